@@ -0,0 +1,95 @@
+#!/usr/bin/env python2
+'''
+Run the workloads in this directory under fluxcapacitor and print one
+JSON object per workload on stdout:
+
+  name            workload and its arguments
+  wall_s          real time the run took
+  virtual_s       time the workload saw passing
+  stops_per_s     ptrace stops handled per second of real time
+  tracer_cpu_s    cpu time used by fluxcapacitor itself
+  native_wall_s   real time without fluxcapacitor (cheap workloads only)
+  overhead_ns_op  extra real time per operation, with native_wall_s
+  error           set if the run failed, other fields are missing
+
+Usage: FCPATH=$PWD/fluxcapacitor python2 bench/bench.py [name ...]
+'''
+
+import json
+import os
+import subprocess
+import sys
+import tempfile
+import time
+
+BENCH_DIR = os.path.dirname(os.path.abspath(__file__))
+
+# (name, arguments, operations, run natively too)
+WORKLOADS = [
+    ('syscall_storm', [100000], 100000, True),
+    ('clock_storm', [1000000], 1000000, True),
+    ('timer_tick', [1000], 1000, False),
+    ('timers', [10, 100], 1000, False),
+    ('sleepers', [10000], 10000, False),
+    ('fork_exec', [100], 100, False),
+    ('ping_pong', [1000], 1000, False),
+]
+
+
+def run(cmd):
+    t0 = time.time()
+    rc = subprocess.call(cmd)
+    td = time.time() - t0
+    if rc != 0:
+        raise Exception("%r exited with %i" % (cmd, rc))
+    return td
+
+
+def bench(fcpath, name, args, ops, native):
+    cmd = [os.path.join(BENCH_DIR, name)] + [str(a) for a in args]
+    (fd, stats_file) = tempfile.mkstemp(suffix=".json")
+    os.close(fd)
+    try:
+        wall = run(fcpath.split() + ['--stats=%s' % (stats_file,), '--']
+                   + cmd)
+        stats = json.load(open(stats_file))
+    finally:
+        os.unlink(stats_file)
+
+    real_s = stats['real_ns'] / 1e9
+    result = {
+        'name': ' '.join([name] + [str(a) for a in args]),
+        'wall_s': round(wall, 4),
+        'virtual_s': round(stats['virtual_ns'] / 1e9, 4),
+        'stops_per_s': int(stats['stop_ns']['count'] / real_s)
+                       if real_s else 0,
+        'tracer_cpu_s': round(stats['tracer_cpu_ns'] / 1e9, 4),
+    }
+    if native:
+        native_wall = run(cmd)
+        result['native_wall_s'] = round(native_wall, 4)
+        result['overhead_ns_op'] = int((wall - native_wall) * 1e9 / ops)
+    return result
+
+
+def main(names):
+    fcpath = os.getenv('FCPATH', None)
+    assert fcpath is not None, "Set FCPATH environment variable first!"
+
+    failed = 0
+    for (name, args, ops, native) in WORKLOADS:
+        if names and name not in names:
+            continue
+        try:
+            result = bench(fcpath, name, args, ops, native)
+        except Exception as e:
+            result = {'name': ' '.join([name] + [str(a) for a in args]),
+                      'error': str(e)}
+            failed += 1
+        print(json.dumps(result, sort_keys=True))
+        sys.stdout.flush()
+    return 1 if failed else 0
+
+
+if __name__ == '__main__':
+    sys.exit(main(sys.argv[1:]))
@@ -0,0 +1,12 @@
+/* Overhead of asking for the time, which goes through the preload
+ * library. */
+#include <stdlib.h>
+#include <time.h>
+
+int main(int argc, char **argv) {
+	long i, n = argc > 1 ? atol(argv[1]) : 1000000;
+	struct timespec ts;
+	for (i = 0; i < n; i++)
+		clock_gettime(CLOCK_REALTIME, &ts);
+	return 0;
+}
@@ -0,0 +1,27 @@
+/* Like examples/sleep_sort.sh: fork and exec a process per number,
+ * each sleeps for a while. */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+int main(int argc, char **argv) {
+	if (argc > 2 && strcmp(argv[1], "child") == 0) {
+		poll(NULL, 0, atoi(argv[2]));
+		return 0;
+	}
+
+	int i, n = argc > 1 ? atoi(argv[1]) : 100;
+	for (i = 0; i < n; i++) {
+		if (fork() == 0) {
+			char ms[32];
+			snprintf(ms, sizeof(ms), "%i", (i * 37) % 1000 * 10);
+			execl("/proc/self/exe", argv[0], "child", ms, NULL);
+			_exit(127);
+		}
+	}
+	while (wait(NULL) > 0);
+	return 0;
+}
@@ -0,0 +1,58 @@
+/* Client and server over loopback TCP, like examples/slowecho: the
+ * server waits a bit before echoing every message. */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <poll.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+
+int main(int argc, char **argv) {
+	long i, n = argc > 1 ? atol(argv[1]) : 1000;
+
+	int sd = socket(AF_INET, SOCK_STREAM, 0);
+	struct sockaddr_in sin;
+	memset(&sin, 0, sizeof(sin));
+	sin.sin_family = AF_INET;
+	sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	socklen_t sin_len = sizeof(sin);
+	if (bind(sd, (struct sockaddr *)&sin, sizeof(sin)) ||
+	    listen(sd, 1) ||
+	    getsockname(sd, (struct sockaddr *)&sin, &sin_len)) {
+		perror("server socket");
+		return 1;
+	}
+
+	char buf[64];
+	if (fork() == 0) {
+		int cd = accept(sd, NULL, NULL);
+		while (read(cd, buf, sizeof(buf)) > 0) {
+			poll(NULL, 0, 20);
+			if (write(cd, buf, 1) != 1)
+				break;
+		}
+		_exit(0);
+	}
+	close(sd);
+
+	int cd = socket(AF_INET, SOCK_STREAM, 0);
+	if (connect(cd, (struct sockaddr *)&sin, sizeof(sin))) {
+		perror("connect()");
+		return 1;
+	}
+	for (i = 0; i < n; i++) {
+		struct pollfd pfd = {cd, POLLIN, 0};
+		if (write(cd, "x", 1) != 1 ||
+		    poll(&pfd, 1, 1000) != 1 ||
+		    read(cd, buf, sizeof(buf)) != 1) {
+			fprintf(stderr, "ping %li failed\n", i);
+			return 1;
+		}
+	}
+	close(cd);
+	wait(NULL);
+	return 0;
+}
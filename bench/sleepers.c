@@ -0,0 +1,28 @@
+/* A big pool of threads, all sleeping at the same time. */
+#include <stdio.h>
+#include <stdlib.h>
+#include <poll.h>
+#include <pthread.h>
+
+static void *sleeper(void *arg) {
+	long i = (long)arg;
+	poll(NULL, 0, 1000 * (1 + i % 10));
+	return NULL;
+}
+
+int main(int argc, char **argv) {
+	long i, n = argc > 1 ? atol(argv[1]) : 10000;
+	pthread_t *threads = malloc(n * sizeof(pthread_t));
+	pthread_attr_t attr;
+	pthread_attr_init(&attr);
+	pthread_attr_setstacksize(&attr, 64 * 1024);
+	for (i = 0; i < n; i++) {
+		if (pthread_create(&threads[i], &attr, sleeper, (void *)i)) {
+			perror("pthread_create()");
+			return 1;
+		}
+	}
+	for (i = 0; i < n; i++)
+		pthread_join(threads[i], NULL);
+	return 0;
+}
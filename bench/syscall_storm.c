@@ -0,0 +1,11 @@
+/* Overhead of a syscall fluxcapacitor doesn't care about. */
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+
+int main(int argc, char **argv) {
+	long i, n = argc > 1 ? atol(argv[1]) : 100000;
+	for (i = 0; i < n; i++)
+		syscall(SYS_getppid);
+	return 0;
+}
@@ -0,0 +1,11 @@
+/* A loop ticking every millisecond. Every tick is too short to be
+ * worth speeding up on its own. */
+#include <stdlib.h>
+#include <poll.h>
+
+int main(int argc, char **argv) {
+	long i, n = argc > 1 ? atol(argv[1]) : 1000;
+	for (i = 0; i < n; i++)
+		poll(NULL, 0, 1);
+	return 0;
+}
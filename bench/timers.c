@@ -0,0 +1,20 @@
+/* N processes, each waiting on M timeouts of different lengths. */
+#include <stdlib.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/wait.h>
+
+int main(int argc, char **argv) {
+	int procs = argc > 1 ? atoi(argv[1]) : 10;
+	int timers = argc > 2 ? atoi(argv[2]) : 100;
+	int p, i;
+	for (p = 0; p < procs; p++) {
+		if (fork() == 0) {
+			for (i = 0; i < timers; i++)
+				poll(NULL, 0, 10 + (p * 7 + i * 13) % 90);
+			_exit(0);
+		}
+	}
+	while (wait(NULL) > 0);
+	return 0;
+}
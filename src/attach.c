@@ -0,0 +1,464 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <elf.h>
+#include <link.h>
+#include <sys/auxv.h>
+
+#include "list.h"
+#include "types.h"
+#include "trace.h"
+#include "fluxcapacitor.h"
+#include "scnums.h"
+
+extern struct options options;
+
+
+/* With --attach we trace processes that are already running. They
+ * were started without the preload library, so their libc reads the
+ * clocks in the vDSO and we never see a syscall. While we're
+ * attached, the entry points of clock_gettime(), gettimeofday() and
+ * time() in their vDSO are a plain syscall instead, which the tracer
+ * fixes up like any other.
+ *
+ * Detaching puts the original code back and the clocks are real
+ * again. We can't keep them ahead without being there: the kernel
+ * would sleep until the real clock reaches a deadline taken on the
+ * virtual one. For the same reason sleeps that are under way expire
+ * when we go. So we only detach while the clocks aren't ahead:
+ * CLOCK_MONOTONIC must not go back. Asked to detach once they are,
+ * we stay, stop speeding up and exit with the processes.
+ *
+ * The vDSO of the tracees is the same image as ours, that's where we
+ * find the entry points and the code to put back. Forked children
+ * inherit the patched vDSO, exec gets a fresh one which we patch
+ * again.
+ *
+ * No thread may be in the middle of an entry point when its code
+ * changes under it. On attach we single-step them out first, on
+ * detach those in a stub are moved to where the original code has
+ * them. */
+
+#if defined(__x86_64__)
+/* mov $nr, %eax; syscall; ret */
+# define STUB_LEN 8
+# define STUB(nr) {0xb8, (nr) & 0xff, ((nr) >> 8) & 0xff, 0, 0,	\
+		0x0f, 0x05, 0xc3}
+
+static struct vdso_entry {
+	const char *name;
+	unsigned char stub[STUB_LEN];
+	/* From the start of the vDSO, 0 if not found. */
+	unsigned long offset;
+	unsigned char code[STUB_LEN];
+} entries[] = {
+	{"__vdso_clock_gettime", STUB(__NR_clock_gettime), 0, {0}},
+	{"__vdso_gettimeofday", STUB(__NR_gettimeofday), 0, {0}},
+	{"__vdso_time", STUB(__NR_time), 0, {0}},
+};
+# define ENTRIES_COUNT (sizeof(entries) / sizeof(entries[0]))
+#endif
+
+static struct {
+	/* The domain of the attached processes. */
+	struct parent *parent;
+	/* Tgids of the processes given to trace_attach(). */
+	int *tgids;
+	int count;
+	int size;
+	/* Processes whose vDSO we put back while detaching, and the
+	 * entry points that were patched. */
+	struct restored {
+		int tgid;
+		unsigned long base;
+		unsigned mask;
+	} *restored;
+	int restored_count;
+	int restored_size;
+	/* Asked to detach, but the clocks are ahead. */
+	int held;
+} attached;
+
+/* Set by SIGINT and SIGTERM, or at --until. */
+static volatile sig_atomic_t detach_asked;
+
+
+#if defined(ENTRIES_COUNT)
+/* Find the entry points in our own vDSO. */
+static int vdso_init() {
+	static int done;
+	if (done)
+		return done > 0;
+	done = -1;
+
+	unsigned long base = getauxval(AT_SYSINFO_EHDR);
+	if (!base)
+		return 0;
+	ElfW(Ehdr) *ehdr = (ElfW(Ehdr) *)base;
+	ElfW(Phdr) *phdr = (ElfW(Phdr) *)(base + ehdr->e_phoff);
+	ElfW(Shdr) *shdr = (ElfW(Shdr) *)(base + ehdr->e_shoff);
+	/* Symbol values are relative to where it was linked. */
+	unsigned long vaddr = 0;
+	int i;
+	for (i = 0; i < ehdr->e_phnum; i++) {
+		if (phdr[i].p_type == PT_LOAD) {
+			vaddr = phdr[i].p_vaddr;
+			break;
+		}
+	}
+
+	for (i = 0; i < ehdr->e_shnum; i++) {
+		if (shdr[i].sh_type != SHT_DYNSYM)
+			continue;
+		ElfW(Sym) *sym = (ElfW(Sym) *)(base + shdr[i].sh_offset);
+		const char *strtab = (const char *)
+			(base + shdr[shdr[i].sh_link].sh_offset);
+		unsigned n, count = shdr[i].sh_size / sizeof(ElfW(Sym));
+		for (n = 0; n < count; n++) {
+			unsigned e;
+			for (e = 0; e < ENTRIES_COUNT; e++) {
+				if (strcmp(strtab + sym[n].st_name,
+					   entries[e].name))
+					continue;
+				entries[e].offset = sym[n].st_value - vaddr;
+				memcpy(entries[e].code,
+				       (void *)(base + entries[e].offset),
+				       STUB_LEN);
+			}
+		}
+	}
+	done = 1;
+	return 1;
+}
+
+/* Where the vDSO of `child` is, 0 if it has none. */
+static unsigned long vdso_base(struct child *child) {
+	int fd = trace_process_open(child->process, "maps");
+	if (fd == -1)
+		return 0;
+	FILE *f = fdopen(fd, "r");
+	unsigned long base = 0;
+	char *line = NULL;
+	size_t line_size = 0;
+	while (getline(&line, &line_size, f) != -1) {
+		if (strstr(line, "[vdso]")) {
+			sscanf(line, "%lx-", &base);
+			break;
+		}
+	}
+	free(line);
+	fclose(f);
+	return base;
+}
+
+/* Put the syscalls in the vDSO at `base` of `child`, or the original
+ * code back. Returns a mask of the entry points that changed. */
+static unsigned vdso_write(struct child *child, unsigned long base,
+			   int patch) {
+	unsigned mask = 0;
+	unsigned e;
+	for (e = 0; e < ENTRIES_COUNT; e++) {
+		struct vdso_entry *entry = &entries[e];
+		if (!entry->offset)
+			continue;
+		unsigned char *from = patch ? entry->code : entry->stub;
+		unsigned char *to = patch ? entry->stub : entry->code;
+		unsigned long addr = base + entry->offset;
+		unsigned long start = addr & ~(sizeof(long) - 1);
+		unsigned char buf[STUB_LEN + sizeof(long)];
+		/* Not the vDSO we know: a 32 bit process, or someone
+		 * else's patch. */
+		if (copy_from_user(child->process, buf, start, sizeof(buf)) ||
+		    memcmp(buf + (addr - start), from, STUB_LEN))
+			continue;
+		memcpy(buf + (addr - start), to, STUB_LEN);
+		if (copy_to_user(child->process, start, buf, sizeof(buf)))
+			continue;
+		mask |= 1 << e;
+	}
+	return mask;
+}
+
+/* Patch the vDSO of `child` once none of its threads is in the code
+ * we replace. Returns 0 if we can't. */
+static int vdso_patch(struct child *child) {
+	if (!vdso_init())
+		return 0;
+	unsigned long base = vdso_base(child);
+	if (!base)
+		return 0;
+
+	unsigned long ranges[2 * ENTRIES_COUNT];
+	int count = 0;
+	unsigned e;
+	for (e = 0; e < ENTRIES_COUNT; e++) {
+		if (!entries[e].offset)
+			continue;
+		ranges[2 * count] = base + entries[e].offset;
+		ranges[2 * count + 1] = base + entries[e].offset + STUB_LEN;
+		count += 1;
+	}
+	if (trace_step_out(child->process, ranges, count))
+		return 0;
+	return vdso_write(child, base, 1) != 0;
+}
+
+/* Where `child` has the patched vDSO of its process. The first thread
+ * to go puts the original code back for all of them. */
+static struct restored *vdso_restore(struct child *child) {
+	int tgid = trace_process_tgid(child->process);
+	int i;
+	for (i = 0; i < attached.restored_count; i++) {
+		if (attached.restored[i].tgid == tgid)
+			return &attached.restored[i];
+	}
+	if (!vdso_init())
+		return NULL;
+	unsigned long base = vdso_base(child);
+	if (!base)
+		return NULL;
+	if (attached.restored_count == attached.restored_size) {
+		attached.restored_size = attached.restored_size ?
+			attached.restored_size * 2 : 16;
+		attached.restored = realloc(attached.restored,
+					    attached.restored_size *
+					    sizeof(struct restored));
+	}
+	struct restored *r = &attached.restored[attached.restored_count++];
+	r->tgid = tgid;
+	r->base = base;
+	/* Nobody runs until we're done with all the threads. */
+	r->mask = vdso_write(child, base, 0);
+	return r;
+}
+
+/* Move `child` out of a stub that's gone: one about to make its
+ * syscall starts the original function over, skipping it, one past
+ * it does the ret. */
+static void vdso_leave(struct child *child, struct trace_sysarg *sysarg,
+		       struct restored *r) {
+	unsigned long ip, sp;
+	if (trace_getpc(child->process, &ip, &sp))
+		return;
+	unsigned e;
+	for (e = 0; e < ENTRIES_COUNT; e++) {
+		unsigned long addr = r->base + entries[e].offset;
+		if (!(r->mask & (1 << e)) || ip < addr ||
+		    ip >= addr + STUB_LEN)
+			continue;
+		if (ip == addr + STUB_LEN - 1 && !sysarg) {
+			unsigned long ret_addr;
+			if (copy_from_user_unaligned(child->process, &ret_addr,
+						     sp, sizeof(ret_addr)))
+				return;
+			trace_setpc(child->process, ret_addr,
+				    sp + sizeof(ret_addr));
+		} else {
+			if (sysarg) {
+				sysarg->number = -1;
+				trace_setregs(child->process, sysarg);
+			}
+			trace_setpc(child->process, addr, sp);
+		}
+		return;
+	}
+}
+
+static void vdso_unpatch(struct child *child, struct trace_sysarg *sysarg) {
+	struct restored *r = vdso_restore(child);
+	if (r && r->mask)
+		vdso_leave(child, sysarg, r);
+}
+#else
+static int vdso_patch(struct child *child) {
+	return 0;
+}
+
+static void vdso_unpatch(struct child *child, struct trace_sysarg *sysarg) {
+}
+#endif
+
+static void on_exit_signal(int signo) {
+	detach_asked = 1;
+}
+
+static int attached_has(int tgid) {
+	int i;
+	for (i = 0; i < attached.count; i++) {
+		if (attached.tgids[i] == tgid)
+			return 1;
+	}
+	return 0;
+}
+
+static int attach_one(struct trace *trace, int pid) {
+	if (trace_attach(trace, pid, attached.parent))
+		return -1;
+	if (attached.count == attached.size) {
+		attached.size = attached.size ? attached.size * 2 : 16;
+		attached.tgids = realloc(attached.tgids,
+					 attached.size * sizeof(int));
+	}
+	attached.tgids[attached.count++] = pid;
+	return 0;
+}
+
+/* Parent pid of `pid`, -1 if gone. */
+static int pid_ppid(int pid) {
+	char path[64], buf[512];
+	snprintf(path, sizeof(path), "/proc/%i/stat", pid);
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd == -1)
+		return -1;
+	int r = read(fd, buf, sizeof(buf) - 1);
+	close(fd);
+	if (r <= 0)
+		return -1;
+	buf[r] = '\0';
+	/* The name may have parentheses of its own. */
+	char *p = strrchr(buf, ')');
+	int ppid;
+	if (!p || sscanf(p + 1, " %*c %i", &ppid) != 1)
+		return -1;
+	return ppid;
+}
+
+/* Attach to the children of the processes we attached to. Returns
+ * how many. */
+static int attach_children(struct trace *trace) {
+	DIR *dir = opendir("/proc");
+	if (!dir)
+		PFATAL("opendir(/proc)");
+	int count = 0;
+	struct dirent *de;
+	while ((de = readdir(dir))) {
+		int pid = atoi(de->d_name);
+		if (pid <= 0 || attached_has(pid) ||
+		    !attached_has(pid_ppid(pid)))
+			continue;
+		/* Forked since we attached, it's ours already. */
+		if (attach_one(trace, pid))
+			continue;
+		count += 1;
+	}
+	closedir(dir);
+	return count;
+}
+
+/* Attach to --attach, in a new domain with id `id`. */
+void attach_start(struct trace *trace, struct list_head *list_of_domains,
+		  int id) {
+	char *none[] = {NULL};
+	struct parent *parent = parent_new(id, argv_split(none, "--", 0));
+	list_add_tail(&parent->in_domains, list_of_domains);
+	attached.parent = parent;
+
+	if (attach_one(trace, options.attach_pid))
+		PFATAL("Can't attach to %i", options.attach_pid);
+	/* Once a process is stopped it can't fork, look again until
+	 * nobody new shows up. */
+	if (options.attach_tree) {
+		while (attach_children(trace))
+			;
+	}
+	SHOUT("[+] Attached to %i process%s", attached.count,
+	      attached.count == 1 ? "" : "es");
+
+	/* Without SA_RESTART, to break out of uevent_select(). */
+	struct sigaction sa;
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = on_exit_signal;
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+}
+
+/* All the threads of `child` are stopped, we just attached to it. */
+void attach_patch(struct child *child) {
+	if (vdso_patch(child))
+		SHOUT("[.] %i reads the clocks through us", child->pid);
+	else
+		SHOUT("[!] %i: can't patch the vDSO, its clocks stay real",
+		      child->pid);
+}
+
+void attach_syscall_exit(struct child *child, struct trace_sysarg *sysarg) {
+	if (!options.attach_pid || sysarg->ret != 0)
+		return;
+	/* A new vDSO, and the only thread left. */
+	if (sysarg->number == __NR_execve
+#ifdef __NR_execveat
+	    || sysarg->number == __NR_execveat
+#endif
+		)
+		attach_patch(child);
+}
+
+/* Detach at the next attach_poll(), if we can. */
+void attach_ask_detach() {
+	detach_asked = 1;
+}
+
+/* Detach if asked to, unless the clocks would go back. */
+void attach_poll() {
+	if (!options.attach_pid || !detach_asked)
+		return;
+	detach_asked = 0;
+	struct parent *parent = attached.parent;
+	if (parent->time_drift <= 0) {
+		options.exit_forced = 1;
+		return;
+	}
+	if (!attached.held)
+		SHOUT("[!] Not detaching, the clocks would go %.3f sec back. "
+		      "Going on at real speed until the process%s exit%s.",
+		      parent->time_drift / 1000000000.,
+		      attached.count == 1 ? "" : "es",
+		      attached.count == 1 ? "s" : "");
+	attached.held = 1;
+}
+
+/* Don't speed up `parent`, we were asked to detach. */
+int attach_held(struct parent *parent) {
+	return attached.held && parent == attached.parent;
+}
+
+/* We're letting `child` go, everyone is stopped. `sysarg` is the
+ * syscall it's entering, if any. */
+void attach_detach(struct child *child, struct trace_sysarg *sysarg) {
+	if (sysarg)
+		wrapper_detach_enter(child, sysarg);
+	vdso_unpatch(child, sysarg);
+	PRINT(" ~  %i detached", child->pid);
+	child_del(child);
+}
+
+/* Let go of everyone still there, they carry on with the real
+ * clocks. Only once attach_poll() says so: they aren't ahead. */
+void attach_stop(struct trace *trace) {
+	if (trace_process_count(trace)) {
+		struct parent *parent = attached.parent;
+		/* Timed syscalls under way expire on their way out. */
+		struct list_head *pos;
+		list_for_each(pos, &parent->list_of_blocked) {
+			struct child *child =
+				hlist_entry(pos, struct child, in_blocked);
+			if (child->blocked_until > 0)
+				child->interrupted = 1;
+		}
+		trace_detach(trace);
+		SHOUT("[-] Detached");
+	}
+	free(attached.tgids);
+	attached.tgids = NULL;
+	attached.count = attached.size = 0;
+	free(attached.restored);
+	attached.restored = NULL;
+	attached.restored_count = attached.restored_size = 0;
+	attached.held = 0;
+}
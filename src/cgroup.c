@@ -0,0 +1,350 @@
+#define _GNU_SOURCE   /* sched_setaffinity() */
+#include <stdio.h>
+#include <stdlib.h>
+#include <limits.h>
+#include <string.h>
+#include <sched.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "types.h"
+#include "list.h"
+
+#include "fluxcapacitor.h"
+
+
+extern struct options options;
+
+
+/* A cgroup v2 directory holding all the traced processes. It lets
+ * tracees run on many cpus at once: instead of polling every process
+ * we look at the cgroup cpu accounting to decide whether anything is
+ * still running. */
+static struct {
+	char path[PATH_MAX];
+	/* With --cpus and without --cgroup: our former cgroup, and the
+	 * one we made to hold both us, in "tracer", and the tracees. */
+	char self[PATH_MAX];
+	char top[PATH_MAX];
+
+	int stat_fd;
+	int pressure_fd;
+	int events_fd;
+
+	u64 usage_usec;
+	u64 pressure_usec;
+
+	int has_cpuset;
+	cpu_set_t cpuset;
+} cgroup = {.stat_fd = -1, .pressure_fd = -1, .events_fd = -1};
+
+
+/* Parse a list like "0-3,8" into a cpu mask. */
+static int str_to_cpuset(const char *s, cpu_set_t *mask) {
+	CPU_ZERO(mask);
+	while (*s) {
+		char *end;
+		long a = strtol(s, &end, 10), b;
+		if (end == s || a < 0)
+			return -1;
+		b = a;
+		if (*end == '-') {
+			s = end + 1;
+			b = strtol(s, &end, 10);
+			if (end == s || b < a)
+				return -1;
+		}
+		for (; a <= b && a < CPU_SETSIZE; a++)
+			CPU_SET(a, mask);
+		if (*end == ',')
+			end++;
+		else if (*end != '\0')
+			return -1;
+		s = end;
+	}
+	return CPU_COUNT(mask) ? 0 : -1;
+}
+
+/* "`dir`/`file`" in `fname`, -1 with ENAMETOOLONG if it doesn't fit. */
+static int cgroup_fname(char *fname, int fname_sz, const char *dir,
+			const char *file) {
+	int r = snprintf(fname, fname_sz, "%s/%s", dir, file);
+	if (r < 0 || r >= fname_sz) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+	return 0;
+}
+
+static int cgroup_write(const char *dir, const char *file, const char *value) {
+	char fname[PATH_MAX];
+	if (cgroup_fname(fname, sizeof(fname), dir, file))
+		return -1;
+	int fd = open(fname, O_WRONLY | O_CLOEXEC);
+	if (fd < 0)
+		return -1;
+	int r = write(fd, value, strlen(value));
+	int saved_errno = errno;
+	close(fd);
+	errno = saved_errno;
+	return r < 0 ? -1 : 0;
+}
+
+static int cgroup_read(const char *dir, const char *file, char *buf, int buf_sz) {
+	char fname[PATH_MAX];
+	if (cgroup_fname(fname, sizeof(fname), dir, file))
+		return -1;
+	int fd = open(fname, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return -1;
+	int r = read(fd, buf, buf_sz - 1);
+	close(fd);
+	if (r < 0)
+		return -1;
+	buf[r] = '\0';
+	return r;
+}
+
+/* Open `file` of our cgroup for reading. */
+static int cgroup_open(const char *file) {
+	char fname[PATH_MAX];
+	if (cgroup_fname(fname, sizeof(fname), cgroup.path, file))
+		return -1;
+	return open(fname, O_RDONLY | O_CLOEXEC);
+}
+
+/* Where is the cgroup2 hierarchy mounted? */
+static void cgroup2_mountpoint(char *buf, int buf_sz) {
+	FILE *f = fopen("/proc/self/mountinfo", "r");
+	if (!f)
+		PFATAL("fopen(/proc/self/mountinfo)");
+
+	char line[1024];
+	buf[0] = '\0';
+	while (fgets(line, sizeof(line), f)) {
+		/* 42 32 0:38 / /sys/fs/cgroup rw,relatime - cgroup2 cgroup2 rw */
+		char *sep = strstr(line, " - cgroup2 ");
+		if (!sep)
+			continue;
+		char mnt[1024];
+		if (sscanf(line, "%*s %*s %*s %*s %1023s", mnt) == 1) {
+			if (snprintf(buf, buf_sz, "%s", mnt) >= buf_sz)
+				FATAL("cgroup2 mountpoint too long: %s", mnt);
+			break;
+		}
+	}
+	fclose(f);
+	if (!buf[0])
+		FATAL("Can't find a cgroup2 filesystem. Is cgroup v2 mounted?");
+}
+
+/* Our own cgroup2 path, relative to the mountpoint. */
+static void cgroup2_self(char *buf, int buf_sz) {
+	FILE *f = fopen("/proc/self/cgroup", "r");
+	if (!f)
+		PFATAL("fopen(/proc/self/cgroup)");
+
+	char line[1024];
+	buf[0] = '\0';
+	while (fgets(line, sizeof(line), f)) {
+		if (strncmp(line, "0::", 3) == 0) {
+			line[strcspn(line, "\n")] = '\0';
+			if (snprintf(buf, buf_sz, "%s", &line[3]) >= buf_sz)
+				FATAL("cgroup path too long: %s", &line[3]);
+			break;
+		}
+	}
+	fclose(f);
+}
+
+static u64 read_key(int fd, const char *key) {
+	char buf[1024];
+	int r = pread(fd, buf, sizeof(buf) - 1, 0);
+	if (r < 0)
+		PFATAL("pread(): Error while reading cgroup stats");
+	buf[r] = '\0';
+
+	char *p = strstr(buf, key);
+	if (!p)
+		return 0;
+	return strtoull(p + strlen(key), NULL, 10);
+}
+
+
+/* Move the process `pid` to `dir`. */
+static int cgroup_move(const char *dir, int pid) {
+	char buf[32];
+	snprintf(buf, sizeof(buf), "%i", pid);
+	return cgroup_write(dir, "cgroup.procs", buf);
+}
+
+/* Back to our former cgroup, and remove the one we made. */
+static void cgroup_return() {
+	char tracer[PATH_MAX];
+	cgroup_write(cgroup.top, "cgroup.subtree_control", "-cpuset");
+	cgroup_write(cgroup.self, "cgroup.subtree_control", "-cpuset");
+	if (cgroup_move(cgroup.self, getpid()))
+		SHOUT("[ ] Can't move back to %s: %s", cgroup.self,
+		      strerror(errno));
+	if (cgroup_fname(tracer, sizeof(tracer), cgroup.top, "tracer") == 0)
+		rmdir(tracer);
+	if (rmdir(cgroup.top))
+		SHOUT("[ ] Can't remove %s: %s", cgroup.top, strerror(errno));
+	cgroup.top[0] = '\0';
+}
+
+/* A cgroup other than the root can't have processes and give
+ * controllers to its children. We leave `self` for a leaf of a new
+ * cgroup, so that the cpuset controller can be enabled in `self`. */
+static void cgroup_leave(const char *self) {
+	char tracer[PATH_MAX];
+	if (snprintf(cgroup.self, sizeof(cgroup.self), "%s", self) >=
+	    (int)sizeof(cgroup.self) ||
+	    snprintf(cgroup.top, sizeof(cgroup.top), "%s/fluxcapacitor.%i",
+		     self, getpid()) >= (int)sizeof(cgroup.top) ||
+	    cgroup_fname(tracer, sizeof(tracer), cgroup.top, "tracer"))
+		FATAL("cgroup path too long: %s", self);
+	if (mkdir(cgroup.top, 0755) && errno != EEXIST)
+		PFATAL("mkdir(%s)", cgroup.top);
+	if (mkdir(tracer, 0755) && errno != EEXIST)
+		PFATAL("mkdir(%s)", tracer);
+	if (cgroup_move(tracer, getpid()))
+		PFATAL("Can't move to %s", tracer);
+
+	if (cgroup_write(self, "cgroup.subtree_control", "+cpuset")) {
+		int saved_errno = errno;
+		cgroup_return();
+		errno = saved_errno;
+		PFATAL("Can't enable cpuset controller in %s.\n"
+		       "\tIt needs the controller available and no other "
+		       "processes. Use --cgroup to point to a delegated "
+		       "cgroup with the cpuset controller enabled", self);
+	}
+}
+
+/* Create a cgroup for tracees under `parent_dir` (by default: our
+ * own cgroup). If `cpus` is given, restrict it to that cpu list. */
+void cgroup_init(const char *parent_dir, const char *cpus) {
+	char base[PATH_MAX];
+	int r, is_root = 0;
+	if (parent_dir) {
+		r = snprintf(base, sizeof(base), "%s", parent_dir);
+	} else {
+		char mnt[PATH_MAX/2], self[PATH_MAX/2];
+		cgroup2_mountpoint(mnt, sizeof(mnt));
+		cgroup2_self(self, sizeof(self));
+		is_root = strcmp(self, "/") == 0;
+		r = snprintf(base, sizeof(base), "%s%s", mnt,
+			     is_root ? "" : self);
+	}
+	if (r >= (int)sizeof(base))
+		FATAL("cgroup path too long: %s", base);
+
+	if (cpus && !parent_dir && !is_root) {
+		cgroup_leave(base);
+		snprintf(base, sizeof(base), "%s", cgroup.top);
+	}
+
+	if (cpus) {
+		if (str_to_cpuset(cpus, &cgroup.cpuset))
+			FATAL("Can't parse cpu list \"%s\"", cpus);
+		cgroup.has_cpuset = 1;
+
+		char buf[1024];
+		if (cgroup_read(base, "cgroup.subtree_control", buf, sizeof(buf)) < 0)
+			PFATAL("Can't read %s/cgroup.subtree_control", base);
+		if (!strstr(buf, "cpuset") &&
+		    cgroup_write(base, "cgroup.subtree_control", "+cpuset")) {
+			PFATAL("Can't enable cpuset controller in %s.\n"
+			       "\tUse --cgroup to point to a delegated cgroup "
+			       "with the cpuset controller enabled", base);
+		}
+	}
+
+	if (cgroup.top[0])
+		r = snprintf(cgroup.path, sizeof(cgroup.path), "%s/tracees",
+			     base);
+	else
+		r = snprintf(cgroup.path, sizeof(cgroup.path),
+			     "%s/fluxcapacitor.%i", base, getpid());
+	if (r >= (int)sizeof(cgroup.path))
+		FATAL("cgroup path too long: %s", base);
+	if (mkdir(cgroup.path, 0755) && errno != EEXIST)
+		PFATAL("mkdir(%s)", cgroup.path);
+
+	if (cpus && cgroup_write(cgroup.path, "cpuset.cpus", cpus))
+		PFATAL("Can't set cpuset.cpus=%s in %s", cpus, cgroup.path);
+
+	cgroup.stat_fd = cgroup_open("cpu.stat");
+	if (cgroup.stat_fd < 0)
+		PFATAL("open(%s/cpu.stat)", cgroup.path);
+
+	/* Pressure stall information is optional. */
+	cgroup.pressure_fd = cgroup_open("cpu.pressure");
+
+	cgroup.events_fd = cgroup_open("cgroup.events");
+	if (cgroup.events_fd < 0)
+		PFATAL("open(%s/cgroup.events)", cgroup.path);
+
+	SHOUT("[.] cgroup %s%s%s", cgroup.path,
+	      cpus ? " cpus=" : "", cpus ? cpus : "");
+}
+
+/* Move a freshly started process into our cgroup. Must be run before
+ * it executes, descendants will inherit it. */
+void cgroup_attach(int pid) {
+	if (cgroup_move(cgroup.path, pid))
+		PFATAL("Can't move %i to %s", pid, cgroup.path);
+
+	/* The affinity is inherited from us and we may be pinned to
+	 * a single cpu. */
+	if (cgroup.has_cpuset &&
+	    sched_setaffinity(pid, sizeof(cpu_set_t), &cgroup.cpuset))
+		PFATAL("sched_setaffinity(%i)", pid);
+}
+
+/* Did anything in the cgroup use, or wait for, a cpu since the last
+ * call? */
+int cgroup_busy() {
+	u64 usage = read_key(cgroup.stat_fd, "usage_usec ");
+	u64 pressure = 0;
+	if (cgroup.pressure_fd != -1)
+		pressure = read_key(cgroup.pressure_fd, "total=");
+
+	int busy = usage != cgroup.usage_usec ||
+		pressure != cgroup.pressure_usec;
+	cgroup.usage_usec = usage;
+	cgroup.pressure_usec = pressure;
+	return busy;
+}
+
+/* Ask the kernel to (un)freeze all the tracees. Freezing is not
+ * instant, see `cgroup_frozen`. */
+void cgroup_freeze(int frozen) {
+	if (cgroup_write(cgroup.path, "cgroup.freeze", frozen ? "1" : "0"))
+		PFATAL("Can't write cgroup.freeze in %s", cgroup.path);
+}
+
+/* Are all the tracees frozen? Processes stopped by ptrace count as
+ * frozen too. */
+int cgroup_frozen() {
+	return read_key(cgroup.events_fd, "frozen ") == 1;
+}
+
+void cgroup_free() {
+	if (cgroup.stat_fd == -1)
+		return;
+	close(cgroup.stat_fd);
+	close(cgroup.events_fd);
+	if (cgroup.pressure_fd != -1)
+		close(cgroup.pressure_fd);
+	cgroup.stat_fd = cgroup.pressure_fd = cgroup.events_fd = -1;
+
+	if (rmdir(cgroup.path))
+		SHOUT("[ ] Can't remove %s: %s", cgroup.path, strerror(errno));
+	if (cgroup.top[0])
+		cgroup_return();
+}
@@ -0,0 +1,316 @@
+#define _GNU_SOURCE   /* accept4() */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <stdarg.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "types.h"
+#include "list.h"
+
+#include "fluxcapacitor.h"
+#include "uevent.h"
+
+
+extern struct options options;
+
+
+/* Drive the clock from outside. A client sends one command per line
+ * and gets a single line of JSON back for each:
+ *
+ *     pause              stop advancing the clock
+ *     resume             advance whenever everyone is blocked again
+ *     step               advance once, to the next deadline, and pause
+ *     advance DURATION   advance by DURATION, crossing deadlines on
+ *                        the way, and pause
+ *     max-jump DURATION  never advance by more than DURATION in one
+ *                        go, 0 for no limit
+ *     status             virtual time of every domain, and what its
+ *                        commands are blocked on
+ *
+ * The reply to "step" and "advance" comes once every domain got
+ * there, so a client can do something at a precise virtual time. A
+ * "step" fails if a domain has no deadline to step to. */
+
+#define CONTROL_LINE 256
+
+struct control_client {
+	struct list_head in_clients;
+	int cd;
+	int waiting;
+	char buf[CONTROL_LINE];
+	int len;
+};
+
+static struct {
+	char *path;
+	int sd;
+
+	struct uevent *uevent;
+	struct list_head *list_of_domains;
+	struct list_head list_of_clients;
+
+	int paused;
+	u64 max_jump_ns;
+	/* A domain had nowhere to step to. */
+	int stuck;
+} control = {.sd = -1};
+
+
+static flux_time domain_now(struct parent *parent) {
+	return (flux_time)TIMESPEC_NSEC(&uevent_now) + parent->time_drift;
+}
+
+static void reply(struct control_client *client, const char *fmt, ...)
+	__attribute__ ((format (printf, 2, 3)));
+static void reply(struct control_client *client, const char *fmt, ...) {
+	char *buf = NULL;
+	size_t len = 0;
+	FILE *f = open_memstream(&buf, &len);
+	va_list ap;
+	va_start(ap, fmt);
+	vfprintf(f, fmt, ap);
+	va_end(ap);
+	fputc('\n', f);
+	fclose(f);
+	if (send(client->cd, buf, len, MSG_DONTWAIT | MSG_NOSIGNAL) !=
+	    (ssize_t)len)
+		SHOUT("[ ] Can't reply on the control socket: %s",
+		      strerror(errno));
+	free(buf);
+}
+
+static void reply_status(struct control_client *client) {
+	char *buf = NULL;
+	size_t len = 0;
+	FILE *f = open_memstream(&buf, &len);
+	fprintf(f, "{\"paused\": %s, \"max_jump_ns\": %llu, \"domains\": [",
+		control.paused ? "true" : "false",
+		(unsigned long long)control.max_jump_ns);
+
+	struct list_head *dpos, *pos;
+	int first_domain = 1;
+	list_for_each(dpos, control.list_of_domains) {
+		struct parent *parent =
+			hlist_entry(dpos, struct parent, in_domains);
+		fprintf(f, "%s{\"id\": %i, \"virtual_ns\": %lli, "
+			"\"drift_ns\": %lli, \"children\": [",
+			first_domain ? "" : ", ", parent->id,
+			(long long)domain_now(parent),
+			(long long)parent->time_drift);
+		first_domain = 0;
+
+		int first = 1;
+		list_for_each(pos, &parent->list_of_children) {
+			struct child *child =
+				hlist_entry(pos, struct child, in_children);
+			fprintf(f, "%s{\"pid\": %i, \"blocked\": %s",
+				first ? "" : ", ", child->pid,
+				child->blocked ? "true" : "false");
+			if (child->blocked && child->timed)
+				fprintf(f, ", \"syscall\": \"%s\"",
+					syscall_to_str(child->syscall_no));
+			/* Unknown and forever are negative. */
+			if (child->blocked && child->timed)
+				fprintf(f, ", \"blocked_until_ns\": %lli",
+					(long long)child->blocked_until);
+			fprintf(f, "}");
+			first = 0;
+		}
+		fprintf(f, "]}");
+	}
+	fprintf(f, "]}");
+	fclose(f);
+	reply(client, "%s", buf);
+	free(buf);
+}
+
+static void command(struct control_client *client, char *line) {
+	char *arg = strchr(line, ' ');
+	if (arg)
+		*arg++ = '\0';
+	u64 ns = 0;
+	if (arg && str_to_time(arg, &ns)) {
+		reply(client, "{\"error\": \"bad duration\"}");
+		return;
+	}
+
+	struct list_head *pos;
+	if (0 == strcmp(line, "pause")) {
+		control.paused = 1;
+	} else if (0 == strcmp(line, "resume")) {
+		control.paused = 0;
+		list_for_each(pos, control.list_of_domains) {
+			struct parent *parent =
+				hlist_entry(pos, struct parent, in_domains);
+			parent->control_steps = 0;
+			parent->control_until = 0;
+		}
+	} else if (0 == strcmp(line, "step") ||
+		   (0 == strcmp(line, "advance") && arg)) {
+		control.paused = 1;
+		list_for_each(pos, control.list_of_domains) {
+			struct parent *parent =
+				hlist_entry(pos, struct parent, in_domains);
+			if (arg)
+				parent->control_until = domain_now(parent) + ns;
+			else
+				parent->control_steps = 1;
+		}
+		client->waiting = 1;
+		SHOUT("[ ] Control: %s %s", line, arg ? arg : "");
+		return;
+	} else if (0 == strcmp(line, "max-jump") && arg) {
+		control.max_jump_ns = ns;
+	} else if (0 == strcmp(line, "status")) {
+		reply_status(client);
+		return;
+	} else {
+		reply(client, "{\"error\": \"unknown command\"}");
+		return;
+	}
+	SHOUT("[ ] Control: %s %s", line, arg ? arg : "");
+	reply(client, "{\"ok\": true}");
+}
+
+static void client_free(struct control_client *client) {
+	uevent_clear(control.uevent, client->cd);
+	close(client->cd);
+	list_del(&client->in_clients);
+	free(client);
+}
+
+/* Run the commands received so far, until one has to wait. */
+static void client_run(struct control_client *client) {
+	char *nl;
+	while (!client->waiting &&
+	       (nl = memchr(client->buf, '\n', client->len))) {
+		*nl = '\0';
+		if (nl > client->buf && nl[-1] == '\r')
+			nl[-1] = '\0';
+		command(client, client->buf);
+		client->len -= nl + 1 - client->buf;
+		memmove(client->buf, nl + 1, client->len);
+	}
+}
+
+static int on_client(struct uevent *uevent, int cd, int mask, void *userdata) {
+	struct control_client *client = userdata;
+	if (client->len == sizeof(client->buf)) {
+		reply(client, "{\"error\": \"line too long\"}");
+		client_free(client);
+		return 0;
+	}
+	int r = recv(cd, client->buf + client->len,
+		     sizeof(client->buf) - client->len, MSG_DONTWAIT);
+	if (r <= 0) {
+		if (r < 0 && (errno == EAGAIN || errno == EINTR))
+			return 0;
+		client_free(client);
+		return 0;
+	}
+	client->len += r;
+	client_run(client);
+	return 0;
+}
+
+static int on_control_accept(struct uevent *uevent, int sd, int mask,
+			     void *userdata) {
+	int cd = accept4(sd, NULL, NULL, SOCK_CLOEXEC);
+	if (cd < 0) {
+		SHOUT("[ ] accept(): %s", strerror(errno));
+		return 0;
+	}
+	struct control_client *client =
+		calloc(1, sizeof(struct control_client));
+	client->cd = cd;
+	list_add_tail(&client->in_clients, &control.list_of_clients);
+	uevent_yield(uevent, cd, UEVENT_READ, on_client, client);
+	return 0;
+}
+
+/* Accept control connections on a unix socket at `path`. */
+void control_listen(const char *path, struct uevent *uevent,
+		    struct list_head *list_of_domains) {
+	control.path = strdup(path);
+	control.uevent = uevent;
+	control.list_of_domains = list_of_domains;
+	INIT_LIST_HEAD(&control.list_of_clients);
+	control.sd = unix_listen(path, SOCK_STREAM);
+	uevent_yield(uevent, control.sd, UEVENT_READ, on_control_accept, NULL);
+	SHOUT("[.] Control on %s", path);
+}
+
+/* May the clock of `parent` move now? */
+int control_may_advance(struct parent *parent) {
+	return !control.paused || parent->control_steps ||
+		parent->control_until;
+}
+
+/* Largest single jump allowed, 0 for any. */
+u64 control_max_jump() {
+	return control.max_jump_ns;
+}
+
+/* The clock of `parent` moved. */
+void control_advanced(struct parent *parent) {
+	if (parent->control_steps)
+		parent->control_steps -= 1;
+	if (parent->control_until && domain_now(parent) >= parent->control_until)
+		parent->control_until = 0;
+}
+
+/* Nothing in `parent` has a deadline, a "step" can't go anywhere. */
+void control_stuck(struct parent *parent) {
+	if (!parent->control_steps)
+		return;
+	parent->control_steps = 0;
+	control.stuck = 1;
+}
+
+/* Answer the clients waiting for every domain to finish a "step" or
+ * an "advance". Call it once in a while. */
+void control_poll() {
+	if (control.sd == -1)
+		return;
+
+	struct list_head *pos, *tmp;
+	list_for_each(pos, control.list_of_domains) {
+		struct parent *parent =
+			hlist_entry(pos, struct parent, in_domains);
+		if (parent->control_steps || parent->control_until)
+			return;
+	}
+	list_for_each_safe(pos, tmp, &control.list_of_clients) {
+		struct control_client *client =
+			hlist_entry(pos, struct control_client, in_clients);
+		if (!client->waiting)
+			continue;
+		client->waiting = 0;
+		if (control.stuck)
+			reply(client, "{\"error\": \"nothing to step to\"}");
+		else
+			reply(client, "{\"ok\": true}");
+		/* Commands that came in the meantime. */
+		client_run(client);
+	}
+	control.stuck = 0;
+}
+
+void control_free() {
+	if (control.sd == -1)
+		return;
+	struct list_head *pos, *tmp;
+	list_for_each_safe(pos, tmp, &control.list_of_clients) {
+		client_free(hlist_entry(pos, struct control_client,
+					in_clients));
+	}
+	uevent_clear(control.uevent, control.sd);
+	close(control.sd);
+	control.sd = -1;
+	unlink(control.path);
+	free(control.path);
+}
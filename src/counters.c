@@ -0,0 +1,269 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+#include "types.h"
+#include "list.h"
+
+#include "fluxcapacitor.h"
+
+
+extern struct options options;
+
+
+/* With --stats we count, with perf_event_open(), what the tracer
+ * and the tracees cost. The tracer's counts are split between the
+ * phases it goes through: handling ptrace stops, settling a domain
+ * and moving its clock in domain_step(), and the rest. A stop
+ * handled while settling counts as a stop. Each tracee thread has
+ * counters of its own, summed when it exits.
+ *
+ * The counters of a thread are a group, read with a single read().
+ * The hardware ones are left out when the machine has none, in a VM
+ * for instance, and the kernel is left out if perf_event_paranoid
+ * says so. */
+
+static const struct {
+	const char *name;
+	u32 type;
+	u64 config;
+} events[] = {
+	{"task_clock_ns", PERF_TYPE_SOFTWARE, PERF_COUNT_SW_TASK_CLOCK},
+	{"context_switches", PERF_TYPE_SOFTWARE,
+	 PERF_COUNT_SW_CONTEXT_SWITCHES},
+	{"cpu_migrations", PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CPU_MIGRATIONS},
+	{"cycles", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES},
+	{"instructions", PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS},
+};
+#define EVENTS_COUNT (sizeof(events) / sizeof(events[0]))
+/* The software ones come first and are always there. */
+#define EVENTS_SOFTWARE 3
+
+static const char *phase_names[COUNTERS_PHASES] = {
+	"stop", "settle", "other"};
+
+/* The leader first, the one we read. */
+struct group {
+	int fds[EVENTS_COUNT];
+};
+
+static struct {
+	int enabled;
+	/* How many of events[] we open, 0 if perf_event_open() doesn't
+	 * work at all. */
+	int count;
+	int exclude_kernel;
+
+	struct group self;
+	int phase;
+	u64 last[EVENTS_COUNT];
+	u64 phases[COUNTERS_PHASES][EVENTS_COUNT];
+
+	/* Of the tracees that are gone, and how many had none. */
+	u64 tracees[EVENTS_COUNT];
+	int tracees_missed;
+	/* Of the tracees still there. */
+	struct group *groups;
+	int groups_count;
+	int groups_size;
+} counters = {.phase = COUNTERS_OTHER};
+
+
+static int event_open(int n, int pid, int group_fd) {
+	struct perf_event_attr attr;
+	memset(&attr, 0, sizeof(attr));
+	attr.size = sizeof(attr);
+	attr.type = events[n].type;
+	attr.config = events[n].config;
+	attr.read_format = PERF_FORMAT_GROUP;
+	attr.exclude_kernel = counters.exclude_kernel;
+	attr.exclude_hv = 1;
+	return syscall(__NR_perf_event_open, &attr, pid, -1, group_fd,
+		       PERF_FLAG_FD_CLOEXEC);
+}
+
+/* Open the first `count` events for `pid` in `group`. Returns 0, or
+ * -1 and sets errno. */
+static int group_open(struct group *group, int pid, int count) {
+	int n;
+	for (n = 0; n < count; n++) {
+		group->fds[n] = event_open(n, pid, n ? group->fds[0] : -1);
+		if (group->fds[n] == -1)
+			break;
+	}
+	if (n == count)
+		return 0;
+	int err = errno;
+	while (n--)
+		close(group->fds[n]);
+	errno = err;
+	return -1;
+}
+
+static void group_close(struct group *group) {
+	int n;
+	for (n = 0; n < counters.count; n++)
+		close(group->fds[n]);
+}
+
+/* The counts of the group led by `fd` in `values`, 0 on success. */
+static int group_read(int fd, u64 *values) {
+	u64 buf[1 + EVENTS_COUNT];
+	ssize_t len = sizeof(u64) * (1 + counters.count);
+	if (read(fd, buf, len) != len || buf[0] != (u64)counters.count)
+		return -1;
+	memcpy(values, &buf[1], sizeof(u64) * counters.count);
+	return 0;
+}
+
+void counters_init() {
+	static const int counts[] = {EVENTS_COUNT, EVENTS_SOFTWARE};
+	counters.enabled = 1;
+	/* The most we can have, then with less. */
+	int exclude_kernel, i;
+	for (exclude_kernel = 0; exclude_kernel < 2; exclude_kernel++) {
+		counters.exclude_kernel = exclude_kernel;
+		for (i = 0; i < 2; i++) {
+			if (!group_open(&counters.self, 0, counts[i])) {
+				counters.count = counts[i];
+				group_read(counters.self.fds[0], counters.last);
+				return;
+			}
+		}
+	}
+	SHOUT("[ ] perf_event_open(): %s, no counters", strerror(errno));
+}
+
+/* Move the tracer to `phase`. What it used since the last move goes
+ * to the one it was in, which is returned. */
+int counters_phase(int phase) {
+	int old = counters.phase;
+	if (!counters.count)
+		return old;
+	u64 now[EVENTS_COUNT];
+	if (group_read(counters.self.fds[0], now))
+		return old;
+	int n;
+	for (n = 0; n < counters.count; n++) {
+		counters.phases[old][n] += now[n] - counters.last[n];
+		counters.last[n] = now[n];
+	}
+	counters.phase = phase;
+	return old;
+}
+
+/* Start counting for the tracee `pid`. Returns what to give to
+ * counters_close(), -1 if nothing is counted. */
+int counters_open(int pid) {
+	if (!counters.count)
+		return -1;
+	struct group group;
+	if (group_open(&group, pid, counters.count)) {
+		/* Out of descriptors, most likely. */
+		counters.tracees_missed += 1;
+		return -1;
+	}
+	if (counters.groups_count == counters.groups_size) {
+		counters.groups_size = counters.groups_size ?
+			counters.groups_size * 2 : 64;
+		counters.groups = realloc(counters.groups,
+					  counters.groups_size *
+					  sizeof(struct group));
+	}
+	counters.groups[counters.groups_count++] = group;
+	return group.fds[0];
+}
+
+/* The tracee is gone, its counts are still there. */
+void counters_close(int fd) {
+	int i, n;
+	for (i = 0; fd != -1 && i < counters.groups_count; i++) {
+		struct group *group = &counters.groups[i];
+		if (group->fds[0] != fd)
+			continue;
+		u64 values[EVENTS_COUNT];
+		if (!group_read(fd, values)) {
+			for (n = 0; n < counters.count; n++)
+				counters.tracees[n] += values[n];
+		}
+		group_close(group);
+		*group = counters.groups[--counters.groups_count];
+		break;
+	}
+}
+
+static void values_dump(FILE *f, const char *name, u64 *values) {
+	fprintf(f, "\"%s\": {", name);
+	int n;
+	for (n = 0; n < counters.count; n++)
+		fprintf(f, "%s\"%s\": %llu", n ? ", " : "", events[n].name,
+			(unsigned long long)values[n]);
+	fprintf(f, "}");
+}
+
+/* The "counters" section of the stats, for a run of `real_ns` with
+ * `stops` ptrace stops. */
+void counters_dump(FILE *f, u64 real_ns, u64 stops) {
+	if (!counters.enabled)
+		return;
+	if (!counters.count) {
+		fprintf(f, "  \"counters\": null,\n");
+		return;
+	}
+	/* Up to now, in the phase we're in. */
+	counters_phase(counters.phase);
+
+	u64 tracer[EVENTS_COUNT], tracees[EVENTS_COUNT];
+	int i, n;
+	memset(tracer, 0, sizeof(tracer));
+	for (i = 0; i < COUNTERS_PHASES; i++) {
+		for (n = 0; n < counters.count; n++)
+			tracer[n] += counters.phases[i][n];
+	}
+	memcpy(tracees, counters.tracees, sizeof(tracees));
+	for (i = 0; i < counters.groups_count; i++) {
+		u64 values[EVENTS_COUNT];
+		if (group_read(counters.groups[i].fds[0], values))
+			continue;
+		for (n = 0; n < counters.count; n++)
+			tracees[n] += values[n];
+	}
+
+	fprintf(f, "  \"counters\": {\n");
+	fprintf(f, "    \"tracer\": {");
+	for (i = 0; i < COUNTERS_PHASES; i++) {
+		fprintf(f, "%s\n      ", i ? "," : "");
+		values_dump(f, phase_names[i], counters.phases[i]);
+	}
+	fprintf(f, "},\n    ");
+	values_dump(f, "tracees", tracees);
+	fprintf(f, ",\n");
+	fprintf(f, "    \"tracees_missed\": %i,\n", counters.tracees_missed);
+	/* task_clock_ns is first. */
+	u64 stop_ns = counters.phases[COUNTERS_STOP][0];
+	fprintf(f, "    \"stop_overhead_ns\": %llu,\n",
+		(unsigned long long)(stops ? stop_ns / stops : 0));
+	fprintf(f, "    \"tracer_fraction\": %.4f,\n",
+		real_ns ? (double)tracer[0] / real_ns : 0.);
+	fprintf(f, "    \"tracer_share\": %.4f\n",
+		tracer[0] + tracees[0] ?
+		(double)tracer[0] / (tracer[0] + tracees[0]) : 0.);
+	fprintf(f, "  },\n");
+}
+
+void counters_free() {
+	int i;
+	for (i = 0; i < counters.groups_count; i++)
+		group_close(&counters.groups[i]);
+	free(counters.groups);
+	counters.groups = NULL;
+	counters.groups_count = counters.groups_size = 0;
+	if (counters.count)
+		group_close(&counters.self);
+	counters.count = 0;
+}
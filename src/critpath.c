@@ -0,0 +1,604 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <linux/futex.h>
+
+#include "list.h"
+#include "types.h"
+#include "trace.h"
+#include "fluxcapacitor.h"
+#include "scnums.h"
+
+extern struct options options;
+
+
+/* What made a domain take as long as it did, in virtual time? We
+ * keep, for every tracee, the waits longer than CRITPATH_MIN_WAIT,
+ * and the causes we can see from one tracee to another:
+ *
+ *  - a fork starts the new process,
+ *  - an exit ends the wait4() of the parent,
+ *  - a write, a send, a close, a kill or a futex wake ends the wait
+ *    of another tracee, blocked since before. We don't know what
+ *    descriptors are connected: the last tracee to do any of these
+ *    is taken to be the one who woke us up,
+ *  - a wait that timed out, or that we skipped, took as long as its
+ *    timeout.
+ *
+ * When the domain is done we walk back from the last exit, always
+ * to whatever came last: that's the critical path. Any timeout on
+ * it, made shorter, makes the whole run shorter. The other tracees
+ * get their slack: how much later they could have done what they
+ * did without the domain finishing any later. */
+
+/* Shorter syscalls are taken as running. */
+#define CRITPATH_MIN_WAIT 1000000LL
+
+enum {
+	EV_START,		/* cause: the fork, if any */
+	EV_FORK,
+	EV_WRITE,
+	EV_BLOCK,
+	EV_TIMEOUT,		/* end of a wait, the clock woke us up */
+	EV_WOKEN,		/* end of a wait, cause: who woke us up */
+	EV_UNBLOCK,		/* end of a wait, we don't know why */
+	EV_EXIT
+};
+
+struct event {
+	flux_time t;
+	int proc;
+	int prev;		/* previous event of the tracee, -1 */
+	int cause;		/* event of another tracee, -1 */
+	short kind;
+	short syscall_no;
+};
+
+struct proc {
+	int pid;
+	int nspid;		/* as the tracees see it, see ns.c */
+	int execs;
+	char comm[16];
+	int last;		/* latest event */
+	int exit;		/* EV_EXIT, -1 */
+
+	/* Entry of the current syscall. */
+	flux_time since;
+	/* Last syscall that may have woken someone up, 0 if none,
+	 * and its EV_WRITE once we needed it. */
+	flux_time write_t;
+	int write_syscall_no;
+	int write_event;
+
+	flux_time on_path;
+	flux_time slack;
+};
+
+struct critpath {
+	flux_time start;
+
+	int procs_count;
+	int procs_size;
+	struct proc *procs;
+
+	int events_count;
+	int events_size;
+	struct event *events;
+};
+
+enum {
+	SEG_NOT_STARTED,
+	SEG_RUN,
+	SEG_TIMEOUT,
+	SEG_BLOCKED,
+	SEG_WOKEN
+};
+
+struct segment {
+	flux_time from;
+	flux_time to;
+	int proc;
+	int what;
+	int syscall_no;
+	int cause;
+};
+
+static FILE *report;
+
+
+void critpath_open(const char *path) {
+	report = fopen(path, "w");
+	if (!report)
+		PFATAL("fopen(%s)", path);
+}
+
+void critpath_close() {
+	if (!report)
+		return;
+	fclose(report);
+	report = NULL;
+}
+
+static flux_time virtual_now(struct parent *parent) {
+	/* Not uevent_now, it's behind while we go through the
+	 * tracees. */
+	struct timespec ts;
+	clock_gettime(CLOCK_REALTIME, &ts);
+	return (flux_time)TIMESPEC_NSEC(&ts) + parent->time_drift;
+}
+
+/* Can `sysarg` end the wait of another tracee? */
+static int syscall_wakes(struct trace_sysarg *sysarg) {
+	switch (sysarg->number) {
+	case __NR_write:
+	case __NR_writev:
+	case __NR_pwrite64:
+	case __NR_close:
+	case __NR_kill:
+	case __NR_tgkill:
+	case __NR_sendmmsg:
+#ifdef __NR_sendto
+	case __NR_sendto:
+#endif
+#ifdef __NR_sendmsg
+	case __NR_sendmsg:
+#endif
+#ifdef __NR_connect
+	case __NR_connect:
+#endif
+#ifdef __NR_shutdown
+	case __NR_shutdown:
+#endif
+		return 1;
+	case __NR_futex:
+		return (sysarg->arg2 & FUTEX_CMD_MASK) == FUTEX_WAKE;
+	}
+	return 0;
+}
+
+static int syscall_waits_child(int syscall_no) {
+	switch (syscall_no) {
+	case __NR_wait4:
+#ifdef __NR_waitpid
+	case __NR_waitpid:
+#endif
+		return 1;
+	}
+	return 0;
+}
+
+static void comm_read(struct child *child, struct proc *p) {
+	p->execs = trace_process_execs(child->process);
+	int fd = trace_process_open(child->process, "comm");
+	if (fd == -1)
+		return;
+	int r = read(fd, p->comm, sizeof(p->comm) - 1);
+	close(fd);
+	if (r <= 0)
+		return;
+	p->comm[r] = '\0';
+	p->comm[strcspn(p->comm, "\n")] = '\0';
+}
+
+/* The pid of `child` in its own PID namespace. */
+static int nspid_read(struct child *child) {
+	int fd = trace_process_open(child->process, "status");
+	if (fd == -1)
+		return child->pid;
+	FILE *f = fdopen(fd, "r");
+	char *line = NULL;
+	size_t line_size = 0;
+	int nspid = child->pid;
+	while (getline(&line, &line_size, f) != -1) {
+		if (strncmp(line, "NSpid:", 6))
+			continue;
+		/* The innermost is last. */
+		char *last = strrchr(line, '\t');
+		if (last)
+			nspid = atoi(last + 1);
+		break;
+	}
+	free(line);
+	fclose(f);
+	return nspid;
+}
+
+static void events_grow(struct critpath *cp) {
+	if (cp->events_count < cp->events_size)
+		return;
+	cp->events_size = cp->events_size ? cp->events_size * 2 : 1024;
+	cp->events = realloc(cp->events,
+			     cp->events_size * sizeof(struct event));
+}
+
+static int event_add(struct critpath *cp, int proc, int kind, flux_time t,
+		     int syscall_no, int cause) {
+	events_grow(cp);
+	int e = cp->events_count++;
+	cp->events[e] = (struct event){t, proc, cp->procs[proc].last, cause,
+				       kind, syscall_no};
+	cp->procs[proc].last = e;
+	return e;
+}
+
+/* The EV_WRITE of the last wake up by `proc`. Made the first time
+ * someone needs it, in the past of `proc`. */
+static int write_event(struct critpath *cp, int proc) {
+	struct proc *p = &cp->procs[proc];
+	if (p->write_event != -1)
+		return p->write_event;
+	events_grow(cp);
+	int e = cp->events_count++;
+	int *link = &p->last;
+	while (*link != -1 && cp->events[*link].t >= p->write_t)
+		link = &cp->events[*link].prev;
+	cp->events[e] = (struct event){p->write_t, proc, *link, -1, EV_WRITE,
+				       p->write_syscall_no};
+	*link = e;
+	p->write_event = e;
+	return e;
+}
+
+/* Who ended the wait of `proc` in `syscall_no`, that returned `ret`:
+ * the process it waited for, or the last tracee to possibly wake it
+ * up since it blocked. Returns the event, -1 if nobody did. */
+static int waker(struct critpath *cp, int proc, int syscall_no, long ret) {
+	struct proc *p = &cp->procs[proc];
+	int i;
+	if (syscall_waits_child(syscall_no)) {
+		for (i = cp->procs_count - 1; ret > 0 && i >= 0; i--) {
+			struct proc *q = &cp->procs[i];
+			if (q->nspid != ret || q->exit == -1)
+				continue;
+			if (cp->events[q->exit].t < p->since)
+				break;
+			return q->exit;
+		}
+		return -1;
+	}
+
+	int best = -1;
+	for (i = 0; i < cp->procs_count; i++) {
+		struct proc *q = &cp->procs[i];
+		if (i == proc || !q->write_t || q->write_t < p->since)
+			continue;
+		if (best == -1 || q->write_t > cp->procs[best].write_t)
+			best = i;
+	}
+	return best == -1 ? -1 : write_event(cp, best);
+}
+
+/* Start recording the domain of `parent`. */
+void critpath_domain(struct parent *parent) {
+	if (!report)
+		return;
+	parent->critpath = calloc(1, sizeof(struct critpath));
+	parent->critpath->start = virtual_now(parent);
+}
+
+/* `child` just started, forked by `forker` or by us if NULL. */
+void critpath_child(struct child *child, struct child *forker) {
+	struct critpath *cp = child->parent->critpath;
+	if (!cp)
+		return;
+	if (cp->procs_count == cp->procs_size) {
+		cp->procs_size = cp->procs_size ? cp->procs_size * 2 : 16;
+		cp->procs = realloc(cp->procs,
+				    cp->procs_size * sizeof(struct proc));
+	}
+	int proc = cp->procs_count++;
+	struct proc *p = &cp->procs[proc];
+	memset(p, 0, sizeof(struct proc));
+	p->pid = child->pid;
+	p->nspid = options.unshare ? nspid_read(child) : child->pid;
+	p->last = -1;
+	p->exit = -1;
+	p->write_event = -1;
+	strcpy(p->comm, "?");
+	comm_read(child, p);
+	child->critpath = proc;
+
+	flux_time now = virtual_now(child->parent);
+	int cause = -1;
+	if (forker)
+		cause = event_add(cp, forker->critpath, EV_FORK, now, 0, -1);
+	event_add(cp, proc, EV_START, now, 0, cause);
+}
+
+void critpath_syscall_enter(struct child *child, struct trace_sysarg *sysarg) {
+	struct critpath *cp = child->parent->critpath;
+	/* A restarted syscall is the same wait. */
+	if (!cp || child->restarting)
+		return;
+	struct proc *p = &cp->procs[child->critpath];
+	p->since = virtual_now(child->parent);
+	if (syscall_wakes(sysarg)) {
+		p->write_t = p->since;
+		p->write_syscall_no = sysarg->number;
+		p->write_event = -1;
+	}
+}
+
+/* Record the syscall as a wait if it was one. Call it before the
+ * result is rewritten. */
+void critpath_syscall_exit(struct child *child, struct trace_sysarg *sysarg) {
+	struct critpath *cp = child->parent->critpath;
+	if (!cp)
+		return;
+	int proc = child->critpath;
+	struct proc *p = &cp->procs[proc];
+	if (p->execs != trace_process_execs(child->process))
+		comm_read(child, p);
+
+	/* The number as it was entered, the skipped ones are -1 by
+	 * now. */
+	int syscall_no = child->blocked_sysarg ?
+		child->blocked_sysarg->number : sysarg->number;
+	flux_time now = virtual_now(child->parent);
+	/* Woken up by us, or by the freezer past its deadline. Other
+	 * signals don't count. */
+	int advanced = child->timed &&
+		(child->skipped || child->interrupted ||
+		 (wrapper_interrupted(sysarg) && child->blocked_until > 0 &&
+		  child->blocked_until <= now));
+	if (!advanced && now - p->since < CRITPATH_MIN_WAIT)
+		return;
+
+	int kind = EV_UNBLOCK, cause = -1;
+	if (advanced || (child->timed && sysarg->ret == 0))
+		kind = EV_TIMEOUT;
+	else if ((cause = waker(cp, proc, syscall_no, sysarg->ret)) != -1)
+		kind = EV_WOKEN;
+	event_add(cp, proc, EV_BLOCK, p->since, syscall_no, -1);
+	event_add(cp, proc, kind, now, syscall_no, cause);
+}
+
+void critpath_exit(struct child *child) {
+	struct critpath *cp = child->parent->critpath;
+	if (!cp)
+		return;
+	struct proc *p = &cp->procs[child->critpath];
+	/* Changed by an exec in another thread. */
+	if (p->pid != child->pid) {
+		p->pid = child->pid;
+		p->nspid = options.unshare ? nspid_read(child) : child->pid;
+	}
+	p->exit = event_add(cp, child->critpath, EV_EXIT,
+			    virtual_now(child->parent), 0, -1);
+}
+
+
+/* Walk back from `end`, to whatever came last each time. Returns the
+ * segments in order, in `*segments_ptr`. */
+static int critical_path(struct critpath *cp, int end,
+			 struct segment **segments_ptr) {
+	int count = 0, size = 0;
+	struct segment *segments = NULL;
+	int e = end;
+	while (e != -1) {
+		struct event *ev = &cp->events[e];
+		struct event *prev = ev->prev != -1 ?
+			&cp->events[ev->prev] : NULL;
+		struct segment s = {prev ? prev->t : ev->t, ev->t, ev->proc,
+				    SEG_RUN, ev->syscall_no, ev->cause};
+		int next = ev->prev;
+		switch (ev->kind) {
+		case EV_START:
+			if (ev->cause == -1) {
+				s.from = cp->start;
+				s.what = SEG_NOT_STARTED;
+			} else {
+				s.from = cp->events[ev->cause].t;
+			}
+			next = ev->cause;
+			break;
+		case EV_TIMEOUT:
+			s.what = SEG_TIMEOUT;
+			break;
+		case EV_UNBLOCK:
+			s.what = SEG_BLOCKED;
+			break;
+		case EV_WOKEN:
+			s.from = cp->events[ev->cause].t;
+			s.what = SEG_WOKEN;
+			next = ev->cause;
+			break;
+		}
+		e = next;
+
+		/* Running is running, whatever we saw on the way. */
+		if (count && s.what == SEG_RUN &&
+		    segments[count - 1].what == SEG_RUN &&
+		    segments[count - 1].proc == s.proc) {
+			segments[count - 1].from = s.from;
+			continue;
+		}
+		if (count == size) {
+			size = size ? size * 2 : 64;
+			segments = realloc(segments,
+					   size * sizeof(struct segment));
+		}
+		segments[count++] = s;
+	}
+
+	int i;
+	for (i = 0; i < count / 2; i++) {
+		struct segment s = segments[i];
+		segments[i] = segments[count - 1 - i];
+		segments[count - 1 - i] = s;
+	}
+	*segments_ptr = segments;
+	return count;
+}
+
+static struct event *sort_events;
+
+static int by_time_desc(const void *a, const void *b) {
+	flux_time ta = sort_events[*(int *)a].t, tb = sort_events[*(int *)b].t;
+	return ta < tb ? 1 : ta > tb ? -1 : *(int *)b - *(int *)a;
+}
+
+/* The latest each event could have happened without the domain
+ * ending after `end_t`. The events before a wake up by someone else
+ * could be as late as the wake up itself. */
+static void slack(struct critpath *cp, flux_time end_t) {
+	int n = cp->events_count, i;
+	flux_time *latest = malloc(n * sizeof(flux_time));
+	int *order = malloc(n * sizeof(int));
+	for (i = 0; i < n; i++) {
+		latest[i] = end_t;
+		order[i] = i;
+	}
+	sort_events = cp->events;
+	qsort(order, n, sizeof(int), by_time_desc);
+
+	/* Once, unless events at the same instant came out of
+	 * order. */
+	int changed = 1, pass;
+	for (pass = 0; changed && pass < 8; pass++) {
+		changed = 0;
+		for (i = 0; i < n; i++) {
+			struct event *ev = &cp->events[order[i]];
+			flux_time l = latest[order[i]];
+			if (ev->prev != -1) {
+				flux_time w = ev->kind == EV_WOKEN ? 0 :
+					ev->t - cp->events[ev->prev].t;
+				if (l - w < latest[ev->prev]) {
+					latest[ev->prev] = l - w;
+					changed = 1;
+				}
+			}
+			if (ev->cause != -1) {
+				flux_time w = ev->t - cp->events[ev->cause].t;
+				if (l - w < latest[ev->cause]) {
+					latest[ev->cause] = l - w;
+					changed = 1;
+				}
+			}
+		}
+	}
+
+	for (i = 0; i < cp->procs_count; i++)
+		cp->procs[i].slack = end_t - cp->start;
+	for (i = 0; i < n; i++) {
+		struct proc *p = &cp->procs[cp->events[i].proc];
+		p->slack = MIN(p->slack, latest[i] - cp->events[i].t);
+	}
+	free(order);
+	free(latest);
+}
+
+static void print_segment(struct critpath *cp, struct segment *s) {
+	struct proc *p = &cp->procs[s->proc];
+	fprintf(report, "  %10.3f %10.3f %7i  %-16s ",
+		(s->from - cp->start) / 1000000000.,
+		(s->to - s->from) / 1000000000., p->pid, p->comm);
+	switch (s->what) {
+	case SEG_NOT_STARTED:
+		fprintf(report, "not started yet\n");
+		break;
+	case SEG_RUN:
+		fprintf(report, "running\n");
+		break;
+	case SEG_TIMEOUT:
+		fprintf(report, "%s() timed out\n",
+			syscall_to_str(s->syscall_no));
+		break;
+	case SEG_BLOCKED:
+		fprintf(report, "blocked in %s()\n",
+			syscall_to_str(s->syscall_no));
+		break;
+	case SEG_WOKEN: {
+		struct event *cause = &cp->events[s->cause];
+		struct proc *q = &cp->procs[cause->proc];
+		if (cause->kind == EV_EXIT)
+			fprintf(report, "%s() woken by %i exiting\n",
+				syscall_to_str(s->syscall_no), q->pid);
+		else
+			fprintf(report, "%s() woken by %i %s()\n",
+				syscall_to_str(s->syscall_no), q->pid,
+				syscall_to_str(cause->syscall_no));
+		break; }
+	}
+}
+
+/* The domain of `parent` is done, write what it waited for. */
+void critpath_report(struct parent *parent) {
+	struct critpath *cp = parent->critpath;
+	if (!cp)
+		return;
+	parent->critpath = NULL;
+
+	int end = -1, i, j;
+	for (i = 0; i < cp->events_count; i++) {
+		if (cp->events[i].kind == EV_EXIT &&
+		    (end == -1 || cp->events[i].t >= cp->events[end].t))
+			end = i;
+	}
+	if (end == -1)
+		goto out;
+	flux_time end_t = cp->events[end].t;
+
+	fprintf(report, "Domain %i: %.3f sec of virtual time.\n\n",
+		parent->id, (end_t - cp->start) / 1000000000.);
+
+	struct segment *segments;
+	int count = critical_path(cp, end, &segments);
+	fprintf(report, "Critical path:\n"
+		"  %10s %10s %7s  %-16s\n", "at", "length", "pid", "comm");
+	for (i = 0; i < count; i++) {
+		struct segment *s = &segments[i];
+		cp->procs[s->proc].on_path += s->to - s->from;
+		if ((s->what == SEG_RUN && s->to == s->from) ||
+		    (s->what == SEG_NOT_STARTED &&
+		     s->to - s->from < CRITPATH_MIN_WAIT))
+			continue;
+		print_segment(cp, s);
+	}
+
+	/* Every syscall timing out on the path, by command. */
+	fprintf(report, "\nTimeouts on the critical path:\n");
+	for (i = 0; i < count; i++) {
+		struct segment *s = &segments[i];
+		if (s->what != SEG_TIMEOUT || s->syscall_no == -1)
+			continue;
+		const char *comm = cp->procs[s->proc].comm;
+		flux_time total = 0;
+		int times = 0;
+		for (j = i; j < count; j++) {
+			struct segment *o = &segments[j];
+			if (o->what != SEG_TIMEOUT ||
+			    o->syscall_no != s->syscall_no ||
+			    strcmp(cp->procs[o->proc].comm, comm))
+				continue;
+			total += o->to - o->from;
+			times += 1;
+			/* Counted. */
+			if (j != i)
+				o->syscall_no = -1;
+		}
+		fprintf(report, "  %10.3f sec in %i %s() of %s\n",
+			total / 1000000000., times,
+			syscall_to_str(s->syscall_no), comm);
+	}
+	free(segments);
+
+	slack(cp, end_t);
+	fprintf(report, "\nSlack:\n"
+		"  %7s  %-16s %10s %10s\n", "pid", "comm", "on path", "slack");
+	for (i = 0; i < cp->procs_count; i++) {
+		struct proc *p = &cp->procs[i];
+		fprintf(report, "  %7i  %-16s %10.3f %10.3f\n", p->pid,
+			p->comm, p->on_path / 1000000000.,
+			p->slack / 1000000000.);
+	}
+	fprintf(report, "\n");
+	fflush(report);
+out:
+	free(cp->events);
+	free(cp->procs);
+	free(cp);
+}
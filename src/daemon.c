@@ -0,0 +1,361 @@
+#define _GNU_SOURCE   /* accept4() and MSG_CMSG_CLOEXEC */
+#include <stdio.h>
+#include <stdlib.h>
+#include <limits.h>
+#include <string.h>
+#include <signal.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "types.h"
+#include "list.h"
+
+#include "fluxcapacitor.h"
+#include "uevent.h"
+
+
+extern struct options options;
+extern char **environ;
+
+
+/* A job is a single SOCK_SEQPACKET message, sent together with the
+ * stdin, stdout and stderr of the client:
+ *
+ *     struct job_request | cwd \0 | argv[0] \0 ... | envp[0] \0 ...
+ *
+ * The commands in argv may be separated by "--", like on the command
+ * line. Each job runs in a new time domain. When it's done the daemon
+ * replies with a single line of text:
+ *
+ *     exit=STATUS speedup_ns=NS real_ns=NS
+ *
+ * A job killed by a signal has 128 plus the signal number as STATUS.
+ * If the client goes away before that, the job is killed. */
+struct job_request {
+	u32 argc;
+	u32 envc;
+};
+
+struct daemon_job {
+	int sd;
+	int fds[3];
+
+	char *buf;
+	size_t len;
+	char *cwd;
+	char **argv;
+	char **envp;
+
+	u64 start_ns;
+};
+
+static struct {
+	char path[PATH_MAX];
+	int sd;
+
+	struct uevent *uevent;
+	struct list_head *list_of_domains;
+	int next_id;
+} server = {.sd = -1};
+
+
+static void job_free(struct daemon_job *job) {
+	int i;
+	for (i = 0; i < 3; i++) {
+		if (job->fds[i] != -1)
+			close(job->fds[i]);
+	}
+	if (job->sd != -1)
+		close(job->sd);
+	free(job->argv);
+	free(job->envp);
+	free(job->buf);
+	free(job);
+}
+
+/* Take the next string from the buffer. */
+static char *next_string(char **p, char *end) {
+	char *s = *p;
+	char *nul = memchr(s, '\0', end - s);
+	if (!nul)
+		return NULL;
+	*p = nul + 1;
+	return s;
+}
+
+static struct daemon_job *job_receive(int cd) {
+	ssize_t len = recv(cd, NULL, 0, MSG_PEEK | MSG_TRUNC);
+	if (len < (ssize_t)sizeof(struct job_request))
+		return NULL;
+
+	struct daemon_job *job = calloc(1, sizeof(struct daemon_job));
+	job->sd = -1;
+	job->fds[0] = job->fds[1] = job->fds[2] = -1;
+	job->buf = malloc(len);
+	job->len = len;
+
+	char cbuf[CMSG_SPACE(3 * sizeof(int))];
+	struct iovec iov = {job->buf, len};
+	struct msghdr msg;
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = cbuf;
+	msg.msg_controllen = sizeof(cbuf);
+
+	ssize_t r = recvmsg(cd, &msg, MSG_CMSG_CLOEXEC);
+	struct cmsghdr *cmsg;
+	for (cmsg = CMSG_FIRSTHDR(&msg); r > 0 && cmsg;
+	     cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+		if (cmsg->cmsg_level != SOL_SOCKET ||
+		    cmsg->cmsg_type != SCM_RIGHTS)
+			continue;
+		int n = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+		memcpy(job->fds, CMSG_DATA(cmsg), MIN(n, 3) * sizeof(int));
+	}
+	if (r != len || msg.msg_flags & (MSG_TRUNC | MSG_CTRUNC))
+		goto error;
+
+	struct job_request *req = (struct job_request *)job->buf;
+	char *p = job->buf + sizeof(struct job_request);
+	char *end = job->buf + len;
+	if (req->argc == 0 || req->argc > (u32)len || req->envc > (u32)len)
+		goto error;
+
+	job->cwd = next_string(&p, end);
+	job->argv = calloc(req->argc + 1, sizeof(char *));
+	job->envp = calloc(req->envc + 1, sizeof(char *));
+	u32 i;
+	for (i = 0; i < req->argc; i++) {
+		job->argv[i] = next_string(&p, end);
+		if (!job->argv[i])
+			goto error;
+	}
+	for (i = 0; i < req->envc; i++) {
+		job->envp[i] = next_string(&p, end);
+		if (!job->envp[i])
+			goto error;
+	}
+	if (!job->cwd)
+		goto error;
+	return job;
+
+error:
+	job_free(job);
+	return NULL;
+}
+
+static int on_hangup(struct uevent *uevent, int cd, int mask, void *userdata) {
+	struct parent *parent = userdata;
+	SHOUT("[-] Domain %i: client went away, killing the job", parent->id);
+
+	uevent_clear(uevent, cd);
+	close(cd);
+	parent->job->sd = -1;
+
+	/* Don't start the remaining commands. */
+	while (parent->list_of_argv[parent->started])
+		parent->started ++;
+	parent_kill_all(parent, SIGKILL);
+	forksrv_cancel(parent);
+	return 0;
+}
+
+static int on_request(struct uevent *uevent, int cd, int mask, void *userdata) {
+	struct daemon_job *job = job_receive(cd);
+	if (!job) {
+		SHOUT("[ ] Bad job request, dropping the client");
+		uevent_clear(uevent, cd);
+		close(cd);
+		return 0;
+	}
+	job->sd = cd;
+	job->start_ns = monotonic_ns();
+
+	/* With a fork server the arguments are for the copy. */
+	char *none[] = {NULL};
+	int argc;
+	for (argc = 0; job->argv[argc]; argc++);
+	char ***list_of_argv = options.fork_server ?
+		argv_split(none, "--", 0) :
+		argv_split(job->argv, "--", argc);
+	char ***a;
+	for (a = list_of_argv; *a; a++) {
+		if (!**a) {
+			SHOUT("[ ] Empty command in job request, "
+			      "dropping the client");
+			uevent_clear(uevent, cd);
+			argv_free(list_of_argv);
+			job_free(job);
+			return 0;
+		}
+	}
+
+	struct parent *parent = parent_new(server.next_id++, list_of_argv);
+	parent->job = job;
+	list_add_tail(&parent->in_domains, server.list_of_domains);
+
+	char *flat_argv = argv_join(job->argv, " ");
+	SHOUT("[+] Domain %i: job in %s: %s", parent->id, job->cwd, flat_argv);
+	free(flat_argv);
+	if (options.fork_server)
+		forksrv_submit(parent, job->buf, job->len, job->fds);
+
+	/* From now on the client is only expected to hang up. */
+	uevent_yield(uevent, cd, UEVENT_READ, on_hangup, parent);
+	return 0;
+}
+
+static int on_accept(struct uevent *uevent, int sd, int mask, void *userdata) {
+	int cd = accept4(sd, NULL, NULL, SOCK_CLOEXEC);
+	if (cd < 0) {
+		SHOUT("[ ] accept(): %s", strerror(errno));
+		return 0;
+	}
+	uevent_yield(uevent, cd, UEVENT_READ, on_request, NULL);
+	return 0;
+}
+
+static void on_exit_signal(int signo) {
+	options.exit_forced = 1;
+}
+
+/* Accept jobs on a unix socket at `path`. Each job becomes a new
+ * domain on `list_of_domains`, numbered from `first_id`. */
+void daemon_listen(const char *path, struct uevent *uevent,
+		   struct list_head *list_of_domains, int first_id) {
+	snprintf(server.path, sizeof(server.path), "%s", path);
+	server.uevent = uevent;
+	server.list_of_domains = list_of_domains;
+	server.next_id = first_id;
+	server.sd = unix_listen(path, SOCK_SEQPACKET);
+	uevent_yield(uevent, server.sd, UEVENT_READ, on_accept, NULL);
+
+	/* Without SA_RESTART, to break out of uevent_select(). */
+	struct sigaction sa;
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = on_exit_signal;
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+
+	SHOUT("[.] Accepting jobs on %s", path);
+}
+
+/* Run in the forked child before exec: give it the stdio, working
+ * directory and environment of the client. */
+void daemon_preexec(void *userdata) {
+	struct parent *parent = userdata;
+	struct daemon_job *job = parent->job;
+	if (!job)
+		return;
+
+	int fd;
+	for (fd = 0; fd < 3; fd++) {
+		if (job->fds[fd] == -1)
+			continue;
+		if (job->fds[fd] == fd)
+			fcntl(fd, F_SETFD, 0);
+		else if (dup2(job->fds[fd], fd) < 0)
+			PFATAL("dup2()");
+	}
+	if (chdir(job->cwd))
+		PFATAL("chdir(%s)", job->cwd);
+
+	char *ld_preload = strdup(ldpreload_get());
+	environ = job->envp;
+	setenv("LD_PRELOAD", ld_preload, 1);
+}
+
+/* Report the result to the client, if it's still there. */
+void daemon_job_done(struct parent *parent) {
+	struct daemon_job *job = parent->job;
+	parent->job = NULL;
+
+	if (job->sd != -1) {
+		char buf[128];
+		int len = snprintf(buf, sizeof(buf),
+				   "exit=%u speedup_ns=%lli real_ns=%llu\n",
+				   parent->exit_status,
+				   (long long)(parent->time_drift -
+					       parent->start_drift),
+				   (unsigned long long)
+				   (monotonic_ns() - job->start_ns));
+		send(job->sd, buf, len, MSG_NOSIGNAL);
+		uevent_clear(server.uevent, job->sd);
+	}
+	job_free(job);
+}
+
+void daemon_free() {
+	if (server.sd == -1)
+		return;
+	uevent_clear(server.uevent, server.sd);
+	close(server.sd);
+	server.sd = -1;
+	unlink(server.path);
+}
+
+
+/* Client side: send `argv` to the daemon and wait for it to finish.
+ * Returns the exit status of the job. */
+int daemon_submit(const char *path, char **argv) {
+	char cwd[PATH_MAX];
+	if (!getcwd(cwd, sizeof(cwd)))
+		PFATAL("getcwd()");
+
+	struct job_request req = {0, 0};
+	size_t len = sizeof(req) + strlen(cwd) + 1;
+	char **a;
+	for (a = argv; *a; a++, req.argc++)
+		len += strlen(*a) + 1;
+	for (a = environ; *a; a++, req.envc++)
+		len += strlen(*a) + 1;
+
+	char *buf = malloc(len), *p = buf;
+	memcpy(p, &req, sizeof(req));
+	p += sizeof(req);
+	p = stpcpy(p, cwd) + 1;
+	for (a = argv; *a; a++)
+		p = stpcpy(p, *a) + 1;
+	for (a = environ; *a; a++)
+		p = stpcpy(p, *a) + 1;
+
+	int fds[3] = {0, 1, 2};
+	char cbuf[CMSG_SPACE(sizeof(fds))];
+	memset(cbuf, 0, sizeof(cbuf));
+	struct iovec iov = {buf, len};
+	struct msghdr msg;
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = cbuf;
+	msg.msg_controllen = sizeof(cbuf);
+	struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+	memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+
+	int sd = unix_connect(path, SOCK_SEQPACKET);
+	if (sendmsg(sd, &msg, MSG_NOSIGNAL) != (ssize_t)len)
+		PFATAL("sendmsg(%s)", path);
+	free(buf);
+
+	char reply[128];
+	int r = recv(sd, reply, sizeof(reply) - 1, 0);
+	if (r <= 0)
+		FATAL("Daemon at %s went away", path);
+	reply[r] = '\0';
+	close(sd);
+
+	unsigned status;
+	if (sscanf(reply, "exit=%u", &status) != 1)
+		FATAL("Bad reply from the daemon: %s", reply);
+	reply[strcspn(reply, "\n")] = '\0';
+	SHOUT("[-] %s", reply);
+	return status;
+}
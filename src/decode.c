@@ -0,0 +1,184 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "types.h"
+#include "ring.h"
+
+
+/* fluxcapacitor-decode: print the log written with --ring, one
+ * message per line, after the time since fluxcapacitor started.
+ * Works on the ring of a fluxcapacitor that's still running, or that
+ * crashed. */
+
+#define FATAL(x...) do {						\
+		fprintf(stderr, "[-] " x);				\
+		fprintf(stderr, "\n");					\
+		exit(EXIT_FAILURE);					\
+	} while (0)
+
+/* Ends a string we don't have all of: "…" in UTF-8. */
+#define CUT_MARK "\xe2\x80\xa6"
+
+static struct ring_header *header;
+static struct ring_record *records;
+static const char **formats;
+
+static struct ring_record *record_at(u64 i) {
+	return &records[i % header->records];
+}
+
+/* Print the message of the record at `i`. Returns the index of the
+ * next one. */
+static u64 print_record(u64 i, u64 head) {
+	struct ring_record *record = record_at(i);
+	const char *strings[RING_ARGS];
+	int a;
+
+	i += 1;
+	for (a = 0; a < RING_ARGS; a++)
+		strings[a] = NULL;
+
+	/* The bytes of the strings are in the records that follow. */
+	const char *fmt = formats[record->event];
+	const char *p = fmt;
+	for (a = 0; a < record->nargs && (p = strchr(p, '%'));) {
+		int type = ring_conversion(p, &p);
+		if (type == RING_T_NONE)
+			continue;
+		if (type == RING_T_STRING) {
+			u64 len = MIN(record->args[a], RING_MAX_STRING);
+			/* Room for the mark of a cut string. */
+			char *s = calloc(1, len + sizeof(CUT_MARK));
+			u64 off;
+			for (off = 0; off < len && i < head; i++) {
+				struct ring_record *cont = record_at(i);
+				if (cont->event != RING_CONT)
+					break;
+				memcpy(s + off, cont->args, MIN(cont->len, len - off));
+				off += MIN(cont->len, len - off);
+			}
+			/* Longer than we log, or the ring ended. */
+			if (off < record->args[a])
+				strcpy(s + off, CUT_MARK);
+			strings[a] = s;
+		}
+		a += 1;
+	}
+
+	printf("[%12.6f] ", (s64)(record->ts_ns - header->start_ns) / 1e9);
+	char spec[32];
+	for (a = 0, p = fmt; *p;) {
+		const char *pct = strchr(p, '%');
+		if (!pct) {
+			fputs(p, stdout);
+			break;
+		}
+		fwrite(p, 1, pct - p, stdout);
+		int type = ring_conversion(pct, &p);
+		snprintf(spec, sizeof(spec), "%.*s", (int)(p - pct), pct);
+		if (type == RING_T_NONE) {
+			putchar('%');
+			continue;
+		}
+		if (a >= record->nargs) {
+			fputs("?", stdout);
+			continue;
+		}
+		u64 arg = record->args[a];
+		switch (type) {
+		case RING_T_INT:
+			printf(spec, (int)arg);
+			break;
+		case RING_T_LONG:
+			printf(spec, (long)arg);
+			break;
+		case RING_T_LLONG:
+			printf(spec, (long long)arg);
+			break;
+		case RING_T_PTR:
+			printf(spec, (void *)(uintptr_t)arg);
+			break;
+		case RING_T_DOUBLE: {
+			double d;
+			memcpy(&d, &arg, sizeof(d));
+			printf(spec, d);
+			break; }
+		case RING_T_STRING:
+			printf(spec, strings[a] ? strings[a] : "");
+			break;
+		default:
+			fputs("?", stdout);
+		}
+		a += 1;
+	}
+	putchar('\n');
+
+	for (a = 0; a < RING_ARGS; a++)
+		free((char *)strings[a]);
+	return i;
+}
+
+int main(int argc, char **argv) {
+	if (argc != 2) {
+		fprintf(stderr, "Usage: %s FILE\n\n"
+			"Print the log that fluxcapacitor --ring=FILE wrote.\n",
+			argv[0]);
+		exit(EXIT_FAILURE);
+	}
+
+	int fd = open(argv[1], O_RDONLY);
+	if (fd == -1)
+		FATAL("open(%s): %s", argv[1], strerror(errno));
+	struct stat st;
+	if (fstat(fd, &st))
+		FATAL("fstat(%s): %s", argv[1], strerror(errno));
+	if ((u64)st.st_size < RING_HEADER_SIZE + RING_TABLE_SIZE)
+		FATAL("%s: too short", argv[1]);
+	void *map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	if (map == MAP_FAILED)
+		FATAL("mmap(%s): %s", argv[1], strerror(errno));
+	close(fd);
+
+	header = map;
+	if (memcmp(header->magic, RING_MAGIC, sizeof(header->magic)) ||
+	    header->record_size != sizeof(struct ring_record) ||
+	    header->table_used > RING_TABLE_SIZE ||
+	    RING_HEADER_SIZE + RING_TABLE_SIZE +
+	    header->records * sizeof(struct ring_record) > (u64)st.st_size)
+		FATAL("%s: not a fluxcapacitor ring", argv[1]);
+
+	/* Snapshot, fluxcapacitor may still be writing. */
+	u32 count = header->formats;
+	u64 head = header->head;
+
+	const char *table = (char *)map + RING_HEADER_SIZE;
+	records = (void *)(table + RING_TABLE_SIZE);
+	formats = calloc(count, sizeof(char *));
+	u32 f, off = 0;
+	for (f = 0; f < count && off < header->table_used; f++) {
+		formats[f] = table + off;
+		off += strnlen(table + off, header->table_used - off) + 1;
+	}
+	count = f;
+
+	u64 i = head > header->records ? head - header->records : 0;
+	if (i)
+		fprintf(stderr, "[ ] %llu older records were overwritten\n",
+			(unsigned long long)i);
+	while (i < head) {
+		struct ring_record *record = record_at(i);
+		/* Strings of a message that was overwritten. */
+		if (record->event == RING_CONT || record->event >= count) {
+			i += 1;
+			continue;
+		}
+		i = print_record(i, head);
+	}
+	return 0;
+}
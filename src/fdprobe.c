@@ -0,0 +1,368 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/time.h>
+
+#include "list.h"
+#include "types.h"
+#include "trace.h"
+#include "fluxcapacitor.h"
+#include "scnums.h"
+
+#ifndef __NR_pidfd_getfd
+# define __NR_pidfd_getfd 438
+#endif
+
+extern struct options options;
+
+
+/* Instead of guessing whether some I/O is still in flight, look at
+ * the descriptors the blocked children are waiting on. We take a
+ * copy of each with pidfd_getfd() and poll them ourselves. If none
+ * is ready, nobody can wake up and it's safe to advance the time.
+ *
+ * The arguments are decoded only when we need them: the children are
+ * blocked in the kernel, their memory doesn't change under us (as
+ * long as all the threads are blocked). An epoll descriptor is polled
+ * as is: it's readable exactly when epoll_wait() would return. */
+
+#define PROBE_MAX 1024
+
+static int probe_broken;
+
+/* What we learnt about the descriptors of a process, so that a read()
+ * or a write() doesn't cost a pidfd_getfd() each. An entry is
+ * forgotten when the descriptor is closed or replaced, see
+ * fdprobe_forget(), and all of them on exec. */
+
+#define FD_CACHE_MAX 65536
+
+struct fd_cache {
+	int size;
+	struct fd_info fds[];
+};
+
+static unsigned timeouts_gen = 1;
+
+
+static int child_pidfd(struct child *child) {
+	int pidfd = trace_process_pidfd(child->process);
+	if (pidfd == -1 && errno == ENOSYS) {
+		SHOUT("[ ] No pidfd_open(), descriptor probing disabled");
+		probe_broken = 1;
+	}
+	return pidfd;
+}
+
+/* Our copy of descriptor `fd` of the child, -1 if it's not open. */
+int fdprobe_getfd(struct child *child, int fd) {
+	if (probe_broken)
+		return -1;
+	int pidfd = child_pidfd(child);
+	if (pidfd == -1)
+		return -1;
+	int copy = syscall(__NR_pidfd_getfd, pidfd, fd, 0);
+	if (copy == -1 && errno == ENOSYS)
+		probe_broken = 1;
+	return copy;
+}
+
+static struct fd_info *fd_info(struct child *child, int fd) {
+	static struct fd_info scratch;
+	if (fd >= FD_CACHE_MAX) {
+		memset(&scratch, 0, sizeof(scratch));
+		return &scratch;
+	}
+	void **slot = trace_process_slot(child->process);
+	struct fd_cache *cache = *slot;
+	int size = cache ? cache->size : 0;
+	if (fd >= size) {
+		int new_size = MAX(size * 2, 64);
+		while (fd >= new_size)
+			new_size *= 2;
+		cache = realloc(cache, sizeof(struct fd_cache) +
+				new_size * sizeof(struct fd_info));
+		memset(&cache->fds[size], 0,
+		       (new_size - size) * sizeof(struct fd_info));
+		cache->size = new_size;
+		*slot = cache;
+	}
+	return &cache->fds[fd];
+}
+
+static int add_fd(struct pollfd *pfds, int *count, int fd, short events) {
+	if (*count >= PROBE_MAX)
+		return -1;
+	pfds[*count] = (struct pollfd){fd, events, 0};
+	*count += 1;
+	return 0;
+}
+
+static int add_fd_set(struct child *child, struct pollfd *pfds, int *count,
+		      int nfds, unsigned long addr, short events) {
+	if (!addr)
+		return 0;
+	unsigned long set[FD_SETSIZE / (8 * sizeof(long))];
+	int words = (nfds + 8 * sizeof(long) - 1) / (8 * sizeof(long));
+	if (copy_from_user_unaligned(child->process, set, addr,
+				     words * sizeof(long)))
+		return -1;
+	int fd;
+	for (fd = 0; fd < nfds; fd++) {
+		if (!(set[fd / (8 * sizeof(long))] >>
+		      (fd % (8 * sizeof(long))) & 1))
+			continue;
+		int i;
+		for (i = 0; i < *count; i++) {
+			if (pfds[i].fd == fd)
+				break;
+		}
+		if (i < *count)
+			pfds[i].events |= events;
+		else if (add_fd(pfds, count, fd, events))
+			return -1;
+	}
+	return 0;
+}
+
+/* Append what the child is waiting for to `pfds`, with descriptors
+ * from the child. Returns -1 if we can't tell. */
+static int child_waits(struct child *child, struct pollfd *pfds, int *count) {
+	struct trace_sysarg *sysarg = child->blocked_sysarg;
+	int nfds;
+
+	if (!sysarg)
+		return -1;
+
+	switch (sysarg->number) {
+	case __NR_nanosleep:
+	case __NR_clock_nanosleep:
+		return 0;
+
+	case __NR_poll:
+	case __NR_ppoll:
+		nfds = sysarg->arg2;
+		if (nfds < 0 || *count + nfds > PROBE_MAX)
+			return -1;
+		if (nfds && copy_from_user_unaligned(child->process,
+						     &pfds[*count], sysarg->arg1,
+						     nfds * sizeof(struct pollfd)))
+			return -1;
+		*count += nfds;
+		return 0;
+
+#ifdef __NR_select
+	case __NR_select:
+#endif
+#ifdef __NR__newselect
+	case __NR__newselect:
+#endif
+	case __NR_pselect6:
+		nfds = sysarg->arg1;
+		if (nfds < 0 || nfds > FD_SETSIZE)
+			return -1;
+		if (add_fd_set(child, pfds, count, nfds, sysarg->arg2,
+			       POLLIN) ||
+		    add_fd_set(child, pfds, count, nfds, sysarg->arg3,
+			       POLLOUT) ||
+		    add_fd_set(child, pfds, count, nfds, sysarg->arg4,
+			       POLLPRI))
+			return -1;
+		return 0;
+
+	case __NR_epoll_wait:
+	case __NR_epoll_pwait:
+	case __NR_read:
+	case __NR_readv:
+#ifdef __NR_recvfrom
+	case __NR_recvfrom:
+#endif
+#ifdef __NR_recvmsg
+	case __NR_recvmsg:
+#endif
+#ifdef __NR_accept
+	case __NR_accept:
+#endif
+#ifdef __NR_accept4
+	case __NR_accept4:
+#endif
+		return add_fd(pfds, count, sysarg->arg1, POLLIN);
+	}
+	return -1;
+}
+
+/* Append what the child is waiting for to `pfds`, and replace the
+ * descriptors with our copies. The first `dups` are copies already,
+ * to be closed. Returns -1 if we can't tell. */
+static int child_dups(struct child *child, struct pollfd *pfds, int *count,
+		      int *dups) {
+	if (child_waits(child, pfds, count))
+		return -1;
+	if (*dups == *count)
+		return 0;
+	int pidfd = child_pidfd(child);
+	if (pidfd == -1)
+		return -1;
+	for (; *dups < *count; *dups += 1) {
+		if (pfds[*dups].fd < 0)
+			continue;
+		int fd = fdprobe_getfd(child, pfds[*dups].fd);
+		/* Closed behind the child's back? */
+		if (fd == -1)
+			return -1;
+		pfds[*dups].fd = fd;
+	}
+	return 0;
+}
+
+static int poll_ready(struct pollfd *pfds, int count) {
+	int r = poll(pfds, count, 0);
+	if (r < 0)
+		PFATAL("poll()");
+	return r > 0;
+}
+
+static void close_dups(struct pollfd *pfds, int dups) {
+	int i;
+	for (i = 0; i < dups; i++) {
+		if (pfds[i].fd >= 0)
+			close(pfds[i].fd);
+	}
+}
+
+/* Is any descriptor the children of `parent` are blocked on ready?
+ * Returns -1 if we can't tell, for example if someone is blocked on
+ * something else than a descriptor or a sleep. */
+int fdprobe_domain(struct parent *parent) {
+	struct pollfd pfds[PROBE_MAX];
+	int count = 0, dups = 0, ready = -1;
+
+	if (probe_broken)
+		return -1;
+
+	struct list_head *pos = NULL;
+	list_for_each(pos, &parent->list_of_children) {
+		struct child *child = hlist_entry(pos, struct child, in_children);
+		if (child_dups(child, pfds, &count, &dups))
+			goto out;
+	}
+	ready = poll_ready(pfds, count);
+
+out:
+	close_dups(pfds, dups);
+	return ready;
+}
+
+/* Would the syscall `child` is entering return right away? Like
+ * fdprobe_domain() for a single child, but a read() or an accept()
+ * on a non-blocking descriptor counts as ready too. For --lockstep,
+ * where the child is held at the syscall entry. */
+int fdprobe_child(struct child *child) {
+	struct pollfd pfds[PROBE_MAX];
+	int count = 0, dups = 0, ready = -1;
+
+	if (probe_broken)
+		return -1;
+
+	if (child_dups(child, pfds, &count, &dups))
+		goto out;
+	ready = poll_ready(pfds, count);
+
+	switch (child->blocked_sysarg->number) {
+	case __NR_read:
+	case __NR_readv:
+#ifdef __NR_recvfrom
+	case __NR_recvfrom:
+#endif
+#ifdef __NR_recvmsg
+	case __NR_recvmsg:
+#endif
+#ifdef __NR_accept
+	case __NR_accept:
+#endif
+#ifdef __NR_accept4
+	case __NR_accept4:
+#endif
+		if (!ready && dups == 1 &&
+		    fcntl(pfds[0].fd, F_GETFL) & O_NONBLOCK)
+			ready = 1;
+		break;
+	}
+
+out:
+	close_dups(pfds, dups);
+	return ready;
+}
+
+static u64 sock_timeout(int fd, int optname) {
+	struct timeval tv;
+	socklen_t len = sizeof(tv);
+	if (getsockopt(fd, SOL_SOCKET, optname, &tv, &len))
+		return 0;
+	return TIMEVAL_NSEC(&tv);
+}
+
+/* What we know about descriptor `fd` of the child, NULL if it's not
+ * open. Valid until the next call. */
+struct fd_info *fdprobe_fd(struct child *child, int fd) {
+	if (probe_broken || fd < 0)
+		return NULL;
+	struct fd_info *info = fd_info(child, fd);
+	if (info->known)
+		return info;
+	int copy = fdprobe_getfd(child, fd);
+	if (copy == -1)
+		return NULL;
+	struct stat st;
+	if (fstat(copy, &st) == 0) {
+		info->known = 1;
+		info->is_socket = S_ISSOCK(st.st_mode);
+		info->ino = st.st_ino;
+	}
+	close(copy);
+	return info->known ? info : NULL;
+}
+
+/* The SO_RCVTIMEO or SO_SNDTIMEO, `optname`, of descriptor `fd` of
+ * the child, in ns. 0 for none, or if it's not a socket. */
+u64 fdprobe_sock_timeout(struct child *child, int fd, int optname) {
+	struct fd_info *info = fdprobe_fd(child, fd);
+	if (!info || !info->is_socket)
+		return 0;
+	if (info->timeouts_gen != timeouts_gen) {
+		int copy = fdprobe_getfd(child, fd);
+		if (copy == -1)
+			return 0;
+		info->rcvtimeo = sock_timeout(copy, SO_RCVTIMEO);
+		info->sndtimeo = sock_timeout(copy, SO_SNDTIMEO);
+		info->timeouts_gen = timeouts_gen;
+		close(copy);
+	}
+	return optname == SO_RCVTIMEO ? info->rcvtimeo : info->sndtimeo;
+}
+
+/* Descriptors `first` to `last` of the child were closed, replaced,
+ * or got another address. */
+void fdprobe_forget(struct child *child, int first, int last) {
+	struct fd_cache *cache = *trace_process_slot(child->process);
+	if (!cache || first < 0)
+		return;
+	last = MIN(last, cache->size - 1);
+	if (first <= last)
+		memset(&cache->fds[first], 0,
+		       (last - first + 1) * sizeof(struct fd_info));
+}
+
+/* Someone set a socket timeout, the ones we know may be stale. */
+void fdprobe_timeouts_changed(void) {
+	timeouts_gen += 1;
+}
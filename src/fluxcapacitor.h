@@ -22,18 +22,32 @@ extern struct timespec uevent_now;
 
 #define SHOUT(x...) do{						\
 		if (options.verbose) {				\
-			fprintf(options.shoutstream, x);	\
-			fprintf(options.shoutstream, "\n");	\
+			if (options.ring) {			\
+				ring_log(1, x);			\
+			} else {				\
+				fprintf(options.shoutstream, x);	\
+				fprintf(options.shoutstream, "\n");	\
+			}					\
 		}						\
 	} while (0)
 
 #define PRINT(x...) do{						\
 		if (options.verbose > 1) {     			\
-			fprintf(options.shoutstream, x);	\
-			fprintf(options.shoutstream, "\n");	\
+			if (options.ring) {			\
+				ring_log(2, x);			\
+			} else {				\
+				fprintf(options.shoutstream, x);	\
+				fprintf(options.shoutstream, "\n");	\
+			}					\
 		}						\
 	} while (0)
 
+/* ring.c */
+void ring_log(int level, const char *fmt, ...)
+	__attribute__ ((format (printf, 2, 3)));
+void ring_open(const char *spec);
+void ring_close();
+
 /* All the global state goes here */
 struct options {
 	/* Path to .so files */
@@ -43,6 +57,9 @@ struct options {
 
 	FILE *shoutstream;
 
+	/* Binary log instead of `shoutstream`, see ring.c. */
+	char *ring;
+
 	/* Should we exit? */
 	int exit_forced;
 
@@ -59,10 +76,82 @@ struct options {
 
 	/* Don't advance time in tiny chunks */
 	u64 min_speedup;
+
+	/* Run tracees in a dedicated cgroup, optionally restricted to
+	 * `cpus`. Without it everything is pinned to a single cpu. */
+	int use_cgroup;
+	char *cgroup_parent;
+	char *cpus;
+
+	/* Cpu for the tracer itself, -1 if not pinned. */
+	int tracer_cpu;
+
+	/* Freeze the cgroup when advancing time. */
+	int freeze;
+
+	/* Run one tracee of a domain at a time, see lockstep.c. */
+	int lockstep;
+
+	/* Unix socket to accept jobs on, or to submit a job to. */
+	char *daemon;
+	char *submit;
+
+	/* Fork the jobs from a running command, see forksrv.c. */
+	int fork_server;
+
+	/* Write stats as JSON to a file on exit, serve them live on a
+	 * unix socket. */
+	char *stats_file;
+	char *stats_socket;
+
+	/* Chrome trace event output, see timeline.c. */
+	char *trace_out;
+
+	/* Folded stacks of the virtual waits, see profile.c. */
+	char *profile;
+
+	/* Critical path report of every domain, see critpath.c. */
+	char *critpath;
+
+	/* Unix socket to control the clock on, see control.c. */
+	char *control;
+
+	/* Run in new namespaces, see ns.c. */
+	int unshare;
+
+	/* Trace a running process instead, and its descendants with
+	 * `attach_tree`. See attach.c. */
+	int attach_pid;
+	int attach_tree;
+
+	/* How far ahead of the real time the clocks start. */
+	u64 drift_ns;
+
+	/* Stop advancing at a virtual instant: `until_date` in ns
+	 * since the epoch, or `until_ns` after the start of each
+	 * domain. Then send `until_signo` to everyone. */
+	flux_time until_date;
+	u64 until_ns;
+	int until_signo;
+
+	/* Run `checkpoint_argv` in the domain every `checkpoint_ns`
+	 * of virtual time. */
+	u64 checkpoint_ns;
+	char **checkpoint_argv;
 };
 
 
+/* A time domain: a group of commands sharing a clock. */
 struct parent {
+	int id;
+	struct list_head in_domains;
+
+	/* Commands not started yet, NULL terminated */
+	char ***list_of_argv;
+
+	/* Max exit status of the exited children (unsigned) */
+	unsigned exit_status;
+
 	int child_count;
 	struct list_head list_of_children;
 
@@ -72,6 +161,46 @@ struct parent {
 	int started;
 
 	flux_time time_drift;
+
+	/* Freezer is stopping the tracees, park interrupted syscalls. */
+	int freezing;
+
+	/* Submitted through the daemon socket, NULL otherwise. */
+	struct daemon_job *job;
+
+	/* Waiting for the fork server to fork the command of the
+	 * job, and the time_drift it started with. See forksrv.c. */
+	int forking;
+	flux_time start_drift;
+
+	/* Virtual instants of --until and of the next --checkpoint,
+	 * 0 if unset. See parent_horizon(). */
+	flux_time until;
+	flux_time next_checkpoint;
+	/* When we sent the --until signal, monotonic. */
+	u64 until_reached_ns;
+
+	/* Someone set SO_RCVTIMEO or SO_SNDTIMEO, socket calls may
+	 * have a deadline. */
+	int sock_timeouts;
+
+	/* Paused from the control socket: advances left, and the
+	 * virtual instant to stop at. See control.c. */
+	int control_steps;
+	flux_time control_until;
+
+	/* Waits and wake ups of the tracees, NULL unless
+	 * --critical-path. See critpath.c. */
+	struct critpath *critpath;
+
+	/* For --lockstep: the one tracee that runs, and the ones held
+	 * until it's their turn. Set when someone may have made a
+	 * descriptor ready, or sent a signal, to the ones held in a
+	 * wait. See lockstep.c. */
+	struct child *runner;
+	struct list_head list_of_runnable;
+	int lockstep_dirty;
+	int lockstep_signalled;
 };
 
 
@@ -90,26 +219,226 @@ struct child {
 
 	int interrupted;
 
+	/* Blocked in `syscall_no`, with a timeout we know of. */
+	int timed;
 	int syscall_no;
 
-	int stat_fd;
 	char stat;
+
+	/* Kicked out of a blocking syscall by the freezer and held at
+	 * the syscall exit. */
+	struct trace_sysarg *parked;
+	/* Syscall is going to be restarted, keep `blocked_until`. */
+	int restarting;
+
+	/* For the timeline, 0 when disabled. */
+	u64 blocked_since_ns;
+
+	/* Syscall skipped at entry, return `skipped_ret` at exit. */
+	int skipped;
+	long skipped_ret;
+
+	/* The syscall we're blocked in, as it was entered. */
+	struct trace_sysarg *blocked_sysarg;
+	/* It waits for the time alone, no descriptor can wake it. */
+	int fd_free;
+
+	/* For --profile: where we're blocked and since when, see
+	 * profile.c. */
+	struct profile_stack *profile;
+	u64 profile_since_ns;
+	flux_time profile_drift;
+
+	/* Its tracee in parent->critpath. */
+	int critpath;
+
+	/* For --lockstep: where it is, and when it entered the syscall
+	 * it runs through. See lockstep.c. */
+	int lockstep;
+	struct list_head in_runnable;
+	u64 lockstep_since_ns;
+
+	/* Its perf counters with --stats, -1 if none. See
+	 * counters.c. */
+	int counters_fd;
 };
 
 
 /* misc.c */
-void pin_cpu();
+void pin_cpu(int cpu);
 char ***argv_split(char **argv, const char *delimiter, int upper_bound);
+void argv_free(char ***list_of_argv);
 char *argv_join(char **argv, const char *delimiter);
 void ensure_libpath(const char *argv_0);
 void ldpreload_extend(const char *lib_path, const char *file);
 const char *ldpreload_get();
+int ldpreload_embedded();
 void handle_backtrace();
 int str_to_signal(const char *s);
 int str_to_time(const char *s, u64 *timens_ptr);
+int str_to_date(const char *s, flux_time *timens_ptr);
 const char *syscall_to_str(int no);
+u64 monotonic_ns();
 int proc_running();
 void ping_myself();
+int unix_listen(const char *path, int type);
+int unix_connect(const char *path, int type);
+
+/* cgroup.c */
+void cgroup_init(const char *parent_dir, const char *cpus);
+void cgroup_attach(int pid);
+int cgroup_busy();
+void cgroup_freeze(int frozen);
+int cgroup_frozen();
+void cgroup_free();
+
+/* daemon.c */
+struct uevent;
+void daemon_listen(const char *path, struct uevent *uevent,
+		   struct list_head *list_of_domains, int first_id);
+void daemon_preexec(void *userdata);
+void daemon_job_done(struct parent *parent);
+void daemon_free();
+int daemon_submit(const char *path, char **argv);
+
+/* attach.c */
+struct trace;
+void attach_start(struct trace *trace, struct list_head *list_of_domains,
+		  int id);
+void attach_patch(struct child *child);
+void attach_syscall_exit(struct child *child, struct trace_sysarg *sysarg);
+void attach_ask_detach();
+void attach_poll();
+int attach_held(struct parent *parent);
+void attach_detach(struct child *child, struct trace_sysarg *sysarg);
+void attach_stop(struct trace *trace);
+
+/* forksrv.c */
+/* Where the template finds the jobs. */
+#define FORKSRV_FD 1000
+
+void forksrv_init(struct uevent *uevent);
+void forksrv_preexec(void *userdata);
+void forksrv_started(struct parent *parent);
+void forksrv_submit(struct parent *parent, const void *buf, size_t len,
+		    int fds[3]);
+void forksrv_cancel(struct parent *parent);
+void forksrv_syscall_enter(struct child *child, struct trace_sysarg *sysarg);
+struct parent *forksrv_domain(struct child *forker);
+void forksrv_copy(struct child *child);
+void forksrv_exit(struct child *child);
+void forksrv_free();
+
+/* stats.c */
+void stats_init();
+u64 stats_clock();
+void stats_stop(int syscall_no, u64 start_ns);
+void stats_advance(int syscall_no, flux_time speedup, u64 settle_start_ns,
+		   flux_time time_drift);
+void stats_dump(FILE *f);
+void stats_write(const char *path);
+void stats_listen(const char *path, struct uevent *uevent);
+void stats_free(const char *path, struct uevent *uevent);
+
+/* counters.c */
+/* Where the tracer is, see counters_phase(). */
+enum {
+	COUNTERS_STOP,
+	COUNTERS_SETTLE,
+	COUNTERS_OTHER,
+	COUNTERS_PHASES
+};
+
+void counters_init();
+int counters_phase(int phase);
+int counters_open(int pid);
+void counters_close(int fd);
+void counters_dump(FILE *f, u64 real_ns, u64 stops);
+void counters_free();
+
+/* fdprobe.c */
+/* What fdprobe.c learnt about a descriptor of a traced process. */
+struct fd_info {
+	int known;
+	int is_socket;
+	u64 ino;
+	/* SO_RCVTIMEO and SO_SNDTIMEO in ns, see fdprobe.c. */
+	unsigned timeouts_gen;
+	u64 rcvtimeo;
+	u64 sndtimeo;
+	/* For latency.c: the --latency rules of the local and of the
+	 * peer address, and the socket type. */
+	int rules_known;
+	void *name_rule;
+	void *peer_rule;
+	int sock_type;
+};
+
+int fdprobe_domain(struct parent *parent);
+int fdprobe_child(struct child *child);
+int fdprobe_getfd(struct child *child, int fd);
+struct fd_info *fdprobe_fd(struct child *child, int fd);
+u64 fdprobe_sock_timeout(struct child *child, int fd, int optname);
+void fdprobe_forget(struct child *child, int first, int last);
+void fdprobe_timeouts_changed(void);
+
+/* control.c */
+void control_listen(const char *path, struct uevent *uevent,
+		    struct list_head *list_of_domains);
+int control_may_advance(struct parent *parent);
+u64 control_max_jump();
+void control_advanced(struct parent *parent);
+void control_stuck(struct parent *parent);
+void control_poll();
+void control_free();
+
+/* latency.c */
+void latency_add(const char *spec);
+int latency_syscall_enter(struct child *child, struct trace_sysarg *sysarg);
+flux_time latency_next_release(struct parent *parent);
+int latency_deliver(struct parent *parent, u64 *wait_ns);
+void latency_free(struct parent *parent);
+
+/* profile.c */
+void profile_open(const char *path);
+void profile_blocked(struct child *child);
+void profile_unblocked(struct child *child);
+void profile_write();
+void profile_free();
+
+/* ns.c */
+void ns_unshare();
+void ns_free();
+
+/* critpath.c */
+void critpath_open(const char *path);
+void critpath_close();
+void critpath_domain(struct parent *parent);
+void critpath_child(struct child *child, struct child *forker);
+void critpath_syscall_enter(struct child *child, struct trace_sysarg *sysarg);
+void critpath_syscall_exit(struct child *child, struct trace_sysarg *sysarg);
+void critpath_exit(struct child *child);
+void critpath_report(struct parent *parent);
+
+/* lockstep.c */
+void lockstep_child(struct child *child);
+void lockstep_syscall_enter(struct child *child, struct trace_sysarg *sysarg);
+void lockstep_syscall_exit(struct child *child);
+void lockstep_exit(struct child *child);
+void lockstep_wake(struct child *child);
+void lockstep_signal(struct parent *parent);
+int lockstep_asleep(struct child *child);
+int lockstep_settle(struct parent *parent, u64 *wait_ns);
+
+/* timeline.c */
+void timeline_open(const char *path);
+void timeline_close();
+u64 timeline_clock();
+void timeline_domain(int domain);
+void timeline_blocked(int domain, int pid, int syscall_no, u64 start_ns);
+void timeline_settle(int domain, u64 start_ns);
+void timeline_jump(int domain, int pid, int syscall_no, flux_time speedup,
+		   flux_time time_drift);
 
 /* parent.c */
 #define TIMEOUT_UNKNOWN (-1LL)
@@ -118,11 +447,18 @@ void ping_myself();
 
 struct trace;
 struct trace_process;
-struct parent *parent_new();
+struct parent *parent_new(int id, char ***list_of_argv);
+void parent_free(struct parent *parent);
 void parent_run_one(struct parent *parent, struct trace *trace,
 		    char **child_argv);
 struct child *parent_min_timeout_child(struct parent *parent);
+flux_time parent_horizon(struct parent *parent);
+void parent_horizon_reached(struct parent *parent, struct trace *trace);
 struct child *parent_woken_child(struct parent *parent);
+int parent_fd_free(struct parent *parent);
+int parent_fast_forward_ok(struct parent *parent, struct child *child);
+void parent_note_advance(struct parent *parent, int pid, int syscall_no,
+			 flux_time speedup, u64 settle_start_ns);
 void parent_kill_all(struct parent *parent, int signo);
 
 struct child *child_new(struct parent *parent, struct trace_process *process, int pid);
@@ -130,11 +466,16 @@ void child_del(struct child *child);
 struct trace_sysarg;
 void child_mark_blocked(struct child *child);
 void child_mark_unblocked(struct child *child);
+void child_park(struct child *child, struct trace_sysarg *sysarg);
+void child_unpark(struct child *child, int timeout);
 
 
 void wrapper_syscall_enter(struct child *child, struct trace_sysarg *sysarg);
 int wrapper_syscall_exit(struct child *child, struct trace_sysarg *sysarg);
 void wrapper_pacify_signal(struct child *child, struct trace_sysarg *sysarg);
+int wrapper_interrupted(struct trace_sysarg *sysarg);
+int wrapper_frozen(struct child *child, struct trace_sysarg *sysarg);
+void wrapper_detach_enter(struct child *child, struct trace_sysarg *sysarg);
 
 
 
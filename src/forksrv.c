@@ -0,0 +1,356 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+#include "list.h"
+#include "types.h"
+#include "trace.h"
+#include "fluxcapacitor.h"
+#include "scnums.h"
+#include "uevent.h"
+
+extern struct options options;
+
+
+/* With --fork-server the command given to the daemon is not run for
+ * each job. It's started once, as the template, and initializes
+ * until it calls fluxcapacitor_fork_point() from the preload
+ * library. From there the template is a server: for each job we
+ * pass it the job request, the same one the daemon got, on
+ * FORKSRV_FD. It forks a copy, which returns from the fork point
+ * with the stdio, working directory and arguments of the job.
+ *
+ * The template runs in domain 0. A copy is put in the domain of the
+ * job it was forked for, from the fork on, with a clock that starts
+ * at the virtual time of the template. We tell the fork of a copy
+ * from the other forks of the template by the thread: the one that
+ * read the job. Jobs that come before the template is ready to read
+ * them wait in our queue, with copies of their descriptors. When the
+ * template can't fork a copy it sends back the errno, as a u32, and
+ * the job at the head of the queue fails. */
+
+struct fork_job {
+	struct fork_job *next;
+	struct parent *parent;
+	/* The client went away, kill the copy as soon as it's here. */
+	int cancelled;
+	/* Not sent yet: the request and our copies of the stdio. */
+	int sent;
+	char *buf;
+	size_t len;
+	int fds[3];
+};
+
+static struct {
+	struct uevent *uevent;
+	/* Our end of the socket, -1 when the template is gone. */
+	int sd;
+	/* Waiting for it to be writable. */
+	int blocked;
+	/* Its end, given to the template before exec. */
+	int template_sd;
+	struct parent *template;
+	int started;
+	/* The thread that reads jobs, once it did. */
+	struct child *server;
+	/* Jobs waiting to be sent, or for a copy, in order. */
+	struct fork_job *jobs;
+	struct fork_job **jobs_tail;
+	/* The copy on its way is for a cancelled job. */
+	int cancelled;
+} srv = {.sd = -1, .template_sd = -1};
+
+
+static void job_free(struct fork_job *job) {
+	int i;
+	for (i = 0; i < 3; i++) {
+		if (job->fds[i] != -1)
+			close(job->fds[i]);
+	}
+	free(job->buf);
+	free(job);
+}
+
+static void job_fail(struct fork_job *job) {
+	job->parent->forking = 0;
+	job->parent->exit_status = 127;
+	job_free(job);
+}
+
+static void jobs_fail() {
+	while (srv.jobs) {
+		struct fork_job *job = srv.jobs;
+		srv.jobs = job->next;
+		SHOUT("[-] Domain %i: no fork server", job->parent->id);
+		job_fail(job);
+	}
+	srv.jobs_tail = &srv.jobs;
+}
+
+/* The template is gone, or never got to the fork point. */
+static void server_gone() {
+	if (srv.sd == -1)
+		return;
+	SHOUT("[-] Fork server is gone");
+	uevent_clear(srv.uevent, srv.sd);
+	srv.blocked = 0;
+	close(srv.sd);
+	srv.sd = -1;
+	srv.server = NULL;
+	jobs_fail();
+}
+
+static int on_event(struct uevent *uevent, int sd, int mask,
+		    void *userdata);
+
+void forksrv_init(struct uevent *uevent) {
+	srv.uevent = uevent;
+	int sv[2];
+	if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, sv))
+		PFATAL("socketpair()");
+	srv.sd = sv[0];
+	srv.template_sd = sv[1];
+	srv.jobs_tail = &srv.jobs;
+	uevent_yield(srv.uevent, srv.sd, UEVENT_READ, on_event, NULL);
+}
+
+/* Run in the forked child before exec. Only the first command of
+ * domain 0 is the template. */
+void forksrv_preexec(void *userdata) {
+	struct parent *parent = userdata;
+	if (srv.template_sd == -1 || parent->id != 0 || srv.started)
+		return;
+	if (dup2(srv.template_sd, FORKSRV_FD) != FORKSRV_FD)
+		PFATAL("dup2()");
+	char buf[16];
+	snprintf(buf, sizeof(buf), "%i", FORKSRV_FD);
+	setenv("FLUXCAPACITOR_FORK_SERVER", buf, 1);
+}
+
+/* The template was started in `parent`. */
+void forksrv_started(struct parent *parent) {
+	if (srv.template_sd == -1 || parent->id != 0 || srv.started)
+		return;
+	srv.started = 1;
+	srv.template = parent;
+	close(srv.template_sd);
+	srv.template_sd = -1;
+}
+
+/* Pass `job` to the template. Returns -1 and sets errno if it
+ * can't take it. */
+static int job_send(struct fork_job *job) {
+	int n = 0, sent[3];
+	int i;
+	for (i = 0; i < 3; i++) {
+		if (job->fds[i] != -1)
+			sent[n++] = job->fds[i];
+	}
+	char cbuf[CMSG_SPACE(sizeof(sent))];
+	memset(cbuf, 0, sizeof(cbuf));
+	struct iovec iov = {job->buf, job->len};
+	struct msghdr msg;
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	if (n == 3) {
+		msg.msg_control = cbuf;
+		msg.msg_controllen = sizeof(cbuf);
+		struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+		cmsg->cmsg_level = SOL_SOCKET;
+		cmsg->cmsg_type = SCM_RIGHTS;
+		cmsg->cmsg_len = CMSG_LEN(sizeof(sent));
+		memcpy(CMSG_DATA(cmsg), sent, sizeof(sent));
+	}
+	ssize_t r = sendmsg(srv.sd, &msg, MSG_NOSIGNAL | MSG_DONTWAIT);
+	if (r >= 0 && r != (ssize_t)job->len) {
+		errno = EMSGSIZE;
+		r = -1;
+	}
+	return r < 0 ? -1 : 0;
+}
+
+/* Send the jobs in the queue, in order, as long as the template
+ * takes them. */
+static void jobs_flush() {
+	struct fork_job **pos = &srv.jobs;
+	while (*pos && (*pos)->sent)
+		pos = &(*pos)->next;
+	while (*pos) {
+		struct fork_job *job = *pos;
+		if (job_send(job)) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK) {
+				if (!srv.blocked)
+					uevent_yield(srv.uevent, srv.sd,
+						     UEVENT_WRITE, on_event,
+						     NULL);
+				srv.blocked = 1;
+				return;
+			}
+			SHOUT("[-] Domain %i: can't pass the job to the fork "
+			      "server: %s", job->parent->id, strerror(errno));
+			*pos = job->next;
+			job_fail(job);
+			continue;
+		}
+		job->sent = 1;
+		free(job->buf);
+		job->buf = NULL;
+		int i;
+		for (i = 0; i < 3; i++) {
+			if (job->fds[i] != -1)
+				close(job->fds[i]);
+			job->fds[i] = -1;
+		}
+		pos = &job->next;
+	}
+	srv.jobs_tail = pos;
+	if (srv.blocked) {
+		/* Back to waiting for errors only. */
+		uevent_clear(srv.uevent, srv.sd);
+		uevent_yield(srv.uevent, srv.sd, UEVENT_READ, on_event, NULL);
+	}
+	srv.blocked = 0;
+}
+
+/* The template couldn't fork a copy for the oldest job it has. */
+static void on_error() {
+	u32 code = 0;
+	ssize_t r = recv(srv.sd, &code, sizeof(code), MSG_DONTWAIT);
+	if (r < 0 && (errno == EAGAIN || errno == EINTR))
+		return;
+	if (r <= 0) {
+		server_gone();
+		return;
+	}
+	struct fork_job *job = srv.jobs;
+	if (!job || !job->sent)
+		return;
+	srv.jobs = job->next;
+	if (!srv.jobs)
+		srv.jobs_tail = &srv.jobs;
+	SHOUT("[-] Domain %i: the fork server can't fork: %s",
+	      job->parent->id, strerror(code));
+	job_fail(job);
+}
+
+static int on_event(struct uevent *uevent, int sd, int mask,
+		    void *userdata) {
+	if (mask & UEVENT_READ)
+		on_error();
+	if ((mask & UEVENT_WRITE) && srv.sd != -1)
+		jobs_flush();
+	return 0;
+}
+
+/* Pass the job of `parent`, `len` bytes of request and the three
+ * stdio descriptors, to the template. It's queued until the template
+ * can take it. */
+void forksrv_submit(struct parent *parent, const void *buf, size_t len,
+		    int fds[3]) {
+	parent->forking = 1;
+	if (srv.sd == -1) {
+		jobs_fail();
+		parent->forking = 0;
+		parent->exit_status = 127;
+		SHOUT("[-] Domain %i: no fork server", parent->id);
+		return;
+	}
+
+	struct fork_job *job = calloc(1, sizeof(struct fork_job));
+	job->parent = parent;
+	job->buf = malloc(len);
+	memcpy(job->buf, buf, len);
+	job->len = len;
+	int i;
+	for (i = 0; i < 3; i++) {
+		job->fds[i] = fds[i] == -1 ? -1 :
+			fcntl(fds[i], F_DUPFD_CLOEXEC, 0);
+	}
+	*srv.jobs_tail = job;
+	srv.jobs_tail = &job->next;
+	jobs_flush();
+}
+
+/* The client of the job of `parent` went away. */
+void forksrv_cancel(struct parent *parent) {
+	struct fork_job *job;
+	for (job = srv.jobs; job; job = job->next) {
+		if (job->parent == parent)
+			job->cancelled = 1;
+	}
+}
+
+void forksrv_syscall_enter(struct child *child, struct trace_sysarg *sysarg) {
+	if (child->parent != srv.template || srv.server == child)
+		return;
+	switch (sysarg->number) {
+#ifdef __NR_recvmsg
+	case __NR_recvmsg:
+#endif
+#ifdef __NR_recvfrom
+	case __NR_recvfrom:
+#endif
+		if (sysarg->arg1 != FORKSRV_FD)
+			return;
+		SHOUT("[.] %i is the fork server", child->pid);
+		srv.server = child;
+	}
+}
+
+/* The domain for the process `forker` just forked: the next job's if
+ * it's a copy, NULL otherwise. */
+struct parent *forksrv_domain(struct child *forker) {
+	if (!forker || forker != srv.server || !srv.jobs || !srv.jobs->sent)
+		return NULL;
+	struct fork_job *job = srv.jobs;
+	srv.jobs = job->next;
+	if (!srv.jobs)
+		srv.jobs_tail = &srv.jobs;
+
+	struct parent *parent = job->parent;
+	flux_time drift = forker->parent->time_drift;
+	flux_time delta = drift - parent->time_drift;
+	parent->time_drift = drift;
+	parent->start_drift = drift;
+	if (parent->until && options.until_ns)
+		parent->until += delta;
+	if (parent->next_checkpoint)
+		parent->next_checkpoint += delta;
+	parent->forking = 0;
+	srv.cancelled = job->cancelled;
+	job_free(job);
+	return parent;
+}
+
+/* `child` is the copy, in the domain forksrv_domain() returned. */
+void forksrv_copy(struct child *child) {
+	struct parent *parent = child->parent;
+	if (srv.cancelled) {
+		srv.cancelled = 0;
+		child_kill(child, SIGKILL);
+		return;
+	}
+	SHOUT("[+] Domain %i: %i forked by the fork server",
+	      parent->id, child->pid);
+}
+
+void forksrv_exit(struct child *child) {
+	if (child == srv.server ||
+	    (child->parent == srv.template &&
+	     child->parent->child_count == 1))
+		server_gone();
+}
+
+void forksrv_free() {
+	server_gone();
+	if (srv.template_sd != -1)
+		close(srv.template_sd);
+	srv.template_sd = -1;
+}
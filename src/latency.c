@@ -0,0 +1,716 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "list.h"
+#include "types.h"
+#include "trace.h"
+#include "fluxcapacitor.h"
+#include "scnums.h"
+
+extern struct options options;
+
+
+/* Data sent over loopback to or from a --latency port is taken away
+ * from the sender on syscall entry, as if the kernel accepted all of
+ * it, and delivered by us once the virtual clock of the domain gets
+ * to the send time plus the latency. We deliver through a copy of the
+ * sender's socket taken with pidfd_getfd(), in order per socket.
+ * Everything the sender does to the socket takes its turn behind the
+ * data: flags and ancillary data go with it, shutdown() is queued
+ * too. parent_horizon() makes sure the clock stops at every delivery.
+ *
+ * sendfile() and splice() to such a socket are taken over by reading
+ * their input ourselves, from a regular file or what a pipe or socket
+ * holds. If the input has nothing for us yet, the call goes through,
+ * after we send what was queued on the socket ahead of the delay.
+ *
+ * There's no backpressure: a fast sender fills our memory instead of
+ * its socket buffer. Skipping the syscall needs orig_eax/orig_rax,
+ * so this is x86 only, like fast forwarding. */
+
+#define LATENCY_RULES 64
+#define LATENCY_MAX_LEN (16 * 1024 * 1024)
+#define LATENCY_MAX_CONTROL (64 * 1024)
+
+struct rule {
+	u16 port;
+	flux_time delay;
+	flux_time jitter;
+};
+
+struct packet {
+	struct list_head in_packets;
+	flux_time release;
+	/* A shutdown(), with `how`, rather than data. */
+	int shutdown;
+	int how;
+	int flags;
+	socklen_t addrlen;
+	struct sockaddr_storage addr;
+	/* Ancillary data first, then the data. */
+	size_t controllen;
+	size_t len;
+	size_t off;
+	char data[];
+};
+
+/* Our copy of a socket with data in flight. */
+struct delayed_socket {
+	struct list_head in_sockets;
+	struct parent *parent;
+	ino_t ino;
+	int fd;
+	int stalled;		/* full on the last try */
+	struct list_head list_of_packets;
+};
+
+static struct {
+	int rules_count;
+	struct rule rules[LATENCY_RULES];
+
+	struct list_head list_of_sockets;
+} latency = {.list_of_sockets = LIST_HEAD_INIT(latency.list_of_sockets)};
+
+
+/* PORTS:DELAY[:JITTER], like 8080,8081:50ms:10ms */
+void latency_add(const char *spec) {
+	char *s = strdup(spec);
+	char *ports = s, *delay, *jitter;
+	u64 delay_ns, jitter_ns = 0;
+
+	delay = strchr(ports, ':');
+	if (!delay)
+		goto error;
+	*delay++ = '\0';
+	jitter = strchr(delay, ':');
+	if (jitter)
+		*jitter++ = '\0';
+	if (str_to_time(delay, &delay_ns) ||
+	    (jitter && str_to_time(jitter, &jitter_ns)))
+		goto error;
+
+	char *port, *saveptr = NULL;
+	for (port = strtok_r(ports, ",", &saveptr); port;
+	     port = strtok_r(NULL, ",", &saveptr)) {
+		char *end;
+		long p = strtol(port, &end, 10);
+		if (end == port || *end || p <= 0 || p > 65535)
+			goto error;
+		if (latency.rules_count == LATENCY_RULES)
+			FATAL("Too many --latency ports");
+		latency.rules[latency.rules_count++] =
+			(struct rule){p, delay_ns, jitter_ns};
+	}
+	free(s);
+	return;
+error:
+	FATAL("Expected PORTS:DELAY[:JITTER], got \"%s\"", spec);
+}
+
+static struct rule *rule_for(struct sockaddr_storage *ss) {
+	int port;
+	if (ss->ss_family == AF_INET) {
+		struct sockaddr_in *sin = (struct sockaddr_in *)ss;
+		if ((ntohl(sin->sin_addr.s_addr) >> 24) != 127)
+			return NULL;
+		port = ntohs(sin->sin_port);
+	} else if (ss->ss_family == AF_INET6) {
+		struct sockaddr_in6 *sin6 = (struct sockaddr_in6 *)ss;
+		if (!IN6_IS_ADDR_LOOPBACK(&sin6->sin6_addr))
+			return NULL;
+		port = ntohs(sin6->sin6_port);
+	} else {
+		return NULL;
+	}
+	int i;
+	for (i = 0; i < latency.rules_count; i++) {
+		if (latency.rules[i].port == port)
+			return &latency.rules[i];
+	}
+	return NULL;
+}
+
+/* The rules for the addresses of socket `fd`, kept with what
+ * fdprobe.c knows about the descriptor until it's closed, bound or
+ * connected again. */
+static void socket_rules(int fd, struct fd_info *info) {
+	struct sockaddr_storage ss;
+	socklen_t len = sizeof(ss);
+	info->name_rule = NULL;
+	info->peer_rule = NULL;
+	if (getsockname(fd, (struct sockaddr *)&ss, &len) == 0)
+		info->name_rule = rule_for(&ss);
+	len = sizeof(ss);
+	if (getpeername(fd, (struct sockaddr *)&ss, &len) == 0)
+		info->peer_rule = rule_for(&ss);
+	len = sizeof(info->sock_type);
+	if (getsockopt(fd, SOL_SOCKET, SO_TYPE, &info->sock_type, &len))
+		info->sock_type = 0;
+	info->rules_known = 1;
+}
+
+static struct delayed_socket *socket_find(struct parent *parent, ino_t ino) {
+	struct list_head *pos;
+	list_for_each(pos, &latency.list_of_sockets) {
+		struct delayed_socket *sock =
+			hlist_entry(pos, struct delayed_socket, in_sockets);
+		if (sock->ino == ino && sock->parent == parent)
+			return sock;
+	}
+	return NULL;
+}
+
+/* Our copy of the socket `tracee_fd` of the child, if a rule applies
+ * to data sent on it, to `addr` if given. */
+static struct delayed_socket *socket_get(struct child *child, long tracee_fd,
+					 struct sockaddr_storage *addr,
+					 struct rule **rule_ptr,
+					 int *sock_type) {
+	struct fd_info *info = fdprobe_fd(child, tracee_fd);
+	if (!info || !info->is_socket)
+		return NULL;
+	if (!info->rules_known) {
+		int fd = fdprobe_getfd(child, tracee_fd);
+		if (fd == -1)
+			return NULL;
+		socket_rules(fd, info);
+		close(fd);
+	}
+	struct rule *rule = info->name_rule;
+	if (!rule)
+		rule = addr ? rule_for(addr) : info->peer_rule;
+	if (!rule)
+		return NULL;
+	*rule_ptr = rule;
+	*sock_type = info->sock_type;
+
+	ino_t ino = info->ino;
+	struct delayed_socket *sock = socket_find(child->parent, ino);
+	if (sock)
+		return sock;
+	int fd = fdprobe_getfd(child, tracee_fd);
+	if (fd == -1)
+		return NULL;
+	sock = calloc(1, sizeof(struct delayed_socket));
+	sock->parent = child->parent;
+	sock->ino = ino;
+	sock->fd = fd;
+	INIT_LIST_HEAD(&sock->list_of_packets);
+	list_add_tail(&sock->in_sockets, &latency.list_of_sockets);
+	return sock;
+}
+
+static void socket_free(struct delayed_socket *sock) {
+	struct list_head *pos, *tmp;
+	list_for_each_safe(pos, tmp, &sock->list_of_packets) {
+		list_del(pos);
+		free(hlist_entry(pos, struct packet, in_packets));
+	}
+	list_del(&sock->in_sockets);
+	close(sock->fd);
+	free(sock);
+}
+
+/* Gather `count` iovecs from the tracee. Returns -1 if we can't. */
+static int iov_get(struct child *child, unsigned long iov_addr, long count,
+		   struct iovec *iov) {
+	if (count < 0 || count > IOV_MAX ||
+	    copy_from_user_unaligned(child->process, iov, iov_addr,
+				     count * sizeof(struct iovec)))
+		return -1;
+	return 0;
+}
+
+/* Total length of the iovecs, LATENCY_MAX_LEN + 1 if it's more. */
+static long iov_len(struct iovec *iov, long count) {
+	long i, len = 0;
+	for (i = 0; i < count; i++) {
+		if (iov[i].iov_len > LATENCY_MAX_LEN)
+			return LATENCY_MAX_LEN + 1;
+		len += iov[i].iov_len;
+		if (len > LATENCY_MAX_LEN)
+			return LATENCY_MAX_LEN + 1;
+	}
+	return len;
+}
+
+/* Copy the first `len` bytes of the iovecs. */
+static int iov_copy(struct child *child, char *dst, struct iovec *iov,
+		    long count, long len) {
+	long i;
+	for (i = 0; i < count && len; i++) {
+		size_t part = MIN(iov[i].iov_len, (size_t)len);
+		if (part &&
+		    copy_from_user_unaligned(child->process, dst,
+					     (unsigned long)iov[i].iov_base,
+					     part))
+			return -1;
+		dst += part;
+		len -= part;
+	}
+	return 0;
+}
+
+/* Send what's due on `sock` at `now`. Returns 1 if something was
+ * sent. If the receiver is too slow to take it, lowers `wait_ns` to
+ * try again. */
+static int socket_deliver(struct delayed_socket *sock, flux_time now,
+			  u64 *wait_ns) {
+	int sent = 0;
+	sock->stalled = 0;
+	while (!list_empty(&sock->list_of_packets)) {
+		struct packet *packet =
+			hlist_entry(sock->list_of_packets.next,
+				    struct packet, in_packets);
+		if (packet->release > now)
+			break;
+		if (packet->shutdown) {
+			if (shutdown(sock->fd, packet->how))
+				SHOUT("[ ] Delayed shutdown(): %s",
+				      strerror(errno));
+			sent = 1;
+			list_del(&packet->in_packets);
+			free(packet);
+			continue;
+		}
+		/* The ancillary data goes with the first part. */
+		struct iovec iov = {
+			packet->data + packet->controllen + packet->off,
+			packet->len - packet->off};
+		struct msghdr msg = {
+			.msg_name = packet->addrlen ? &packet->addr : NULL,
+			.msg_namelen = packet->addrlen,
+			.msg_iov = &iov,
+			.msg_iovlen = 1,
+			.msg_control = packet->off || !packet->controllen ?
+				NULL : packet->data,
+			.msg_controllen = packet->off ? 0 : packet->controllen};
+		ssize_t r = sendmsg(sock->fd, &msg, packet->flags |
+				    MSG_DONTWAIT | MSG_NOSIGNAL);
+		if (r < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+			sock->stalled = 1;
+			*wait_ns = MIN(*wait_ns, 1000000ULL);
+			break;
+		}
+		if (r < 0) {
+			SHOUT("[ ] Dropping %zu delayed bytes: %s",
+			      packet->len - packet->off, strerror(errno));
+			r = packet->len - packet->off;
+		}
+		sent = 1;
+		packet->off += r;
+		if (packet->off < packet->len)
+			continue;
+		list_del(&packet->in_packets);
+		free(packet);
+	}
+	return sent;
+}
+
+
+#if defined(__x86_64__) || defined(__i386__)
+/* Uniform in [0, n], n below 2^62. */
+static u64 random_upto(u64 n) {
+	u64 range = n + 1;
+	u64 limit = ((1ULL << 62) / range) * range;
+	u64 r;
+	do {
+		r = ((u64)random() << 31 | (u64)random()) & ((1ULL << 62) - 1);
+	} while (r >= limit);
+	return r % range;
+}
+
+/* Put `packet` at the end of the queue of `sock`, after the delay of
+ * `rule`. Returns the delay. */
+static flux_time packet_queue(struct child *child, struct delayed_socket *sock,
+			      struct rule *rule, struct packet *packet) {
+	/* In order on the same socket, the jitter can't reorder. */
+	flux_time delay = rule->delay;
+	if (rule->jitter)
+		delay += (flux_time)random_upto(2 * rule->jitter) -
+			rule->jitter;
+	/* Not uevent_now, which may lag behind the clock the sender
+	 * just read. */
+	struct timespec ts;
+	clock_gettime(CLOCK_REALTIME, &ts);
+	flux_time now = (flux_time)TIMESPEC_NSEC(&ts) +
+		child->parent->time_drift;
+	packet->release = now + MAX(delay, 0);
+	if (!list_empty(&sock->list_of_packets)) {
+		struct packet *last = hlist_entry(sock->list_of_packets.prev,
+						  struct packet, in_packets);
+		packet->release = MAX(packet->release, last->release);
+	}
+	list_add_tail(&packet->in_packets, &sock->list_of_packets);
+	return packet->release - now;
+}
+
+/* Skip the syscall, it returns `ret`. */
+static void skip_syscall(struct child *child, struct trace_sysarg *sysarg,
+			 long ret) {
+	sysarg->number = -1;
+	trace_setregs(child->process, sysarg);
+	child->skipped = 1;
+	child->skipped_ret = ret;
+}
+
+/* A shutdown() for writing of a socket with data still queued waits
+ * for the data. Returns 1 if it was queued. */
+static int shutdown_enter(struct child *child, struct trace_sysarg *sysarg) {
+	if (sysarg->arg2 != SHUT_WR && sysarg->arg2 != SHUT_RDWR)
+		return 0;
+	struct fd_info *info = fdprobe_fd(child, sysarg->arg1);
+	if (!info || !info->is_socket)
+		return 0;
+	struct delayed_socket *sock = socket_find(child->parent, info->ino);
+	if (!sock || list_empty(&sock->list_of_packets))
+		return 0;
+
+	struct packet *last = hlist_entry(sock->list_of_packets.prev,
+					  struct packet, in_packets);
+	struct packet *packet = calloc(1, sizeof(struct packet));
+	packet->shutdown = 1;
+	packet->how = sysarg->arg2;
+	packet->release = last->release;
+	list_add_tail(&packet->in_packets, &sock->list_of_packets);
+
+	PRINT(" ~  %i shutdown() waits for the delayed data", child->pid);
+	skip_syscall(child, sysarg, 0);
+	return 1;
+}
+
+/* Queue a message sent on `fd` by `child`, with its ancillary data
+ * and address. Returns how many bytes were taken, -1 if the socket
+ * isn't ours to delay or the message can't be read. */
+static long msg_enter(struct child *child, struct trace_sysarg *sysarg,
+		      long fd, struct iovec *iov, long count, int flags,
+		      unsigned long addr, socklen_t addrlen,
+		      unsigned long control, size_t controllen) {
+	/* The rest of the flags are ours to pass on. A fast open
+	 * connects, the socket can't have anything queued. */
+	if (flags & MSG_FASTOPEN || controllen > LATENCY_MAX_CONTROL)
+		return -1;
+	flags &= ~MSG_DONTWAIT;
+
+	struct sockaddr_storage ss;
+	if (addr) {
+		if (addrlen > sizeof(ss) ||
+		    copy_from_user_unaligned(child->process, &ss, addr,
+					     addrlen))
+			return -1;
+	}
+
+	struct rule *rule;
+	int sock_type;
+	struct delayed_socket *sock = socket_get(child, fd, addr ? &ss : NULL,
+						 &rule, &sock_type);
+	if (!sock)
+		return -1;
+
+	/* More than we're willing to hold is a short write. A
+	 * datagram that big fails anyway. */
+	long len = iov_len(iov, count);
+	if (len > LATENCY_MAX_LEN) {
+		if (sock_type != SOCK_STREAM)
+			return -1;
+		len = LATENCY_MAX_LEN;
+	}
+
+	struct packet *packet = calloc(1, sizeof(struct packet) +
+				       controllen + len);
+	if ((controllen &&
+	     copy_from_user_unaligned(child->process, packet->data, control,
+				      controllen)) ||
+	    iov_copy(child, packet->data + controllen, iov, count, len)) {
+		free(packet);
+		return -1;
+	}
+	packet->flags = flags;
+	packet->controllen = controllen;
+	packet->len = len;
+	if (addr) {
+		packet->addr = ss;
+		packet->addrlen = addrlen;
+	}
+	flux_time delay = packet_queue(child, sock, rule, packet);
+
+	PRINT(" ~  %i %s() of %li bytes delayed by %.3f sec",
+	      child->pid, syscall_to_str(sysarg->number), len,
+	      delay / 1000000000.);
+	return len;
+}
+
+#ifdef __NR_sendmmsg
+/* The messages of a sendmmsg(), one packet each. */
+static int sendmmsg_enter(struct child *child, struct trace_sysarg *sysarg) {
+	struct mmsghdr msgs[UIO_MAXIOV];
+	struct iovec iov[IOV_MAX];
+	unsigned long vec = sysarg->arg2;
+	long vlen = MIN((unsigned long)sysarg->arg3, UIO_MAXIOV);
+	/* We write msg_len back with copy_to_user(). */
+	if (!vlen || vec % sizeof(long) ||
+	    copy_from_user(child->process, msgs, vec, vlen * sizeof(msgs[0])))
+		return 0;
+
+	long i;
+	for (i = 0; i < vlen; i++) {
+		struct msghdr *msg = &msgs[i].msg_hdr;
+		long count = msg->msg_iovlen;
+		if (iov_get(child, (unsigned long)msg->msg_iov, count, iov))
+			break;
+		long len = msg_enter(child, sysarg, sysarg->arg1, iov, count,
+				     sysarg->arg4, (unsigned long)msg->msg_name,
+				     msg->msg_namelen,
+				     (unsigned long)msg->msg_control,
+				     msg->msg_controllen);
+		if (len < 0)
+			break;
+		msgs[i].msg_len = len;
+		/* Short, the caller sends the rest again. */
+		if (len < iov_len(iov, count)) {
+			i += 1;
+			break;
+		}
+	}
+	if (!i)
+		return 0;
+	if (copy_to_user(child->process, vec, msgs, i * sizeof(msgs[0])))
+		SHOUT("[ ] %i: can't write back sendmmsg() lengths",
+		      child->pid);
+	skip_syscall(child, sysarg, i);
+	return 1;
+}
+#endif
+
+/* Read up to `len` bytes of `fd`, our copy of a descriptor of the
+ * child, without blocking: at `*off`, if given, of a regular file, or
+ * what a pipe holds. Returns -1 if there's nothing for us yet. */
+static long input_read(int fd, int pipe_only, long long *off, char *buf,
+		       long len) {
+	struct stat st;
+	if (fstat(fd, &st) || (pipe_only && !S_ISFIFO(st.st_mode)))
+		return -1;
+	if (S_ISREG(st.st_mode)) {
+		if (off)
+			return pread(fd, buf, len, *off);
+		return read(fd, buf, len);
+	}
+	if (off)
+		return -1;
+	int avail;
+	if (ioctl(fd, FIONREAD, &avail) || avail <= 0)
+		return -1;
+	return read(fd, buf, MIN(len, (long)avail));
+}
+
+/* sendfile() or splice() from `in_fd` to `out_fd`, `off` pointing to
+ * the input offset of `off_size` bytes, if any. */
+static int copy_enter(struct child *child, struct trace_sysarg *sysarg,
+		      long in_fd, unsigned long off, size_t off_size,
+		      long out_fd, unsigned long count) {
+	struct rule *rule;
+	int sock_type;
+	struct delayed_socket *sock = socket_get(child, out_fd, NULL, &rule,
+						 &sock_type);
+	if (!sock)
+		return 0;
+
+	long long offset = 0;
+	long len = MIN(count, (unsigned long)LATENCY_MAX_LEN);
+	struct packet *packet = calloc(1, sizeof(struct packet) + len);
+	int fd = fdprobe_getfd(child, in_fd);
+	long r = -1;
+	if (fd != -1) {
+		if (!off || !copy_from_user_unaligned(child->process, &offset,
+						      off, off_size))
+			r = input_read(fd, sysarg->number != __NR_sendfile,
+				       off ? &offset : NULL, packet->data,
+				       len);
+		close(fd);
+	}
+	if (r < 0) {
+		free(packet);
+		if (list_empty(&sock->list_of_packets))
+			return 0;
+		/* It would overtake the delayed data. */
+		u64 wait_ns = ~0ULL;
+		socket_deliver(sock, LLONG_MAX, &wait_ns);
+		PRINT(" ~  %i %s() has nothing to delay yet, delayed data "
+		      "sent now", child->pid, syscall_to_str(sysarg->number));
+		return 0;
+	}
+	if (off) {
+		offset += r;
+		if (copy_to_user(child->process, off, &offset, off_size)) {
+			free(packet);
+			return 0;
+		}
+	}
+	if (!r) {
+		free(packet);
+		skip_syscall(child, sysarg, 0);
+		return 1;
+	}
+	packet->len = r;
+	flux_time delay = packet_queue(child, sock, rule, packet);
+
+	PRINT(" ~  %i %s() of %li bytes delayed by %.3f sec",
+	      child->pid, syscall_to_str(sysarg->number), r,
+	      delay / 1000000000.);
+	skip_syscall(child, sysarg, r);
+	return 1;
+}
+#endif
+
+/* Take over a write to a --latency socket, or a shutdown() that has
+ * to wait behind one. Returns 1 if the syscall was skipped and
+ * queued. */
+int latency_syscall_enter(struct child *child, struct trace_sysarg *sysarg) {
+#if defined(__x86_64__) || defined(__i386__)
+	if (!latency.rules_count)
+		return 0;
+
+	struct iovec iov_buf[IOV_MAX];
+	struct iovec *iov = iov_buf;
+	long count = 1;
+	int flags = 0;
+	unsigned long addr = 0;
+	socklen_t addrlen = 0;
+	unsigned long control = 0;
+	size_t controllen = 0;
+
+	switch (sysarg->number) {
+	case __NR_write:
+		iov[0] = (struct iovec){(void *)sysarg->arg2, sysarg->arg3};
+		break;
+	case __NR_writev:
+		count = sysarg->arg3;
+		if (iov_get(child, sysarg->arg2, count, iov))
+			return 0;
+		break;
+#ifdef __NR_sendto
+	case __NR_sendto:
+		iov[0] = (struct iovec){(void *)sysarg->arg2, sysarg->arg3};
+		flags = sysarg->arg4;
+		addr = sysarg->arg5;
+		addrlen = sysarg->arg6;
+		break;
+#endif
+#ifdef __NR_sendmsg
+	case __NR_sendmsg: {
+		struct msghdr msg;
+		if (copy_from_user_unaligned(child->process, &msg, sysarg->arg2,
+					     sizeof(msg)))
+			return 0;
+		count = msg.msg_iovlen;
+		if (iov_get(child, (unsigned long)msg.msg_iov, count, iov))
+			return 0;
+		flags = sysarg->arg3;
+		addr = (unsigned long)msg.msg_name;
+		addrlen = msg.msg_namelen;
+		/* Copied as is. A --latency port is an inet one, there
+		 * are no descriptors to pass. */
+		control = (unsigned long)msg.msg_control;
+		controllen = msg.msg_controllen;
+		break; }
+#endif
+#ifdef __NR_sendmmsg
+	case __NR_sendmmsg:
+		return sendmmsg_enter(child, sysarg);
+#endif
+#ifdef __NR_sendfile
+	case __NR_sendfile:
+		return copy_enter(child, sysarg, sysarg->arg2, sysarg->arg3,
+				  sizeof(long), sysarg->arg1, sysarg->arg4);
+#endif
+#ifdef __NR_splice
+	case __NR_splice:
+		return copy_enter(child, sysarg, sysarg->arg1, sysarg->arg2,
+				  sizeof(long long), sysarg->arg3,
+				  sysarg->arg5);
+#endif
+#ifdef __NR_shutdown
+	case __NR_shutdown:
+		return shutdown_enter(child, sysarg);
+#endif
+	default:
+		return 0;
+	}
+
+	long len = msg_enter(child, sysarg, sysarg->arg1, iov, count, flags,
+			     addr, addrlen, control, controllen);
+	if (len < 0)
+		return 0;
+	skip_syscall(child, sysarg, len);
+	return 1;
+#else
+	return 0;
+#endif
+}
+
+/* Earliest virtual instant we have something to deliver in `parent`,
+ * 0 if none. */
+flux_time latency_next_release(struct parent *parent) {
+	flux_time next = 0;
+	struct list_head *pos;
+	list_for_each(pos, &latency.list_of_sockets) {
+		struct delayed_socket *sock =
+			hlist_entry(pos, struct delayed_socket, in_sockets);
+		if (sock->parent != parent || sock->stalled ||
+		    list_empty(&sock->list_of_packets))
+			continue;
+		struct packet *packet =
+			hlist_entry(sock->list_of_packets.next,
+				    struct packet, in_packets);
+		if (!next || packet->release < next)
+			next = packet->release;
+	}
+	return next;
+}
+
+/* Send what's due in `parent`. Returns 1 if something was sent. If a
+ * receiver is too slow to take it, lowers `wait_ns` to try again. */
+int latency_deliver(struct parent *parent, u64 *wait_ns) {
+	int sent = 0;
+	flux_time now = (flux_time)TIMESPEC_NSEC(&uevent_now) +
+		parent->time_drift;
+
+	struct list_head *pos, *tmp;
+	list_for_each_safe(pos, tmp, &latency.list_of_sockets) {
+		struct delayed_socket *sock =
+			hlist_entry(pos, struct delayed_socket, in_sockets);
+		if (sock->parent != parent)
+			continue;
+		if (socket_deliver(sock, now, wait_ns))
+			sent = 1;
+		/* The tracee may have closed its end: we hold the
+		 * socket open until everything is delivered. */
+		if (list_empty(&sock->list_of_packets))
+			socket_free(sock);
+	}
+	return sent;
+}
+
+/* Drop what's left for `parent`. */
+void latency_free(struct parent *parent) {
+	struct list_head *pos, *tmp;
+	list_for_each_safe(pos, tmp, &latency.list_of_sockets) {
+		struct delayed_socket *sock =
+			hlist_entry(pos, struct delayed_socket, in_sockets);
+		if (sock->parent == parent)
+			socket_free(sock);
+	}
+}
@@ -0,0 +1,484 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <linux/futex.h>
+
+#include "list.h"
+#include "types.h"
+#include "trace.h"
+#include "fluxcapacitor.h"
+#include "scnums.h"
+
+extern struct options options;
+
+
+/* With --lockstep only one tracee of a domain runs at a time, the
+ * `runner`. The others are held in ptrace stops:
+ *
+ *  - QUEUED at a syscall exit, or before they even started, until
+ *    it's their turn;
+ *  - WAITING at the entry of a wait that would block: a sleep, or a
+ *    poll(), select(), epoll_wait(), read(), recv() or accept() on
+ *    descriptors that aren't ready. They don't go to the kernel.
+ *
+ * The runner goes on through the syscalls that return right away,
+ * and gives way on the exit of one if somebody is queued, or when
+ * it's about to wait. A wait we can't look into, like futex() or
+ * wait4(), goes to the kernel as usual: the tracee is in the KERNEL
+ * until it's back. A WAITING tracee is let go when a descriptor it
+ * waits on gets ready, when a signal comes for it, or when its
+ * timeout is due. Then the syscall returns right away and it's
+ * WAKING until the exit.
+ *
+ * So when nobody runs and everyone is WAITING, we know the domain is
+ * idle as soon as we checked their descriptors: no sched_yield(), no
+ * /proc, no ping_myself(). The tracees take turns at known points,
+ * which makes runs more reproducible. A runner that makes no
+ * syscalls can't be stopped, one stuck in a syscall we thought
+ * wouldn't block is let go after LOCKSTEP_STUCK_NS. */
+
+enum {
+	LOCKSTEP_NONE,
+	LOCKSTEP_RUNNING,
+	LOCKSTEP_QUEUED,
+	LOCKSTEP_WAITING,
+	LOCKSTEP_WAKING,
+	LOCKSTEP_KERNEL,
+};
+
+#define LOCKSTEP_STUCK_NS (10 * 1000000ULL)
+
+#ifndef FUTEX_CMD_MASK
+# define FUTEX_CMD_MASK ~(FUTEX_PRIVATE_FLAG | FUTEX_CLOCK_REALTIME)
+#endif
+
+
+/* Can `sysarg` make a descriptor ready for somebody else? */
+static int syscall_wakes(struct trace_sysarg *sysarg) {
+	switch (sysarg->number) {
+	case __NR_write:
+	case __NR_writev:
+	case __NR_pwrite64:
+	case __NR_read:
+	case __NR_readv:
+	case __NR_close:
+	case __NR_dup2:
+	case __NR_dup3:
+	case __NR_execve:
+	case __NR_sendmmsg:
+	case __NR_sendfile:
+	case __NR_splice:
+	case __NR_tee:
+	case __NR_vmsplice:
+	case __NR_epoll_ctl:
+#ifdef __NR_sendto
+	case __NR_sendto:
+#endif
+#ifdef __NR_sendmsg
+	case __NR_sendmsg:
+#endif
+#ifdef __NR_recvfrom
+	case __NR_recvfrom:
+#endif
+#ifdef __NR_recvmsg
+	case __NR_recvmsg:
+#endif
+#ifdef __NR_accept
+	case __NR_accept:
+#endif
+#ifdef __NR_accept4
+	case __NR_accept4:
+#endif
+#ifdef __NR_connect
+	case __NR_connect:
+#endif
+#ifdef __NR_shutdown
+	case __NR_shutdown:
+#endif
+		return 1;
+	}
+	return 0;
+}
+
+static int syscall_signals(struct trace_sysarg *sysarg) {
+	switch (sysarg->number) {
+	case __NR_kill:
+	case __NR_tkill:
+	case __NR_tgkill:
+	case __NR_rt_sigqueueinfo:
+	case __NR_rt_tgsigqueueinfo:
+		return 1;
+	}
+	return 0;
+}
+
+/* What becomes of the runner entering `sysarg`: still RUNNING if
+ * the syscall returns right away, WAITING, or in the KERNEL. */
+static int syscall_state(struct child *child, struct trace_sysarg *sysarg) {
+	if (child->skipped)
+		return LOCKSTEP_RUNNING;
+
+	switch (sysarg->number) {
+	case __NR_nanosleep:
+	case __NR_poll:
+	case __NR_ppoll:
+#ifdef __NR_select
+	case __NR_select:
+#endif
+#ifdef __NR__newselect
+	case __NR__newselect:
+#endif
+	case __NR_pselect6:
+	case __NR_epoll_wait:
+	case __NR_epoll_pwait:
+	case __NR_read:
+	case __NR_readv:
+#ifdef __NR_accept
+	case __NR_accept:
+#endif
+#ifdef __NR_accept4
+	case __NR_accept4:
+#endif
+		break;
+
+#ifdef __NR_recvfrom
+	case __NR_recvfrom:
+		if (sysarg->arg4 & MSG_DONTWAIT)
+			return LOCKSTEP_RUNNING;
+		break;
+#endif
+#ifdef __NR_recvmsg
+	case __NR_recvmsg:
+		if (sysarg->arg3 & MSG_DONTWAIT)
+			return LOCKSTEP_RUNNING;
+		break;
+#endif
+
+	case __NR_futex:
+		switch (sysarg->arg2 & FUTEX_CMD_MASK) {
+		case FUTEX_WAKE:
+		case FUTEX_WAKE_OP:
+		case FUTEX_WAKE_BITSET:
+		case FUTEX_REQUEUE:
+		case FUTEX_CMP_REQUEUE:
+		case FUTEX_UNLOCK_PI:
+			return LOCKSTEP_RUNNING;
+		}
+		return LOCKSTEP_KERNEL;
+
+	case __NR_wait4:
+	case __NR_waitid:
+	case __NR_pause:
+	case __NR_rt_sigsuspend:
+	case __NR_rt_sigtimedwait:
+	case __NR_restart_syscall:
+	case __NR_flock:
+#ifdef __NR_msgrcv
+	case __NR_msgrcv:
+#endif
+#ifdef __NR_semop
+	case __NR_semop:
+#endif
+#ifdef __NR_semtimedop
+	case __NR_semtimedop:
+#endif
+		return LOCKSTEP_KERNEL;
+
+	default:
+		return LOCKSTEP_RUNNING;
+	}
+
+	/* A zero timeout, or one that's due already. */
+	flux_time now = (flux_time)TIMESPEC_NSEC(&uevent_now) +
+		child->parent->time_drift;
+	if (child->timed && child->blocked_until >= 0 &&
+	    child->blocked_until <= now)
+		return LOCKSTEP_RUNNING;
+
+	switch (fdprobe_child(child)) {
+	case 0:
+		return LOCKSTEP_WAITING;
+	case 1:
+		return LOCKSTEP_RUNNING;
+	}
+	return LOCKSTEP_KERNEL;
+}
+
+/* Does `child` have a signal to handle? Not one that would be
+ * ignored, and not ours: that one is sent on purpose. */
+static int signal_pending(struct child *child) {
+	char buf[2048];
+	int fd = trace_process_open(child->process, "status");
+	if (fd == -1)
+		return 0;
+	int r = read(fd, buf, sizeof(buf) - 1);
+	close(fd);
+	if (r <= 0)
+		return 0;
+	buf[r] = '\0';
+
+	const char *names[] = {"SigPnd:", "ShdPnd:", "SigBlk:", "SigIgn:",
+			       "SigCgt:"};
+	unsigned long long masks[5] = {0};
+	int i;
+	for (i = 0; i < 5; i++) {
+		char *p = strstr(buf, names[i]);
+		if (p)
+			masks[i] = strtoull(p + strlen(names[i]), NULL, 16);
+	}
+	unsigned long long bit = 1ULL << (options.signo - 1);
+	unsigned long long dfl_ign = 1ULL << (SIGCHLD - 1) |
+		1ULL << (SIGURG - 1) | 1ULL << (SIGWINCH - 1) |
+		1ULL << (SIGCONT - 1);
+	unsigned long long pending = (masks[0] | masks[1]) & ~masks[2] &
+		~masks[3] & ~(dfl_ign & ~masks[4]) & ~bit;
+	return pending != 0;
+}
+
+/* Let go the waiting tracees that got a signal, their syscall is
+ * interrupted right away. */
+static void signals(struct parent *parent) {
+	parent->lockstep_signalled = 0;
+	struct list_head *pos;
+	list_for_each(pos, &parent->list_of_children) {
+		struct child *child = hlist_entry(pos, struct child, in_children);
+		if (child->lockstep != LOCKSTEP_WAITING ||
+		    !signal_pending(child))
+			continue;
+		PRINT(" ~  %i signalled in %s()", child->pid,
+		      syscall_to_str(child->blocked_sysarg->number));
+		child->lockstep = LOCKSTEP_WAKING;
+		trace_release(child->process);
+	}
+}
+
+static void queue(struct child *child) {
+	child->lockstep = LOCKSTEP_QUEUED;
+	list_add_tail(&child->in_runnable, &child->parent->list_of_runnable);
+}
+
+static void run(struct child *child) {
+	struct parent *parent = child->parent;
+	if (parent->runner)
+		FATAL("");
+	if (child->lockstep == LOCKSTEP_QUEUED)
+		list_del(&child->in_runnable);
+	child->lockstep = LOCKSTEP_RUNNING;
+	child->lockstep_since_ns = monotonic_ns();
+	parent->runner = child;
+	trace_release(child->process);
+}
+
+/* Who runs next: a waiting tracee that got something to read, or
+ * the first one queued. */
+static struct child *pick(struct parent *parent, struct child *except) {
+	if (parent->lockstep_signalled)
+		signals(parent);
+
+	if (parent->lockstep_dirty) {
+		parent->lockstep_dirty = 0;
+		struct list_head *pos;
+		list_for_each(pos, &parent->list_of_children) {
+			struct child *child =
+				hlist_entry(pos, struct child, in_children);
+			if (child == except ||
+			    child->lockstep != LOCKSTEP_WAITING ||
+			    fdprobe_child(child) <= 0)
+				continue;
+			/* Others may be ready too, look again next
+			 * time. */
+			parent->lockstep_dirty = 1;
+			return child;
+		}
+	}
+
+	if (list_empty(&parent->list_of_runnable))
+		return NULL;
+	return hlist_entry(parent->list_of_runnable.next, struct child,
+			   in_runnable);
+}
+
+static void run_next(struct parent *parent, struct child *except) {
+	struct child *next = pick(parent, except);
+	if (next)
+		run(next);
+}
+
+
+/* A new tracee, before it ran anything. */
+void lockstep_child(struct child *child) {
+	if (!options.lockstep)
+		return;
+	struct parent *parent = child->parent;
+	if (!parent->runner) {
+		child->lockstep = LOCKSTEP_RUNNING;
+		parent->runner = child;
+		return;
+	}
+	trace_hold(child->process);
+	queue(child);
+}
+
+/* Call it after wrapper_syscall_enter(). */
+void lockstep_syscall_enter(struct child *child, struct trace_sysarg *sysarg) {
+	if (!options.lockstep)
+		return;
+	struct parent *parent = child->parent;
+	if (child != parent->runner)
+		FATAL("");
+
+	if (syscall_wakes(sysarg))
+		parent->lockstep_dirty = 1;
+	if (syscall_signals(sysarg))
+		parent->lockstep_signalled = 1;
+
+	int state = syscall_state(child, sysarg);
+	if (state == LOCKSTEP_RUNNING) {
+		child->lockstep_since_ns = monotonic_ns();
+		return;
+	}
+	if (state == LOCKSTEP_WAITING) {
+		PRINT(" ~  %i held in %s()", child->pid,
+		      syscall_to_str(sysarg->number));
+		trace_hold(child->process);
+	}
+	child->lockstep = state;
+	parent->runner = NULL;
+	run_next(parent, child);
+}
+
+/* Call it last on a syscall exit. */
+void lockstep_syscall_exit(struct child *child) {
+	if (!options.lockstep)
+		return;
+	struct parent *parent = child->parent;
+
+	switch (child->lockstep) {
+	case LOCKSTEP_RUNNING: {
+		/* Give way to whoever waits for their turn. */
+		if (list_empty(&parent->list_of_runnable) &&
+		    !parent->lockstep_dirty && !parent->lockstep_signalled)
+			return;
+		struct child *next = pick(parent, child);
+		if (!next)
+			return;
+		parent->runner = NULL;
+		trace_hold(child->process);
+		queue(child);
+		run(next);
+		return; }
+
+	case LOCKSTEP_WAKING:
+	case LOCKSTEP_KERNEL:
+		if (!parent->runner) {
+			child->lockstep = LOCKSTEP_RUNNING;
+			parent->runner = child;
+			return;
+		}
+		trace_hold(child->process);
+		queue(child);
+		return;
+	}
+	FATAL("");
+}
+
+/* Call it when `child` is gone. Its descriptors are closed and its
+ * parent gets a SIGCHLD. */
+void lockstep_exit(struct child *child) {
+	if (!options.lockstep)
+		return;
+	struct parent *parent = child->parent;
+	if (child->lockstep == LOCKSTEP_QUEUED)
+		list_del(&child->in_runnable);
+	child->lockstep = LOCKSTEP_NONE;
+	parent->lockstep_dirty = 1;
+	parent->lockstep_signalled = 1;
+	if (parent->runner != child)
+		return;
+	parent->runner = NULL;
+	run_next(parent, NULL);
+}
+
+/* The wait of `child` is over, its timeout is due and we sent it the
+ * signal. */
+void lockstep_wake(struct child *child) {
+	if (child->lockstep != LOCKSTEP_WAITING)
+		return;
+	if (!child->parent->runner) {
+		run(child);
+		return;
+	}
+	child->lockstep = LOCKSTEP_WAKING;
+	trace_release(child->process);
+}
+
+/* We sent signals to the tracees of `parent`. */
+void lockstep_signal(struct parent *parent) {
+	if (options.lockstep)
+		signals(parent);
+}
+
+/* Is `child` held in a wait that nothing can end but time? */
+int lockstep_asleep(struct child *child) {
+	return child->lockstep == LOCKSTEP_WAITING &&
+		!child->parent->lockstep_signalled &&
+		fdprobe_child(child) == 0;
+}
+
+/* Is the domain idle? 1 if everyone is WAITING and nothing they wait
+ * on is ready: only time can wake them. 0 if someone runs, or is
+ * about to. -1 if someone is in the KERNEL, only the usual
+ * heuristics can tell. */
+int lockstep_settle(struct parent *parent, u64 *wait_ns) {
+	struct child *runner = parent->runner;
+	if (runner && runner->blocked) {
+		u64 stuck = monotonic_ns() - runner->lockstep_since_ns;
+		if (stuck < LOCKSTEP_STUCK_NS) {
+			*wait_ns = MIN(*wait_ns, LOCKSTEP_STUCK_NS - stuck);
+			return 0;
+		}
+		SHOUT("[ ] %i stuck in %s(), letting others run",
+		      runner->pid,
+		      syscall_to_str(runner->blocked_sysarg->number));
+		runner->lockstep = LOCKSTEP_KERNEL;
+		parent->runner = NULL;
+		run_next(parent, NULL);
+	}
+	if (parent->runner)
+		return 0;
+
+	if (parent->lockstep_signalled)
+		signals(parent);
+
+	int unknown = 0;
+	struct list_head *pos;
+	list_for_each(pos, &parent->list_of_children) {
+		struct child *child = hlist_entry(pos, struct child, in_children);
+		switch (child->lockstep) {
+		case LOCKSTEP_WAITING:
+			switch (fdprobe_child(child)) {
+			case 0:
+				break;
+			case 1:
+				PRINT(" ~  %i woken in %s()", child->pid,
+				      syscall_to_str(child->blocked_sysarg->number));
+				run(child);
+				return 0;
+			default:
+				unknown = 1;
+			}
+			break;
+		case LOCKSTEP_KERNEL:
+			unknown = 1;
+			break;
+		default:
+			return 0;
+		}
+	}
+	return unknown ? -1 : 1;
+}
@@ -18,16 +18,76 @@ static void usage() {
 "Usage:\n"
 "\n"
 "    fluxcapacitor [options] [ -- command [ arguments ... ] ... ]\n"
+"                  [ --domain -- command [ arguments ... ] ... ]\n"
+"    fluxcapacitor [options] --daemon=SOCKET\n"
+"    fluxcapacitor [options] --submit=SOCKET -- command ...\n"
+"    fluxcapacitor [options] --attach=PID\n"
+"\n"
+"Commands after --domain run with a separate clock.\n"
 "\n"
 "Options:\n"
 "\n"
 "  --output=FILENAME    Write logs to FILENAME instead of stderr.\n"
 "  --libpath=PATH       Load " PRELOAD_LIBNAME " from\n"
-"                       selected PATH directory.\n"
+"                       selected PATH directory instead of the\n"
+"                       copy built in.\n"
 "  --signal=SIGNAL      Use specified signal to interrupt blocking\n"
 "                       syscall instead of SIGURG.\n"
+"  --cpus=LIST          Run commands in a dedicated cgroup on cpus\n"
+"                       from LIST (like 0-3,8) instead of pinning\n"
+"                       everything to a single cpu.\n"
+"  --tracer-cpu=CPU     Pin fluxcapacitor itself to CPU.\n"
+"  --cgroup=PATH        Create the cgroup under PATH (a cgroup v2\n"
+"                       directory). Implied by --cpus.\n"
+"  --freeze             Use the cgroup freezer to stop all commands\n"
+"                       while advancing time.\n"
+"  --lockstep           Run one command of a domain at a time, so\n"
+"                       that we know when they're all waiting.\n"
+"  --daemon=SOCKET      Keep running and accept jobs submitted on a\n"
+"                       unix SOCKET. Each job gets its own clock.\n"
+"  --submit=SOCKET      Run the command in the daemon listening on\n"
+"                       SOCKET and wait for it to finish.\n"
+"  --fork-server        With --daemon, start the command once and\n"
+"                       fork it for each job when it gets to\n"
+"                       fluxcapacitor_fork_point().\n"
+"  --stats=FILE         Write tracer statistics as JSON to FILE on\n"
+"                       exit.\n"
+"  --stats-socket=PATH  Serve live statistics on a unix socket.\n"
+"  --trace-out=FILE     Write a timeline of blocked syscalls and time\n"
+"                       jumps to FILE, in Chrome trace event format.\n"
+"  --profile=FILE       Write the stacks the virtual time was spent\n"
+"                       waiting in to FILE, as folded stacks for\n"
+"                       flame graphs.\n"
+"  --critical-path=FILE  Write to FILE the chain of waits, across\n"
+"                       commands, that set the virtual duration of\n"
+"                       each domain, and the slack of the others.\n"
+"  --until=TIME         Stop the clock after TIME of virtual time\n"
+"                       (like 90s, 36h or 14d), or at a DATE (like\n"
+"                       2030-01-01T00:00:00 UTC or @SECONDS), and\n"
+"                       send the until-signal to every command.\n"
+"  --until-signal=SIGNAL  Signal sent at --until, SIGTERM by\n"
+"                       default. SIGKILL follows 5 sec later.\n"
+"  --checkpoint=TIME:COMMAND  Run the shell COMMAND every TIME of\n"
+"                       virtual time, with the same clock.\n"
+"  --latency=PORTS:DELAY[:JITTER]  Deliver data sent over loopback\n"
+"                       to or from PORTS (like 80,443) after DELAY\n"
+"                       +/- JITTER of virtual time. Repeatable.\n"
+"  --control=PATH       Pause, step and query the clock through a\n"
+"                       unix socket.\n"
+"  --unshare            Run the commands in new user, network and\n"
+"                       PID namespaces, with a loopback of their own.\n"
+"  --attach=PID         Speed up the running process PID and its\n"
+"                       threads instead. Detach on SIGINT, SIGTERM\n"
+"                       or at --until, unless its clocks are\n"
+"                       ahead: then stop speeding it up.\n"
+"  --attach-tree=PID    Like --attach, with all the descendants of\n"
+"                       PID.\n"
+"  --drift=TIME         Start the clocks TIME ahead of the real time.\n"
 "  --verbose,-v         Print more stuff. Repeat for debugging\n"
 "                       messages.\n"
+"  --ring=FILE[:MB]     Log to a binary ring of MB megabytes (16 by\n"
+"                       default) instead, and read it later with\n"
+"                       fluxcapacitor-decode FILE.\n"
 "  --help               Print this message.\n"
 "\n"
 		);
@@ -39,16 +99,21 @@ static void usage() {
 /* Global */
 struct options options;
 
-static flux_time main_loop(char ***list_of_argv);
+static flux_time main_loop(char ***list_of_domains, int argc);
+
+/* Real time the tracees get to exit after the --until signal. */
+#define UNTIL_GRACE_NS (5 * 1000000000ULL)
 
 int main(int argc, char **argv) {
 
 	options.verbose = 0;
 	options.shoutstream = stderr;
 	options.signo = SIGURG;
+	options.tracer_cpu = -1;
+	options.until_signo = SIGTERM;
+	static char *checkpoint_argv[] = {"/bin/sh", "-c", NULL, NULL};
 
 	handle_backtrace();
-	pin_cpu();
 
 	optind = 1;
 	while (1) {
@@ -59,6 +124,29 @@ int main(int argc, char **argv) {
 			{"help",       no_argument,       0, 'h' },
 			{"verbose",    no_argument,       0, 'v' },
 			{"signal",     required_argument, 0,  0  },
+			{"cpus",       required_argument, 0,  0  },
+			{"tracer-cpu", required_argument, 0,  0  },
+			{"cgroup",     required_argument, 0,  0  },
+			{"freeze",     no_argument,       0,  0  },
+			{"lockstep",   no_argument,       0,  0  },
+			{"daemon",     required_argument, 0,  0  },
+			{"submit",     required_argument, 0,  0  },
+			{"fork-server", no_argument,      0,  0  },
+			{"stats",      required_argument, 0,  0  },
+			{"stats-socket", required_argument, 0, 0 },
+			{"trace-out",  required_argument, 0,  0  },
+			{"profile",    required_argument, 0,  0  },
+			{"critical-path", required_argument, 0, 0 },
+			{"until",      required_argument, 0,  0  },
+			{"until-signal", required_argument, 0, 0 },
+			{"checkpoint", required_argument, 0,  0  },
+			{"latency",    required_argument, 0,  0  },
+			{"control",    required_argument, 0,  0  },
+			{"unshare",    no_argument,       0,  0  },
+			{"attach",     required_argument, 0,  0  },
+			{"attach-tree", required_argument, 0, 0  },
+			{"drift",      required_argument, 0,  0  },
+			{"ring",       required_argument, 0,  0  },
 			{0,            0,                 0,  0  }
 		};
 
@@ -77,6 +165,79 @@ int main(int argc, char **argv) {
 				options.signo = str_to_signal(optarg);
 				if (!options.signo)
 					FATAL("Unrecognised signal \"%s\"", optarg);
+			} else if (0 == strcasecmp(opt_name, "cpus")) {
+				options.cpus = strdup(optarg);
+				options.use_cgroup = 1;
+			} else if (0 == strcasecmp(opt_name, "tracer-cpu")) {
+				char *end;
+				options.tracer_cpu = strtol(optarg, &end, 10);
+				if (end == optarg || *end || options.tracer_cpu < 0)
+					FATAL("Unrecognised cpu \"%s\"", optarg);
+			} else if (0 == strcasecmp(opt_name, "cgroup")) {
+				options.cgroup_parent = strdup(optarg);
+				options.use_cgroup = 1;
+			} else if (0 == strcasecmp(opt_name, "freeze")) {
+				options.freeze = 1;
+				options.use_cgroup = 1;
+			} else if (0 == strcasecmp(opt_name, "lockstep")) {
+				options.lockstep = 1;
+			} else if (0 == strcasecmp(opt_name, "daemon")) {
+				options.daemon = strdup(optarg);
+			} else if (0 == strcasecmp(opt_name, "submit")) {
+				options.submit = strdup(optarg);
+			} else if (0 == strcasecmp(opt_name, "fork-server")) {
+				options.fork_server = 1;
+			} else if (0 == strcasecmp(opt_name, "stats")) {
+				options.stats_file = strdup(optarg);
+			} else if (0 == strcasecmp(opt_name, "stats-socket")) {
+				options.stats_socket = strdup(optarg);
+			} else if (0 == strcasecmp(opt_name, "trace-out")) {
+				options.trace_out = strdup(optarg);
+			} else if (0 == strcasecmp(opt_name, "profile")) {
+				options.profile = strdup(optarg);
+			} else if (0 == strcasecmp(opt_name, "critical-path")) {
+				options.critpath = strdup(optarg);
+			} else if (0 == strcasecmp(opt_name, "until")) {
+				if (str_to_time(optarg, &options.until_ns) &&
+				    str_to_date(optarg, &options.until_date))
+					FATAL("Unrecognised time \"%s\"", optarg);
+			} else if (0 == strcasecmp(opt_name, "until-signal")) {
+				options.until_signo = str_to_signal(optarg);
+				if (!options.until_signo)
+					FATAL("Unrecognised signal \"%s\"", optarg);
+			} else if (0 == strcasecmp(opt_name, "checkpoint")) {
+				char *cmd = strchr(optarg, ':');
+				if (!cmd || !cmd[1])
+					FATAL("Expected INTERVAL:COMMAND, got \"%s\"",
+					      optarg);
+				*cmd = '\0';
+				if (str_to_time(optarg, &options.checkpoint_ns) ||
+				    !options.checkpoint_ns)
+					FATAL("Unrecognised time \"%s\"", optarg);
+				checkpoint_argv[2] = cmd + 1;
+				options.checkpoint_argv = checkpoint_argv;
+			} else if (0 == strcasecmp(opt_name, "latency")) {
+				latency_add(optarg);
+			} else if (0 == strcasecmp(opt_name, "control")) {
+				options.control = strdup(optarg);
+			} else if (0 == strcasecmp(opt_name, "unshare")) {
+				options.unshare = 1;
+			} else if (0 == strcasecmp(opt_name, "attach") ||
+				   0 == strcasecmp(opt_name, "attach-tree")) {
+				char *end;
+				options.attach_pid = strtol(optarg, &end, 10);
+				if (end == optarg || *end || options.attach_pid <= 0)
+					FATAL("Unrecognised pid \"%s\"", optarg);
+				options.attach_tree =
+					0 == strcasecmp(opt_name, "attach-tree");
+			} else if (0 == strcasecmp(opt_name, "drift")) {
+				if (str_to_time(optarg, &options.drift_ns))
+					FATAL("Unrecognised time \"%s\"", optarg);
+			} else if (0 == strcasecmp(opt_name, "ring")) {
+				options.ring = strdup(optarg);
+				/* Make sure there's something to be logged */
+				if (options.verbose == 0)
+					options.verbose += 1;
 			} else {
 				FATAL("Unknown option: %s", argv[optind]);
 			}
@@ -111,32 +272,98 @@ int main(int argc, char **argv) {
 		}
 	}
 
-	if (!argv[optind]) {
+	if (!argv[optind] && !options.daemon && !options.attach_pid) {
 		FATAL("You must specify at least one command to execute.");
 	}
 
-	char ***list_of_argv = argv_split(&argv[optind], "--", argc);
+	if (options.attach_pid &&
+	    (argv[optind] || options.daemon || options.checkpoint_argv ||
+	     options.use_cgroup || options.unshare))
+		FATAL("--attach doesn't work with commands, --daemon, "
+		      "--checkpoint, --unshare or a cgroup");
+
+	/* The freezer kicks tracees out of their syscalls, held ones
+	 * too. */
+	if (options.lockstep && options.freeze)
+		FATAL("--lockstep doesn't work with --freeze");
+
+	if (options.fork_server && (!options.daemon || !argv[optind]))
+		FATAL("--fork-server needs --daemon and a command");
+
+	/* The daemon does all the work. */
+	if (options.submit)
+		return daemon_submit(options.submit, &argv[optind]);
+
+	if (options.ring)
+		ring_open(options.ring);
 
-	ensure_libpath(argv[0]);
-	ldpreload_extend(options.libpath, PRELOAD_LIBNAME);
+	/* Each group of commands separated by "--domain" gets its
+	 * own clock. */
+	char ***list_of_domains = argv_split(&argv[optind], "--domain", argc);
+
+	/* Without a cpuset all the tracees share our cpu. */
+	if (!options.cpus || options.tracer_cpu != -1)
+		pin_cpu(options.tracer_cpu);
+
+	/* An explicit --libpath wins over the embedded library. */
+	if (!options.attach_pid &&
+	    (options.libpath || !ldpreload_embedded())) {
+		ensure_libpath(argv[0]);
+		ldpreload_extend(options.libpath, PRELOAD_LIBNAME);
+	}
 
 	SHOUT("--- Flux Capacitor ---\n");
 
-	SHOUT("[.] LD_PRELOAD=%s", ldpreload_get());
+	if (!options.attach_pid)
+		SHOUT("[.] LD_PRELOAD=%s", ldpreload_get());
+
+	if (options.use_cgroup)
+		cgroup_init(options.cgroup_parent, options.cpus);
+
+	if (options.unshare)
+		ns_unshare();
+
+	if (options.stats_file || options.stats_socket)
+		stats_init();
+	if (options.trace_out)
+		timeline_open(options.trace_out);
+	if (options.profile)
+		profile_open(options.profile);
+	if (options.critpath)
+		critpath_open(options.critpath);
+
+	u64 time_drift = main_loop(list_of_domains, argc);
+	ns_free();
 
-	u64 time_drift = main_loop(list_of_argv);
+	timeline_close();
+	profile_write();
+	profile_free();
+	critpath_close();
+
+	if (options.stats_file)
+		stats_write(options.stats_file);
+	counters_free();
+
+	if (options.use_cgroup)
+		cgroup_free();
 
 	free(options.libpath);
+	free(options.cgroup_parent);
+	free(options.cpus);
+	free(options.daemon);
+	free(options.stats_file);
+	free(options.stats_socket);
+	free(options.trace_out);
+	free(options.profile);
+	free(options.critpath);
+	free(options.control);
 	fflush(options.shoutstream);
-	char ***child_argv = list_of_argv;
-	while (*child_argv) {
-		free(*child_argv);
-		child_argv ++;
-	}
-	free(list_of_argv);
+	argv_free(list_of_domains);
 
 	PRINT(" ~  Exiting with code %i. Speedup %.3f sec.",
 	      options.exit_status, time_drift / 1000000000.);
+	ring_close();
+	free(options.ring);
 	return options.exit_status;
 }
 
@@ -155,10 +382,23 @@ static int on_trace_start(struct trace_process *process, int type, void *arg,
 			  void *userdata) {
 	if (type != TRACE_ENTER)
 		FATAL("");
-	int pid = (long)arg;
+	struct trace_enterarg *enterarg = arg;
+	int pid = enterarg->pid;
 	SHOUT("[+] %i started", pid);
+	/* Forked processes stay in the time domain of their parent. */
 	struct parent *parent = (struct parent *)userdata;
+	struct child *forker = enterarg->parent_userdata;
+	if (forker)
+		parent = forker->parent;
+	/* Unless it's a copy from the fork server. */
+	struct parent *job = forksrv_domain(forker);
+	if (job)
+		parent = job;
 	struct child *child = child_new(parent, process, pid);
+	critpath_child(child, job ? NULL : forker);
+	lockstep_child(child);
+	if (job)
+		forksrv_copy(child);
 	return trace_continue(process, on_trace, child);
 }
 
@@ -169,32 +409,50 @@ static int on_trace(struct trace_process *process, int type, void *arg,
 
 	case TRACE_EXIT: {
 		struct trace_exitarg *exitarg = arg;
+		unsigned status;
 		if (exitarg->type == TRACE_EXIT_NORMAL) {
 			SHOUT("[-] %i exited with return status %u",
 			      child->pid, exitarg->value);
-			options.exit_status = MAX(options.exit_status,
-						  (unsigned)exitarg->value);
+			status = exitarg->value;
 		} else {
 			SHOUT("[-] %i exited due to signal %u",
 			      child->pid, exitarg->value);
+			/* Like a shell, so that callers can tell. Not
+			 * if we killed it at --until. */
+			status = child->parent->until_reached_ns ? 0 :
+				128 + (unsigned)exitarg->value;
 		}
+		options.exit_status = MAX(options.exit_status, status);
+		child->parent->exit_status =
+			MAX(child->parent->exit_status, status);
 		child_del(child);
 		break; }
 
 	case TRACE_SYSCALL_ENTER: {
 		struct trace_sysarg *sysarg = arg;
 		child_mark_blocked(child);
+		if (!child->blocked_sysarg)
+			child->blocked_sysarg = malloc(sizeof(struct trace_sysarg));
+		*child->blocked_sysarg = *sysarg;
 		wrapper_syscall_enter(child, sysarg);
+		forksrv_syscall_enter(child, sysarg);
+		lockstep_syscall_enter(child, sysarg);
 		break; }
 
 	case TRACE_SYSCALL_EXIT: {
 		struct trace_sysarg *sysarg = arg;
+		if (child->parent->freezing && wrapper_frozen(child, sysarg)) {
+			child_park(child, sysarg);
+			break;
+		}
 		child_mark_unblocked(child);
 		wrapper_syscall_exit(child, sysarg);
+		attach_syscall_exit(child, sysarg);
 		if (child->interrupted) {
 			child->interrupted = 0;
 			wrapper_pacify_signal(child, sysarg);
 		}
+		lockstep_syscall_exit(child);
 		break; }
 
 	case TRACE_SIGNAL: {
@@ -203,6 +461,19 @@ static int on_trace(struct trace_process *process, int type, void *arg,
 			*signal_ptr = 0;
 		break; }
 
+	case TRACE_PID_CHANGE:
+		SHOUT("[ ] %i is now %i", child->pid, *(int *)arg);
+		child->pid = *(int *)arg;
+		break;
+
+	case TRACE_ATTACHED:
+		attach_patch(child);
+		break;
+
+	case TRACE_DETACH:
+		attach_detach(child, arg);
+		break;
+
 	default:
 		FATAL("");
 
@@ -210,28 +481,196 @@ static int on_trace(struct trace_process *process, int type, void *arg,
 	return 0;
 }
 
-static flux_time main_loop(char ***list_of_argv) {
+/* Is everyone still blocked parked on the syscall exit? */
+static int domains_parked(struct list_head *list_of_domains) {
+	struct list_head *pos, *dpos;
+	list_for_each(dpos, list_of_domains) {
+		struct parent *domain =
+			hlist_entry(dpos, struct parent, in_domains);
+		list_for_each(pos, &domain->list_of_blocked) {
+			struct child *child =
+				hlist_entry(pos, struct child, in_blocked);
+			if (!child->parked)
+				return 0;
+		}
+	}
+	return 1;
+}
+
+/* Stop every tracee with the cgroup freezer and only then advance
+ * the time, so that nobody can wake up in the meantime. The freezer
+ * kicks blocked tracees out of their syscalls, we park them on the
+ * syscall exit. Once everyone is frozen, the expired syscalls are
+ * made to time out and the others are restarted. The freezer stops
+ * all the domains, but only `parent` advances. Returns 0 if a
+ * tracee in `parent` woke up on its own and we should not advance. */
+static int freeze_advance(struct parent *parent,
+			  struct list_head *list_of_domains,
+			  struct uevent *uevent, flux_time speedup) {
 	struct timeval timeout;
+	struct list_head *pos, *tmp, *dpos;
 
-	struct parent *parent = parent_new();
-	struct trace *trace = trace_new(on_trace_start, parent);
-	struct uevent *uevent = uevent_new(NULL);
+	list_for_each(dpos, list_of_domains) {
+		hlist_entry(dpos, struct parent, in_domains)->freezing = 1;
+	}
+	cgroup_freeze(1);
+	/* The cgroup may look frozen before the tracees it kicked out
+	 * of their syscalls reached the exit stop. */
+	while (!cgroup_frozen() || !domains_parked(list_of_domains)) {
+		timeout = NSEC_TIMEVAL(100000ULL);
+		uevent_select(uevent, &timeout);
+	}
 
-	parent_run_one(parent, trace, *list_of_argv);
-	list_of_argv ++;
+	/* Anyone who returned from a syscall for real, or got a signal
+	 * while parked? */
+	int woken = parent->blocked_count != parent->child_count;
+	list_for_each(pos, &parent->list_of_children) {
+		struct child *child =
+			hlist_entry(pos, struct child, in_children);
+		if (child->parked && trace_signal_pending(child->process))
+			woken = 1;
+	}
+	if (!woken)
+		parent->time_drift += speedup;
+
+	list_for_each(dpos, list_of_domains) {
+		struct parent *domain =
+			hlist_entry(dpos, struct parent, in_domains);
+		domain->freezing = 0;
+
+		flux_time now = (flux_time)TIMESPEC_NSEC(&uevent_now) +
+			domain->time_drift;
+		list_for_each_safe(pos, tmp, &domain->list_of_children) {
+			struct child *child =
+				hlist_entry(pos, struct child, in_children);
+			if (!child->parked)
+				continue;
+			int expired = domain == parent && !woken &&
+				child->blocked_until > 0 &&
+				child->blocked_until <= now;
+			if (expired)
+				PRINT(" ~  %i waking %s()", child->pid,
+				      syscall_to_str(child->syscall_no));
+			child_unpark(child, expired);
+		}
+	}
 
-	uevent_yield(uevent, trace_sfd(trace), UEVENT_READ, on_signal, trace);
+	cgroup_freeze(0);
+	if (woken)
+		SHOUT("[ ] Someone woke up while freezing, not advancing");
+	return !woken;
+}
 
-	while ((parent->child_count || *list_of_argv) && !options.exit_forced) {
-		/* Is everyone blocking? */
-		if (parent->blocked_count != parent->child_count) {
-			/* Nope, need to wait for some process to block */
-			uevent_select(uevent, NULL);
-			continue;
+/* A domain that has to look again at its children, even if nothing
+ * happens, sets the re-poll timer. There's one for all the domains:
+ * each look is a walk over all of them. */
+static struct {
+	int tfd;
+	u64 deadline_ns;
+} repoll = {.tfd = -1};
+
+static int on_repoll(struct uevent *uevent, int tfd, int mask,
+		     void *userdata) {
+	repoll.tfd = -1;
+	return 0;
+}
+
+/* Wake the main loop in at most `ns`. */
+static void repoll_in(struct uevent *uevent, u64 ns) {
+	u64 deadline_ns = monotonic_ns() + ns;
+	if (repoll.tfd != -1) {
+		if (repoll.deadline_ns <= deadline_ns)
+			return;
+		uevent_timer_cancel(uevent, repoll.tfd);
+	}
+	repoll.tfd = uevent_timer(uevent, ns, on_repoll, NULL);
+	repoll.deadline_ns = deadline_ns;
+}
+
+/* Try to move the clock of a single time domain forward. Returns 1
+ * if something happened. Otherwise the domain waits for any event,
+ * for at most `wait_ns` if it lowered it, or until the re-poll timer
+ * it set. */
+static int domain_step(struct parent *parent, struct list_head *list_of_domains,
+		       struct trace *trace, struct uevent *uevent,
+		       u64 *wait_ns) {
+	struct timeval timeout;
+
+	/* Attached and asked to detach, the clock goes on at real
+	 * speed. */
+	if (attach_held(parent))
+		return 0;
+
+	/* Past --until the clock stays put. Give everyone a while to
+	 * exit before killing them. */
+	if (parent->until_reached_ns) {
+		u64 waited = monotonic_ns() - parent->until_reached_ns;
+		if (waited >= UNTIL_GRACE_NS) {
+			SHOUT("[-] Domain %i still running, killing it",
+			      parent->id);
+			parent_kill_all(parent, SIGKILL);
+			parent->until_reached_ns = monotonic_ns();
+			waited = 0;
 		}
+		*wait_ns = MIN(*wait_ns, UNTIL_GRACE_NS - waited);
+		return 0;
+	}
 
-		/* Continue only after some time passed with no action. */
-		if (parent->child_count) {
+	/* Nothing to do before the fork server forks the job. */
+	if (!parent->child_count && parent->forking)
+		return 0;
+
+	/* Delayed data that came due while we weren't looking. */
+	if (latency_deliver(parent, wait_ns))
+		return 1;
+
+	/* In lockstep we know who runs, no need to guess. */
+	int idle = -1;
+	if (options.lockstep) {
+		idle = lockstep_settle(parent, wait_ns);
+		if (!idle)
+			return 0;
+	}
+
+	/* Is everyone blocking? */
+	if (parent->blocked_count != parent->child_count) {
+		/* Nope, need to wait for some process to block */
+		return 0;
+	}
+
+	/* Paused, no need to settle. Starting the next command
+	 * doesn't move the clock. */
+	char **child_argv = parent->list_of_argv[parent->started];
+	if (!child_argv && !control_may_advance(parent)) {
+		PRINT(" ~  Domain %i paused", parent->id);
+		return 0;
+	}
+
+	u64 settle_start_ns = monotonic_ns();
+
+	/* Only sleeps: no I/O can be in flight, and no timeout is too
+	 * short to skip. The one we woke up last will stop on its way
+	 * out, wait for that. */
+	int fd_free = parent->child_count ? parent_fd_free(parent) : 0;
+	if (fd_free < 0)
+		return 0;
+
+	/* Continue only after some time passed with no
+	 * action. With the freezer there's no need to guess,
+	 * see freeze_advance(). */
+	if (parent->child_count && !options.freeze && idle < 0 && !fd_free) {
+		/* Look at the descriptors the children are blocked
+		 * on. If one is ready, someone is about to wake up.
+		 * If none is, nothing is in flight and there's no
+		 * need to guess. */
+		int ready = fdprobe_domain(parent);
+		if (ready > 0) {
+			PRINT(" ~  Descriptor ready. Waiting for a state change.");
+			repoll_in(uevent, 1000000ULL);
+			return 0;
+		}
+
+		if (ready < 0) {
 			/* Say a child process did a syscall that
 			 * produces side effects. For example a
 			 * network write. It make take a while before
@@ -244,6 +683,10 @@ static flux_time main_loop(char ***list_of_argv) {
 			 * kernel. We must give some time for a kernel
 			 * to work it out.  */
 
+			/* Start measuring cgroup cpu usage. */
+			if (options.use_cgroup)
+				cgroup_busy();
+
 			/* First. Let's make it clear we want to give
 			 * priority to anybody requiring CPU now. */
 			sched_yield();
@@ -273,92 +716,256 @@ static flux_time main_loop(char ***list_of_argv) {
 			 * doesn't work - kernel returns immediately
 			 * and doesn't do any work. Therefore we must
 			 * set the timeout to a next smallest value,
-			 * and 'select()' granularity is in us. */
+			 * and 'uevent_select()' granularity is in us. */
 
 			timeout = NSEC_TIMEVAL(1000ULL);
 			int r = uevent_select(uevent, &timeout);
 			if (r != 0)
-				continue;
+				return 1;
+		}
 
-			/* Next, make sure all processes are in 'S'
-			 * sleeping state. They should be! */
-			struct child *woken = parent_woken_child(parent);
-			if (woken) {
-				int woken_pid = woken->pid;
-				SHOUT("[ ] %i not in 'S' state but in '%c'. "
-				      "Waiting for a state change.",
-				      woken_pid, woken->stat);
-
-				timeout = NSEC_TIMEVAL(1000000ULL);
-				uevent_select(uevent, &timeout);
-				continue;
-			}
+		/* Next, make sure all processes are in 'S'
+		 * sleeping state. They should be! With a cgroup
+		 * tracees may run on other cpus, so instead
+		 * check that nothing in the cgroup used cpu
+		 * while we were waiting. */
+		if (ready < 0 && options.use_cgroup && cgroup_busy()) {
+			PRINT(" ~  cgroup busy. Waiting for it to settle.");
+			repoll_in(uevent, 1000000ULL);
+			return 0;
+		}
+		struct child *woken = ready < 0 && options.use_cgroup ? NULL :
+			parent_woken_child(parent);
+		if (woken) {
+			int woken_pid = woken->pid;
+			SHOUT("[ ] %i not in 'S' state but in '%c'. "
+			      "Waiting for a state change.",
+			      woken_pid, woken->stat);
+
+			repoll_in(uevent, 1000000ULL);
+			return 0;
+		}
 
-			/* Finally, send something to myself using
-			 * localhost to make sure network buffers are
-			 * drained. */
+		/* Finally, send something to myself using
+		 * localhost to make sure network buffers are
+		 * drained. */
+		if (ready < 0)
 			ping_myself();
 
-			if (parent->child_count) {
-				timeout = NSEC_TIMEVAL(0);
-				r = uevent_select(uevent, &timeout);
-				if (r != 0)
-					continue;
-			}
+		if (parent->child_count) {
+			timeout = NSEC_TIMEVAL(0);
+			int r = uevent_select(uevent, &timeout);
+			if (r != 0)
+				return 1;
 		}
+	}
 
-		/* All children started? */
-		if (*list_of_argv) {
-			parent_run_one(parent, trace, *list_of_argv);
-			list_of_argv ++;
-			uevent_select(uevent, NULL);
-			continue;
+	/* All children started? */
+	if (child_argv) {
+		parent_run_one(parent, trace, child_argv);
+		parent->started ++;
+		return 1;
+	}
+
+	/* Hurray, we're most likely waiting for a timeout. */
+	struct child *min_child = parent_min_timeout_child(parent);
+
+	/* Or for a horizon, which comes first. Nobody has to be woken
+	 * up. */
+	flux_time horizon = parent_horizon(parent);
+	u64 max_jump = control_max_jump();
+	if (max_jump && min_child) {
+		flux_time cap = (flux_time)TIMESPEC_NSEC(&uevent_now) +
+			parent->time_drift + (flux_time)max_jump;
+		if (cap < min_child->blocked_until &&
+		    (!horizon || cap < horizon))
+			horizon = cap;
+	}
+	if (horizon && (!min_child || min_child->blocked_until > horizon)) {
+		flux_time now = (flux_time)TIMESPEC_NSEC(&uevent_now) + parent->time_drift;
+		flux_time speedup = horizon - now;
+		if (speedup > 0 && speedup < 10 * 1000000 && !fd_free) {
+			*wait_ns = MIN(*wait_ns, (u64)speedup);
+			return 0;
+		} else if (speedup > 0) {
+			SHOUT("[ ] Domain %i speeding up by %.3f sec",
+			      parent->id, speedup / 1000000000.0);
+		} else {
+			speedup = 0;
 		}
+		if (options.freeze) {
+			if (!freeze_advance(parent, list_of_domains, uevent,
+					    speedup))
+				return 1;
+		} else {
+			parent->time_drift += speedup;
+		}
+		parent_note_advance(parent, 0, -1, speedup, settle_start_ns);
+		parent_horizon_reached(parent, trace);
+		return 1;
+	}
 
-		/* Hurray, we're most likely waiting for a timeout. */
-		struct child *min_child = parent_min_timeout_child(parent);
-		if (min_child) {
-			flux_time now = (flux_time)TIMESPEC_NSEC(&uevent_now) + parent->time_drift;
-			flux_time speedup = min_child->blocked_until - now;
-			/* Don't speed up less than 10ms */
-			if (speedup > 0 && speedup < 10 * 1000000) {
-				SHOUT("[ ] %i too small speedup on %s(), waiting",
-				      min_child->pid,
-				      syscall_to_str(min_child->syscall_no));
-				timeout = NSEC_TIMEVAL(speedup);
-				uevent_select(uevent, &timeout);
+	if (min_child) {
+		flux_time now = (flux_time)TIMESPEC_NSEC(&uevent_now) + parent->time_drift;
+		flux_time speedup = min_child->blocked_until - now;
+		/* Don't speed up less than 10ms */
+		if (speedup > 0 && speedup < 10 * 1000000 && !fd_free) {
+			SHOUT("[ ] %i too small speedup on %s(), waiting",
+			      min_child->pid,
+			      syscall_to_str(min_child->syscall_no));
+			*wait_ns = MIN(*wait_ns, (u64)speedup);
+			return 0;
+		} else if (speedup > 0) {
+			SHOUT("[ ] %i speeding up %s() by %.3f sec",
+			      min_child->pid,
+			      syscall_to_str(min_child->syscall_no),
+			      speedup / 1000000000.0);
+		} else {
+			/* Timeout already passed, wake up the process */
+			speedup = 0;
+			SHOUT("[ ] %i waking expired %s()",
+			      min_child->pid,
+			      syscall_to_str(min_child->syscall_no));
+		}
+		/* The freezer may let min_child exit. */
+		int pid = min_child->pid, syscall_no = min_child->syscall_no;
+		if (options.freeze) {
+			if (freeze_advance(parent, list_of_domains, uevent,
+					   speedup))
+				parent_note_advance(parent, pid, syscall_no,
+						    speedup, settle_start_ns);
+			return 1;
+		}
+		parent->time_drift += speedup;
+		parent_note_advance(parent, pid, syscall_no, speedup,
+				    settle_start_ns);
+		min_child->interrupted = 1;
+		child_kill(min_child, options.signo);
+		lockstep_wake(min_child);
+		return 1;
+	}
+
+	SHOUT("[ ] Can't speedup!");
+	control_stuck(parent);
+	/* Wait for any event. */
+	if (parent->child_count)
+		repoll_in(uevent, 1000000000ULL);
+	return 0;
+}
+
+/* Run in the forked child before exec. */
+static void preexec(void *userdata) {
+	daemon_preexec(userdata);
+	forksrv_preexec(userdata);
+}
+
+static flux_time main_loop(char ***list_of_domains, int argc) {
+	struct list_head list_of_domains_head;
+	struct list_head *pos, *tmp;
+	flux_time time_drift = 0;
+
+	struct trace *trace = trace_new(on_trace_start, NULL);
+	struct uevent *uevent = uevent_new(NULL);
+	trace_preexec(trace, preexec);
+
+	INIT_LIST_HEAD(&list_of_domains_head);
+	int domain_count;
+	for (domain_count = 0; list_of_domains[domain_count]; domain_count++) {
+		char **domain_argv = list_of_domains[domain_count];
+		/* The "--" after "--domain" */
+		if (*domain_argv && strcmp(*domain_argv, "--") == 0)
+			domain_argv ++;
+		struct parent *parent =
+			parent_new(domain_count,
+				   argv_split(domain_argv, "--", argc));
+		list_add_tail(&parent->in_domains, &list_of_domains_head);
+	}
+
+	uevent_yield(uevent, trace_sfd(trace), UEVENT_READ, on_signal, trace);
+
+	if (options.daemon)
+		daemon_listen(options.daemon, uevent, &list_of_domains_head,
+			      domain_count);
+	if (options.fork_server)
+		forksrv_init(uevent);
+	if (options.attach_pid)
+		attach_start(trace, &list_of_domains_head, domain_count++);
+	if (options.stats_socket)
+		stats_listen(options.stats_socket, uevent);
+	if (options.control)
+		control_listen(options.control, uevent, &list_of_domains_head);
+
+	while ((!list_empty(&list_of_domains_head) || options.daemon) &&
+	       !options.exit_forced) {
+		u64 wait_ns = ~0ULL;
+		int progress = 0;
+
+		list_for_each_safe(pos, tmp, &list_of_domains_head) {
+			struct parent *parent =
+				hlist_entry(pos, struct parent, in_domains);
+			if (parent->child_count || parent->forking ||
+			    parent->list_of_argv[parent->started]) {
+				int phase = counters_phase(COUNTERS_SETTLE);
+				progress |= domain_step(parent,
+							&list_of_domains_head,
+							trace, uevent, &wait_ns);
+				counters_phase(phase);
 				continue;
-			} else if (speedup > 0) {
-				SHOUT("[ ] %i speeding up %s() by %.3f sec",
-				      min_child->pid,
-				      syscall_to_str(min_child->syscall_no),
-				      speedup / 1000000000.0);
-			} else {
-				/* Timeout already passed, wake up the process */
-				speedup = 0;
-				SHOUT("[ ] %i waking expired %s()",
-				      min_child->pid,
-				      syscall_to_str(min_child->syscall_no));
 			}
-			parent->time_drift += speedup;
-			min_child->interrupted = 1;
-			child_kill(min_child, options.signo);
+
+			/* Domain is done. */
+			if (domain_count > 1 || parent->job)
+				SHOUT("[-] Domain %i finished with status %u. "
+				      "Speedup %.3f sec.", parent->id,
+				      parent->exit_status,
+				      (parent->time_drift -
+				       parent->start_drift) / 1000000000.);
+			time_drift = MAX(time_drift, parent->time_drift);
+			list_del(&parent->in_domains);
+			parent_free(parent);
+			/* Don't wait for events from no one. */
+			progress = 1;
+		}
+
+		control_poll();
+		/* The attached domain is gone once they all exited. */
+		if (!list_empty(&list_of_domains_head))
+			attach_poll();
+		if (progress)
+			continue;
+		if (wait_ns == ~0ULL) {
+			uevent_select(uevent, NULL);
 		} else {
-			SHOUT("[ ] Can't speedup!");
-			/* Wait for any event. */
-			if (parent->child_count) {
-				timeout = NSEC_TIMEVAL(1000000000ULL);
-				uevent_select(uevent, &timeout);
-			}
+			struct timeval timeout = NSEC_TIMEVAL(wait_ns);
+			uevent_select(uevent, &timeout);
 		}
 	}
-	parent_kill_all(parent, SIGINT);
+
+	/* Attached processes go on without us. */
+	if (options.attach_pid)
+		attach_stop(trace);
+
+	list_for_each_safe(pos, tmp, &list_of_domains_head) {
+		struct parent *parent =
+			hlist_entry(pos, struct parent, in_domains);
+		parent_kill_all(parent, SIGINT);
+	}
 
 	trace_free(trace);
 
-	flux_time time_drift = parent->time_drift;
-	free(parent);
-	free(uevent);
+	list_for_each_safe(pos, tmp, &list_of_domains_head) {
+		struct parent *parent =
+			hlist_entry(pos, struct parent, in_domains);
+		time_drift = MAX(time_drift, parent->time_drift);
+		list_del(&parent->in_domains);
+		parent_free(parent);
+	}
+	control_poll();
+	control_free();
+	daemon_free();
+	forksrv_free();
+	stats_free(options.stats_socket, uevent);
+	uevent_free(uevent);
 
 	return time_drift;
 }
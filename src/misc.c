@@ -4,13 +4,18 @@
 #include <limits.h>
 #include <string.h>
 #include <sched.h>
+#include <time.h>
 #include <signal.h>
 #include <execinfo.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
 #include <fcntl.h>
 #include <unistd.h>
 #include <arpa/inet.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <errno.h>
 
 #include <libgen.h>
 #include <dlfcn.h>
@@ -25,14 +30,16 @@
 extern struct options options;
 
 
-/* Pin current process and its children to a single CPU. Man
- * sched_setaffinity(2) says:
+/* Pin current process and its children to a single CPU, by default
+ * the one we're running on (cpu == -1). Man sched_setaffinity(2)
+ * says:
  *
  * > A child created via fork(2) inherits its parent's CPU affinity
  * > mask.  The affinity mask is preserved across an execve(2).
  */
-void pin_cpu() {
-	int cpu = sched_getcpu();
+void pin_cpu(int cpu) {
+	if (cpu == -1)
+		cpu = sched_getcpu();
 	if (cpu == -1)
 		PFATAL("sched_getcpu()");
 
@@ -71,6 +78,15 @@ char ***argv_split(char **argv, const char *delimiter, int upper_bound) {
 	return realloc(child_argv, child_no * sizeof(char *));
 }
 
+void argv_free(char ***list_of_argv) {
+	char ***child_argv = list_of_argv;
+	while (*child_argv) {
+		free(*child_argv);
+		child_argv ++;
+	}
+	free(list_of_argv);
+}
+
 
 /* Returns malloced memory */
 char *argv_join(char **argv, const char *delim) {
@@ -92,6 +108,17 @@ char *argv_join(char **argv, const char *delim) {
 
 #define PATH_DELIMITER "/"
 
+#ifdef EMBED_PRELOAD
+/* Only called for --libpath, which wins over the library built in.
+ * There's no TEST_LIBNAME to dlopen() next to it. */
+void ensure_libpath(const char *argv_0) {
+	char filename[PATH_MAX];
+	snprintf(filename, sizeof(filename), "%s" PATH_DELIMITER "%s",
+		 options.libpath, PRELOAD_LIBNAME);
+	if (access(filename, R_OK))
+		PFATAL("Unable to load \"%s\"", filename);
+}
+#else
 static int dl_checkpath(const char *path_prefix, const char *solib) {
 	char filename[PATH_MAX];
 	if (strlen(path_prefix) > 0) {
@@ -147,6 +174,7 @@ void ensure_libpath(const char *argv_0) {
 		}
 	}
 }
+#endif
 
 void ldpreload_extend(const char *lib_path, const char *file) {
         char pathname[PATH_MAX];
@@ -176,6 +204,41 @@ const char *ldpreload_get() {
         return getenv("LD_PRELOAD");
 }
 
+#ifdef EMBED_PRELOAD
+extern const char preload_so_start[], preload_so_end[];
+
+/* Preload the library built into our own binary: no probing, no
+ * files on disk. It lives in a sealed memfd, tracees load it from
+ * /proc/<our pid>/fd/N. The descriptor is close-on-exec so it
+ * doesn't leak into them. Returns 0 if we don't have one. */
+int ldpreload_embedded() {
+	int fd = memfd_create(PRELOAD_LIBNAME, MFD_CLOEXEC | MFD_ALLOW_SEALING);
+	if (fd < 0)
+		PFATAL("memfd_create()");
+
+	const char *p = preload_so_start;
+	while (p < preload_so_end) {
+		int r = write(fd, p, preload_so_end - p);
+		if (r < 0)
+			PFATAL("write(memfd)");
+		p += r;
+	}
+	if (fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW |
+		  F_SEAL_WRITE | F_SEAL_SEAL))
+		PFATAL("fcntl(F_ADD_SEALS)");
+
+	char dir[64], file[16];
+	snprintf(dir, sizeof(dir), "/proc/%i/fd", getpid());
+	snprintf(file, sizeof(file), "%i", fd);
+	ldpreload_extend(dir, file);
+	return 1;
+}
+#else
+int ldpreload_embedded() {
+	return 0;
+}
+#endif
+
 
 static void *getMcontextEip(ucontext_t *uc) {
 #if defined(__APPLE__) && !defined(MAC_OS_X_VERSION_10_6)
@@ -326,6 +389,12 @@ int str_to_time(const char *s, u64 *timens_ptr) {
 		v *= 1000000ULL;
 	} else if (strcasecmp(end, "s") == 0 || strcasecmp(end, "sec") == 0) {
 		v *= 1000000000ULL;
+	} else if (strcasecmp(end, "m") == 0 || strcasecmp(end, "min") == 0) {
+		v *= 60 * 1000000000ULL;
+	} else if (strcasecmp(end, "h") == 0 || strcasecmp(end, "hour") == 0) {
+		v *= 3600 * 1000000000ULL;
+	} else if (strcasecmp(end, "d") == 0 || strcasecmp(end, "day") == 0) {
+		v *= 86400 * 1000000000ULL;
 	} else {
 		return -1;
 	}
@@ -334,6 +403,29 @@ int str_to_time(const char *s, u64 *timens_ptr) {
 	return 0;
 }
 
+/* A date, in UTC: "@SECONDS" since the epoch, "YYYY-MM-DD" or
+ * "YYYY-MM-DDTHH:MM:SS". */
+int str_to_date(const char *s, flux_time *timens_ptr) {
+	char *end;
+	if (s[0] == '@') {
+		long long v = strtoll(s + 1, &end, 10);
+		if (end == s + 1 || *end)
+			return -1;
+		*timens_ptr = (flux_time)v * 1000000000LL;
+		return 0;
+	}
+
+	struct tm tm;
+	memset(&tm, 0, sizeof(tm));
+	end = strptime(s, "%Y-%m-%d", &tm);
+	if (end && *end == 'T')
+		end = strptime(end + 1, "%H:%M:%S", &tm);
+	if (!end || *end)
+		return -1;
+	*timens_ptr = (flux_time)timegm(&tm) * 1000000000LL;
+	return 0;
+}
+
 const char *syscall_to_str(int no) {
 	const int map_sz = sizeof(syscall_to_str_map) / sizeof(syscall_to_str_map[0]);
 	if (no >= 0 && no < map_sz) {
@@ -346,6 +438,12 @@ const char *syscall_to_str(int no) {
 	return buf;
 }
 
+u64 monotonic_ns() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return TIMESPEC_NSEC(&ts);
+}
+
 int proc_running() {
 	static int fd = -1;
 	if (fd == -1) {
@@ -436,3 +534,41 @@ void ping_myself() {
 		PFATAL("read()");
 
 }
+
+/* Listen on a unix socket at `path`, replacing a stale one. */
+int unix_listen(const char *path, int type) {
+	struct sockaddr_un sun;
+	memset(&sun, 0, sizeof(sun));
+	sun.sun_family = AF_UNIX;
+	if (strlen(path) >= sizeof(sun.sun_path))
+		FATAL("Socket path too long \"%s\"", path);
+	strcpy(sun.sun_path, path);
+
+	int sd = socket(AF_UNIX, type | SOCK_CLOEXEC, 0);
+	if (sd < 0)
+		PFATAL("socket()");
+
+	if (unlink(path) && errno != ENOENT)
+		PFATAL("unlink(%s)", path);
+	if (bind(sd, (struct sockaddr *)&sun, sizeof(sun)) < 0)
+		PFATAL("bind(%s)", path);
+	if (listen(sd, 64) < 0)
+		PFATAL("listen()");
+	return sd;
+}
+
+int unix_connect(const char *path, int type) {
+	struct sockaddr_un sun;
+	memset(&sun, 0, sizeof(sun));
+	sun.sun_family = AF_UNIX;
+	if (strlen(path) >= sizeof(sun.sun_path))
+		FATAL("Socket path too long \"%s\"", path);
+	strcpy(sun.sun_path, path);
+
+	int sd = socket(AF_UNIX, type | SOCK_CLOEXEC, 0);
+	if (sd < 0)
+		PFATAL("socket()");
+	if (connect(sd, (struct sockaddr *)&sun, sizeof(sun)) < 0)
+		PFATAL("connect(%s)", path);
+	return sd;
+}
@@ -0,0 +1,123 @@
+#define _GNU_SOURCE   /* unshare() */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <stdarg.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <signal.h>
+#include <unistd.h>
+#include <net/if.h>
+#include <sys/ioctl.h>
+#include <sys/prctl.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+
+#include "types.h"
+#include "list.h"
+
+#include "fluxcapacitor.h"
+
+
+extern struct options options;
+
+
+/* With --unshare we move to new user, network and PID namespaces
+ * before starting anything. The commands get a loopback of their
+ * own: no port conflicts with other runs on the host, and the only
+ * traffic there, which ping_myself() waits for, is theirs.
+ *
+ * We stay in the PID namespace we came from, only our children go
+ * to the new one. The first of them is its init: a process of ours
+ * that reaps orphans and keeps the namespace alive until we're done,
+ * whichever command exits first. When it dies, the kernel kills
+ * whatever is left in there.
+ *
+ * The mount namespace is ours, so /proc still shows the pids from
+ * outside, like we need it to. */
+
+static pid_t ns_init;
+
+
+static void write_file(const char *path, const char *fmt, ...)
+	__attribute__ ((format (printf, 2, 3)));
+static void write_file(const char *path, const char *fmt, ...) {
+	char buf[128];
+	va_list ap;
+	va_start(ap, fmt);
+	int len = vsnprintf(buf, sizeof(buf), fmt, ap);
+	va_end(ap);
+	int fd = open(path, O_WRONLY | O_CLOEXEC);
+	if (fd == -1)
+		PFATAL("open(%s)", path);
+	if (write(fd, buf, len) != len)
+		PFATAL("write(%s)", path);
+	close(fd);
+}
+
+static void loopback_up() {
+	int sd = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+	if (sd == -1)
+		PFATAL("socket()");
+	struct ifreq ifr;
+	memset(&ifr, 0, sizeof(ifr));
+	strcpy(ifr.ifr_name, "lo");
+	if (ioctl(sd, SIOCGIFFLAGS, &ifr))
+		PFATAL("ioctl(SIOCGIFFLAGS)");
+	ifr.ifr_flags |= IFF_UP | IFF_RUNNING;
+	if (ioctl(sd, SIOCSIFFLAGS, &ifr))
+		PFATAL("ioctl(SIOCSIFFLAGS)");
+	close(sd);
+}
+
+static void on_sigchld(int signo) {
+}
+
+static void init_run() {
+	prctl(PR_SET_NAME, "fluxcapacitor");
+	/* Take the namespace down with us if we crash. Our parent is
+	 * outside, getppid() is 0: no way to check we're not late. */
+	prctl(PR_SET_PDEATHSIG, SIGKILL);
+
+	sigset_t mask, empty;
+	sigemptyset(&mask);
+	sigaddset(&mask, SIGCHLD);
+	sigprocmask(SIG_BLOCK, &mask, NULL);
+	sigemptyset(&empty);
+	signal(SIGCHLD, on_sigchld);
+	while (1) {
+		while (waitpid(-1, NULL, WNOHANG) > 0)
+			;
+		sigsuspend(&empty);
+	}
+}
+
+/* Move to new namespaces, call it before starting any command. */
+void ns_unshare() {
+	uid_t uid = getuid();
+	gid_t gid = getgid();
+	if (unshare(CLONE_NEWUSER | CLONE_NEWNET | CLONE_NEWPID))
+		PFATAL("unshare(CLONE_NEWUSER | CLONE_NEWNET | CLONE_NEWPID)");
+	/* Same ids inside, nobody else exists. */
+	write_file("/proc/self/setgroups", "deny");
+	write_file("/proc/self/uid_map", "%u %u 1", uid, uid);
+	write_file("/proc/self/gid_map", "%u %u 1", gid, gid);
+	loopback_up();
+
+	fflush(NULL);
+	ns_init = fork();
+	if (ns_init == -1)
+		PFATAL("fork()");
+	if (ns_init == 0)
+		init_run();
+	SHOUT("[.] New namespaces, init is %i", ns_init);
+}
+
+void ns_free() {
+	if (!ns_init)
+		return;
+	kill(ns_init, SIGKILL);
+	waitpid(ns_init, NULL, __WALL);
+	ns_init = 0;
+}
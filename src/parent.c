@@ -6,6 +6,8 @@
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <unistd.h>
+#include <errno.h>
+#include <time.h>
 
 #include "list.h"
 #include "types.h"
@@ -15,18 +17,48 @@
 extern struct options options;
 
 
-struct parent *parent_new() {
+struct parent *parent_new(int id, char ***list_of_argv) {
 	struct parent *parent = calloc(1, sizeof(struct parent));
+	parent->id = id;
+	parent->list_of_argv = list_of_argv;
 
 	INIT_LIST_HEAD(&parent->list_of_children);
 	INIT_LIST_HEAD(&parent->list_of_blocked);
+	INIT_LIST_HEAD(&parent->list_of_runnable);
 
+	parent->time_drift = options.drift_ns;
+	parent->start_drift = parent->time_drift;
+
+	struct timespec ts;
+	clock_gettime(CLOCK_REALTIME, &ts);
+	flux_time now = TIMESPEC_NSEC(&ts) + parent->time_drift;
+	if (options.until_date)
+		parent->until = options.until_date;
+	else if (options.until_ns)
+		parent->until = now + options.until_ns;
+	if (options.checkpoint_ns)
+		parent->next_checkpoint = now + options.checkpoint_ns;
+
+	timeline_domain(id);
+	critpath_domain(parent);
 	return parent;
 }
 
+void parent_free(struct parent *parent) {
+	if (parent->job)
+		daemon_job_done(parent);
+	critpath_report(parent);
+	latency_free(parent);
+	argv_free(parent->list_of_argv);
+	free(parent);
+}
+
 void parent_run_one(struct parent *parent, struct trace *trace,
 		    char **child_argv) {
-	int pid = trace_execvp(trace, child_argv);
+	int pid = trace_execvp(trace, child_argv, parent);
+	forksrv_started(parent);
+	if (options.use_cgroup)
+		cgroup_attach(pid);
 	char *flat_argv = argv_join(child_argv, " ");
 	SHOUT("[+] %i running: %s", pid, flat_argv);
 	free(flat_argv);
@@ -58,12 +90,20 @@ struct child *parent_min_timeout_child(struct parent *parent) {
 	return min_child;
 }
 
-static char read_process_status(int stat_fd) {
+/* Opened on demand, a process may have thousands of threads. */
+static char read_process_status(struct child *child) {
 	char buf[1024] = {0};
 
-	int r = pread(stat_fd, buf, sizeof(buf), 0);
+	int stat_fd = trace_process_open(child->process, "stat");
+	/* Gone, or changing its pid in an exec. */
+	if (stat_fd < 0 && errno == ENOENT)
+		return 'X';
+	if (stat_fd < 0)
+		PFATAL("open(/proc/%i/stat)", child->pid);
+	int r = read(stat_fd, buf, sizeof(buf));
+	close(stat_fd);
 	if (r < 16 || r == sizeof(buf))
-		PFATAL("pread(): Error while reading /proc/[pid]/stat");
+		PFATAL("read(): Error while reading /proc/[pid]/stat");
 	buf[r] = '\0';
 
 	// Let's pray there aren't parenthesis in the program name
@@ -75,24 +115,154 @@ static char read_process_status(int stat_fd) {
 	return p[2];
 }
 
+/* Can `child`, which has just blocked, skip its sleep? Only if there
+ * is nothing left to start, everyone else in the domain is already
+ * asleep in the kernel, and nobody has an earlier deadline. With the
+ * freezer the clock only moves while everyone is frozen. */
+int parent_fast_forward_ok(struct parent *parent, struct child *child) {
+	if (parent->blocked_count != parent->child_count ||
+	    parent->list_of_argv[parent->started] ||
+	    options.freeze)
+		return 0;
+	flux_time horizon = parent_horizon(parent);
+	if (horizon && child->blocked_until > horizon)
+		return 0;
+	flux_time now = (flux_time)TIMESPEC_NSEC(&uevent_now) +
+		parent->time_drift;
+	if (!control_may_advance(parent) ||
+	    (control_max_jump() &&
+	     child->blocked_until - now > (flux_time)control_max_jump()))
+		return 0;
+
+	struct list_head *pos = NULL;
+	list_for_each(pos, &parent->list_of_children) {
+		struct child *other = hlist_entry(pos, struct child, in_children);
+		if (other == child)
+			continue;
+		if (other->parked || other->interrupted)
+			return 0;
+		if (other->blocked_until > 0 &&
+		    other->blocked_until < child->blocked_until)
+			return 0;
+		/* Held by us, not sleeping in the kernel. */
+		if (options.lockstep) {
+			if (!lockstep_asleep(other))
+				return 0;
+			continue;
+		}
+		other->stat = read_process_status(other);
+		if (other->stat != 'S')
+			return 0;
+	}
+	return 1;
+}
+
+/* The virtual instant the clock of `parent` must not go past: the
+ * earliest of --until, the next --checkpoint, the next --latency
+ * delivery and the end of an "advance" from the control socket, 0 if
+ * none. After --until it's the current time. */
+flux_time parent_horizon(struct parent *parent) {
+	if (parent->until_reached_ns)
+		return (flux_time)TIMESPEC_NSEC(&uevent_now) +
+			parent->time_drift;
+	flux_time horizon = parent->until;
+	if (parent->next_checkpoint &&
+	    (!horizon || parent->next_checkpoint < horizon))
+		horizon = parent->next_checkpoint;
+	flux_time release = latency_next_release(parent);
+	if (release && (!horizon || release < horizon))
+		horizon = release;
+	if (parent->control_until &&
+	    (!horizon || parent->control_until < horizon))
+		horizon = parent->control_until;
+	return horizon;
+}
+
+/* The clock got to the horizon: deliver delayed data, run the
+ * checkpoint command in the domain, or tell everyone the time is
+ * up. */
+void parent_horizon_reached(struct parent *parent, struct trace *trace) {
+	u64 wait_ns = ~0ULL;
+	latency_deliver(parent, &wait_ns);
+
+	flux_time now = (flux_time)TIMESPEC_NSEC(&uevent_now) +
+		parent->time_drift;
+	if (parent->until && now >= parent->until) {
+		if (parent->until_reached_ns)
+			return;
+		/* The attached processes go on, with the real clocks,
+		 * if we can let them. */
+		if (options.attach_pid) {
+			SHOUT("[-] Domain %i reached --until", parent->id);
+			parent->until_reached_ns = monotonic_ns();
+			attach_ask_detach();
+			return;
+		}
+		SHOUT("[-] Domain %i reached --until, sending %s",
+		      parent->id, strsignal(options.until_signo));
+		parent->until_reached_ns = monotonic_ns();
+		/* Don't start the remaining commands. */
+		while (parent->list_of_argv[parent->started])
+			parent->started ++;
+		parent_kill_all(parent, options.until_signo);
+		return;
+	}
+	if (parent->next_checkpoint && now >= parent->next_checkpoint) {
+		parent->next_checkpoint += options.checkpoint_ns;
+		SHOUT("[+] Domain %i checkpoint", parent->id);
+		parent_run_one(parent, trace, options.checkpoint_argv);
+	}
+}
+
+/* Record a time advance in the stats and the timeline. */
+void parent_note_advance(struct parent *parent, int pid, int syscall_no,
+			 flux_time speedup, u64 settle_start_ns) {
+	control_advanced(parent);
+	stats_advance(syscall_no, speedup, settle_start_ns,
+		      parent->time_drift);
+	timeline_settle(parent->id, settle_start_ns);
+	timeline_jump(parent->id, pid, syscall_no, speedup,
+		      parent->time_drift);
+}
+
 struct child *parent_woken_child(struct parent *parent) {
 	struct list_head *pos = NULL;
 	list_for_each(pos, &parent->list_of_children) {
 		struct child *child = hlist_entry(pos, struct child, in_children);
+		/* Held by us in a wait, see lockstep.c. */
+		if (options.lockstep && lockstep_asleep(child))
+			continue;
 
-		child->stat = read_process_status(child->stat_fd);
+		child->stat = read_process_status(child);
 		if (child->stat != 'S')
 			return child;
 	}
 	return NULL;
 }
 
+/* Is everyone blocked on a sleep, or a poll or a select without
+ * descriptors? Then nothing in flight can wake anyone up. Returns -1
+ * if so, but someone we woke up or skipped isn't out yet. */
+int parent_fd_free(struct parent *parent) {
+	int woken = 0;
+	struct list_head *pos = NULL;
+	list_for_each(pos, &parent->list_of_children) {
+		struct child *child = hlist_entry(pos, struct child, in_children);
+		if (!child->blocked || !child->fd_free)
+			return 0;
+		if (child->interrupted || child->skipped)
+			woken = 1;
+	}
+	return woken ? -1 : 1;
+}
+
 void parent_kill_all(struct parent *parent, int signo) {
 	struct list_head *pos = NULL;
 	list_for_each(pos, &parent->list_of_children) {
 		struct child *child = hlist_entry(pos, struct child, in_children);
 		kill(child->pid, signo);
 	}
+	lockstep_signal(parent);
 }
 
 void child_kill(struct child *child, int signo) {
@@ -106,13 +276,7 @@ struct child *child_new(struct parent *parent, struct trace_process *process,
 	child->pid = pid;
 	child->process = process;
 	child->parent = parent;
-
-	char fname[64] = {0};
-	snprintf(fname, sizeof(fname), "/proc/%i/stat", pid);
-
-	child->stat_fd = open(fname, O_RDONLY | O_CLOEXEC);
-	if (child->stat_fd < 0)
-		PFATAL("open(%s, O_RDONLY)", fname);
+	child->counters_fd = counters_open(pid);
 
 	list_add(&child->in_children, &parent->list_of_children);
 	parent->child_count += 1;
@@ -120,12 +284,17 @@ struct child *child_new(struct parent *parent, struct trace_process *process,
 }
 
 void child_del(struct child *child) {
+	critpath_exit(child);
+	lockstep_exit(child);
+	forksrv_exit(child);
+	counters_close(child->counters_fd);
+	free(child->parked);
+	free(child->blocked_sysarg);
 	if (child->blocked)
 		child_mark_unblocked(child);
 	list_del(&child->in_children);
 	child->pid = 0;
 	child->parent->child_count -= 1;
-	close(child->stat_fd);
 	free(child);
 }
 
@@ -135,7 +304,9 @@ void child_mark_blocked(struct child *child) {
 		FATAL("");
 
 	child->blocked = 1;
-	child->blocked_until = TIMEOUT_UNKNOWN;
+	child->blocked_since_ns = timeline_clock();
+	if (!child->restarting)
+		child->blocked_until = TIMEOUT_UNKNOWN;
 	list_add(&child->in_blocked, &child->parent->list_of_blocked);
 	child->parent->blocked_count += 1;
 }
@@ -144,7 +315,49 @@ void child_mark_unblocked(struct child *child) {
 	if (!child->blocked)
 		FATAL("");
 
+	/* Only syscalls with a timeout are interesting. */
+	if (child->timed) {
+		timeline_blocked(child->parent->id, child->pid,
+				 child->syscall_no, child->blocked_since_ns);
+		if (!child->restarting)
+			profile_unblocked(child);
+	}
+
 	child->blocked = 0;
 	list_del(&child->in_blocked);
 	child->parent->blocked_count -= 1;
 }
+
+/* Hold the child on the exit of a syscall interrupted by the
+ * freezer. It stays "blocked" until we decide what to do with it. */
+void child_park(struct child *child, struct trace_sysarg *sysarg) {
+	if (child->parked)
+		FATAL("");
+	child->parked = malloc(sizeof(struct trace_sysarg));
+	*child->parked = *sysarg;
+	trace_hold(child->process);
+}
+
+/* Let the parked child go. Either the syscall returns a timeout, or
+ * it's restarted as if nothing happened. */
+void child_unpark(struct child *child, int timeout) {
+	struct trace_sysarg *sysarg = child->parked;
+	child->parked = NULL;
+	if (!timeout)
+		child->restarting = 1;
+	child_mark_unblocked(child);
+
+	if (timeout) {
+		wrapper_syscall_exit(child, sysarg);
+		wrapper_pacify_signal(child, sysarg);
+	} else {
+		/* Kernel restarts syscalls on its own, unless they
+		 * returned EINTR, see wrapper_frozen(). A signal that
+		 * came in the meantime gets its EINTR. */
+		if (sysarg->ret == -EINTR &&
+		    !trace_signal_pending(child->process))
+			trace_restart_syscall(child->process);
+	}
+	trace_release(child->process);
+	free(sysarg);
+}
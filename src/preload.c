@@ -2,8 +2,12 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <errno.h>
+#include <signal.h>
 #include <unistd.h>
 #include <dlfcn.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
 
 #include <time.h>
 #include <sys/time.h>
@@ -123,6 +127,131 @@ int clock_nanosleep(clockid_t clk_id, int flags,
 }
 
 
+/* SIGCHLD in the fork server: copies that are done. */
+static void reap_copies(int signo) {
+	int saved_errno = errno;
+	while (waitpid(-1, NULL, WNOHANG) > 0)
+		;
+	errno = saved_errno;
+}
+
+/* The fork server of fluxcapacitor --daemon --fork-server. Call it
+ * once the initialization is done: it doesn't return in the calling
+ * process, which forks a copy for each job fluxcapacitor passes on.
+ * Returns in the copy, with the stdin, stdout, stderr, working
+ * directory and environment of the client, and the arguments of the
+ * job, NULL terminated. Returns NULL right away without --fork-server.
+ *
+ * Only the calling thread is copied. From the fork point on, the
+ * children of the process are reaped as they exit. */
+PUBLIC
+char **fluxcapacitor_fork_point(void) {
+	char *env = getenv("FLUXCAPACITOR_FORK_SERVER");
+	if (!env)
+		return NULL;
+	int sd = atoi(env);
+
+	struct sigaction sa, old_sa;
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = reap_copies;
+	sa.sa_flags = SA_RESTART | SA_NOCLDSTOP;
+	sigemptyset(&sa.sa_mask);
+	sigaction(SIGCHLD, &sa, &old_sa);
+	/* Copies that are done already. */
+	reap_copies(SIGCHLD);
+
+	while (1) {
+		ssize_t len = recv(sd, NULL, 0, MSG_PEEK | MSG_TRUNC);
+		if (len < 0 && errno == EINTR)
+			continue;
+		/* fluxcapacitor is gone. */
+		if (len <= 0)
+			_exit(0);
+
+		char *buf = malloc(len + 1);
+		int fds[3] = {-1, -1, -1};
+		char cbuf[CMSG_SPACE(sizeof(fds))];
+		struct iovec iov = {buf, len};
+		struct msghdr msg;
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_iov = &iov;
+		msg.msg_iovlen = 1;
+		msg.msg_control = cbuf;
+		msg.msg_controllen = sizeof(cbuf);
+		ssize_t r = recvmsg(sd, &msg, MSG_CMSG_CLOEXEC);
+		struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+		if (r > 0 && cmsg && cmsg->cmsg_level == SOL_SOCKET &&
+		    cmsg->cmsg_type == SCM_RIGHTS)
+			memcpy(fds, CMSG_DATA(cmsg), sizeof(fds));
+		u32 argc = 0, envc = 0;
+		if (r == len && len >= (ssize_t)(2 * sizeof(u32))) {
+			memcpy(&argc, buf, sizeof(u32));
+			memcpy(&envc, buf + sizeof(u32), sizeof(u32));
+		}
+
+		pid_t pid = -1;
+		int err = EINVAL;
+		if (r == len && argc < (u32)len && envc < (u32)len) {
+			pid = fork();
+			err = errno;
+		}
+		if (pid == -1) {
+			/* No copy for this job: tell fluxcapacitor, or
+			 * its client waits forever. */
+			u32 code = err;
+			send(sd, &code, sizeof(code), MSG_NOSIGNAL);
+		}
+		if (pid == 0) {
+			/* The job's children are its own to wait for. */
+			sigaction(SIGCHLD, &old_sa, NULL);
+			close(sd);
+			unsetenv("FLUXCAPACITOR_FORK_SERVER");
+			int fd;
+			for (fd = 0; fd < 3; fd++) {
+				if (fds[fd] != -1) {
+					dup2(fds[fd], fd);
+					close(fds[fd]);
+				}
+			}
+			/* u32 argc | u32 envc | cwd | argv... | envp... */
+			buf[len] = '\0';
+			char *p = buf + 2 * sizeof(u32);
+			char *end = buf + len;
+			if (p < end && chdir(p))
+				perror("chdir()");
+			char **argv = calloc(argc + 1, sizeof(char *));
+			u32 i;
+			p += strlen(p) + 1;
+			for (i = 0; i < argc && p < end; i++) {
+				argv[i] = p;
+				p += strlen(p) + 1;
+			}
+			/* The environment of the client, as for any
+			 * other job, but keep our LD_PRELOAD. */
+			char *ld_preload = getenv("LD_PRELOAD");
+			if (ld_preload)
+				ld_preload = strdup(ld_preload);
+			clearenv();
+			for (i = 0; i < envc && p < end; i++) {
+				if (strchr(p, '='))
+					putenv(p);
+				p += strlen(p) + 1;
+			}
+			if (ld_preload)
+				setenv("LD_PRELOAD", ld_preload, 1);
+			free(ld_preload);
+			return argv;
+		}
+		int fd;
+		for (fd = 0; fd < 3; fd++) {
+			if (fds[fd] != -1)
+				close(fds[fd]);
+		}
+		free(buf);
+	}
+}
+
+
 static void __attribute__ ((constructor)) my_init(void)  {
 	static void *libc_handle;
 	libc_handle = dlopen("libc.so.6", RTLD_LAZY | RTLD_GLOBAL | RTLD_NOLOAD);
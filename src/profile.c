@@ -0,0 +1,419 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <elf.h>
+#include <link.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "types.h"
+#include "list.h"
+#include "trace.h"
+#include "fluxcapacitor.h"
+
+
+extern struct options options;
+
+
+/* Where do the commands spend their (virtual) time waiting? When a
+ * child blocks on a timeout we walk its stack, and when it wakes up
+ * the time it waited goes to that stack. Most of it usually wasn't
+ * waited for real but skipped by an advance, so the two are kept
+ * apart, as two leaves: "[waited]" and "[skipped]".
+ *
+ * The stack is only a list of addresses when we take it. The first
+ * time we see one we find, from /proc/<pid>/maps, the file each
+ * address comes from. Names are looked up in the ELF symbol tables
+ * of those files at the end, once.
+ *
+ * The output is in the folded format of FlameGraph's
+ * stackcollapse scripts, in microseconds:
+ *
+ *     python3;_start;...;__select;[skipped] 60000000 */
+
+#define PROFILE_DEPTH 64
+#define PROFILE_BUCKETS 1021
+
+struct symbol {
+	unsigned long addr;
+	unsigned long size;
+	const char *name;
+};
+
+struct module {
+	struct list_head in_modules;
+	char *path;
+
+	int loaded;
+	void *map;
+	size_t map_size;
+	/* File offset to address, from the PT_LOAD headers. */
+	ElfW(Phdr) *phdrs;
+	int phnum;
+	struct symbol *symbols;
+	int symbol_count;
+};
+
+struct frame {
+	struct module *module;	/* NULL if not from a file */
+	unsigned long offset;	/* in the file */
+};
+
+struct profile_stack {
+	struct hlist_node node;
+
+	int pid;
+	int execs;
+	char *comm;
+	int depth;
+	unsigned long pcs[PROFILE_DEPTH];
+	struct frame frames[PROFILE_DEPTH];
+
+	u64 waited_ns;
+	u64 skipped_ns;
+};
+
+static struct {
+	char *path;
+	struct hlist_head hstacks[PROFILE_BUCKETS];
+	struct list_head list_of_modules;
+} profile;
+
+
+void profile_open(const char *path) {
+	profile.path = strdup(path);
+	INIT_LIST_HEAD(&profile.list_of_modules);
+	int i;
+	for (i = 0; i < PROFILE_BUCKETS; i++)
+		INIT_HLIST_HEAD(&profile.hstacks[i]);
+}
+
+static struct module *module_get(const char *path) {
+	struct list_head *pos;
+	list_for_each(pos, &profile.list_of_modules) {
+		struct module *module =
+			list_entry(pos, struct module, in_modules);
+		if (strcmp(module->path, path) == 0)
+			return module;
+	}
+	struct module *module = calloc(1, sizeof(struct module));
+	module->path = strdup(path);
+	list_add_tail(&module->in_modules, &profile.list_of_modules);
+	return module;
+}
+
+/* Find the files the addresses of `stack` come from. */
+static void stack_resolve(struct child *child, struct profile_stack *stack) {
+	int fd = trace_process_open(child->process, "comm");
+	char comm[64] = "";
+	if (fd != -1) {
+		int r = read(fd, comm, sizeof(comm) - 1);
+		close(fd);
+		comm[MAX(r, 0)] = '\0';
+		comm[strcspn(comm, "\n")] = '\0';
+	}
+	stack->comm = strdup(comm[0] ? comm : "?");
+
+	fd = trace_process_open(child->process, "maps");
+	if (fd == -1)
+		return;
+	FILE *f = fdopen(fd, "r");
+	char *line = NULL;
+	size_t line_size = 0;
+	while (getline(&line, &line_size, f) != -1) {
+		unsigned long start, end, offset;
+		int path_at = 0;
+		if (sscanf(line, "%lx-%lx %*s %lx %*s %*s %n",
+			   &start, &end, &offset, &path_at) != 3 || !path_at)
+			continue;
+		char *path = line + path_at;
+		path[strcspn(path, "\n")] = '\0';
+		if (path[0] != '/')
+			continue;
+		int i;
+		for (i = 0; i < stack->depth; i++) {
+			if (stack->pcs[i] < start || stack->pcs[i] >= end)
+				continue;
+			stack->frames[i].module = module_get(path);
+			stack->frames[i].offset = stack->pcs[i] - start + offset;
+		}
+	}
+	free(line);
+	fclose(f);
+}
+
+static struct profile_stack *stack_get(struct child *child,
+				       unsigned long *pcs, int depth) {
+	int execs = trace_process_execs(child->process);
+	unsigned long hash = child->pid * 31 + execs;
+	int i;
+	for (i = 0; i < depth; i++)
+		hash = hash * 31 + pcs[i];
+	struct hlist_head *head = &profile.hstacks[hash % PROFILE_BUCKETS];
+
+	struct hlist_node *pos;
+	hlist_for_each(pos, head) {
+		struct profile_stack *stack =
+			hlist_entry(pos, struct profile_stack, node);
+		if (stack->pid == child->pid && stack->execs == execs &&
+		    stack->depth == depth &&
+		    memcmp(stack->pcs, pcs, depth * sizeof(long)) == 0)
+			return stack;
+	}
+
+	struct profile_stack *stack = calloc(1, sizeof(struct profile_stack));
+	stack->pid = child->pid;
+	stack->execs = execs;
+	stack->depth = depth;
+	memcpy(stack->pcs, pcs, depth * sizeof(long));
+	stack_resolve(child, stack);
+	hlist_add_head(&stack->node, head);
+	return stack;
+}
+
+/* `child` just blocked on a timeout. */
+void profile_blocked(struct child *child) {
+	if (!profile.path)
+		return;
+	/* Restarted after the freezer, the same wait goes on. */
+	if (child->profile)
+		return;
+	unsigned long pcs[PROFILE_DEPTH];
+	int depth = trace_process_stack(child->process, pcs, PROFILE_DEPTH);
+	child->profile = stack_get(child, pcs, depth);
+	child->profile_since_ns = monotonic_ns();
+	child->profile_drift = child->parent->time_drift;
+}
+
+/* And it's awake. */
+void profile_unblocked(struct child *child) {
+	struct profile_stack *stack = child->profile;
+	if (!stack)
+		return;
+	child->profile = NULL;
+	stack->waited_ns += monotonic_ns() - child->profile_since_ns;
+	stack->skipped_ns += child->parent->time_drift - child->profile_drift;
+}
+
+
+static int symbol_cmp(const void *a, const void *b) {
+	const struct symbol *sa = a, *sb = b;
+	return sa->addr < sb->addr ? -1 : sa->addr > sb->addr;
+}
+
+static void module_load(struct module *module) {
+	module->loaded = 1;
+	int fd = open(module->path, O_RDONLY | O_CLOEXEC);
+	if (fd == -1)
+		return;
+	struct stat st;
+	if (fstat(fd, &st) || (size_t)st.st_size < sizeof(ElfW(Ehdr))) {
+		close(fd);
+		return;
+	}
+	void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED)
+		return;
+	module->map = map;
+	module->map_size = st.st_size;
+
+	char *base = map;
+	ElfW(Ehdr) *ehdr = map;
+	if (memcmp(ehdr->e_ident, ELFMAG, SELFMAG) ||
+	    ehdr->e_ident[EI_CLASS] != (sizeof(long) == 8 ? ELFCLASS64
+					: ELFCLASS32) ||
+	    ehdr->e_phoff + ehdr->e_phnum * sizeof(ElfW(Phdr)) > module->map_size ||
+	    ehdr->e_shoff + ehdr->e_shnum * sizeof(ElfW(Shdr)) > module->map_size)
+		return;
+	module->phdrs = (ElfW(Phdr) *)(base + ehdr->e_phoff);
+	module->phnum = ehdr->e_phnum;
+
+	/* Functions from .symtab, and from .dynsym for stripped
+	 * files. Duplicates don't matter. */
+	ElfW(Shdr) *shdrs = (ElfW(Shdr) *)(base + ehdr->e_shoff);
+	int i, count = 0;
+	for (i = 0; i < ehdr->e_shnum; i++) {
+		if (shdrs[i].sh_type == SHT_SYMTAB ||
+		    shdrs[i].sh_type == SHT_DYNSYM)
+			count += shdrs[i].sh_size / sizeof(ElfW(Sym));
+	}
+	module->symbols = calloc(count + 1, sizeof(struct symbol));
+	for (i = 0; i < ehdr->e_shnum; i++) {
+		ElfW(Shdr) *shdr = &shdrs[i];
+		if ((shdr->sh_type != SHT_SYMTAB &&
+		     shdr->sh_type != SHT_DYNSYM) ||
+		    shdr->sh_link >= ehdr->e_shnum ||
+		    shdr->sh_offset + shdr->sh_size > module->map_size)
+			continue;
+		ElfW(Shdr) *strtab = &shdrs[shdr->sh_link];
+		if (strtab->sh_offset + strtab->sh_size > module->map_size)
+			continue;
+		ElfW(Sym) *syms = (ElfW(Sym) *)(base + shdr->sh_offset);
+		int j, n = shdr->sh_size / sizeof(ElfW(Sym));
+		for (j = 0; j < n; j++) {
+			if (ELF64_ST_TYPE(syms[j].st_info) != STT_FUNC ||
+			    !syms[j].st_value || !syms[j].st_size ||
+			    syms[j].st_name >= strtab->sh_size)
+				continue;
+			struct symbol *symbol =
+				&module->symbols[module->symbol_count++];
+			symbol->addr = syms[j].st_value;
+			symbol->size = syms[j].st_size;
+			symbol->name = base + strtab->sh_offset + syms[j].st_name;
+		}
+	}
+	qsort(module->symbols, module->symbol_count, sizeof(struct symbol),
+	      symbol_cmp);
+}
+
+static const char *module_symbol(struct module *module, unsigned long offset) {
+	if (!module->loaded)
+		module_load(module);
+
+	int i;
+	unsigned long addr = 0;
+	for (i = 0; i < module->phnum; i++) {
+		ElfW(Phdr) *phdr = &module->phdrs[i];
+		if (phdr->p_type == PT_LOAD && offset >= phdr->p_offset &&
+		    offset < phdr->p_offset + phdr->p_filesz) {
+			addr = offset - phdr->p_offset + phdr->p_vaddr;
+			break;
+		}
+	}
+	if (i == module->phnum)
+		return NULL;
+
+	/* The last symbol starting at or before `addr`. */
+	int lo = 0, hi = module->symbol_count;
+	while (lo < hi) {
+		int mid = (lo + hi) / 2;
+		if (module->symbols[mid].addr <= addr)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	if (lo == 0)
+		return NULL;
+	struct symbol *symbol = &module->symbols[lo - 1];
+	if (addr >= symbol->addr + symbol->size)
+		return NULL;
+	return symbol->name;
+}
+
+struct folded {
+	char *stack;
+	u64 us;
+};
+
+static int folded_cmp(const void *a, const void *b) {
+	return strcmp(((struct folded *)a)->stack, ((struct folded *)b)->stack);
+}
+
+static void folded_add(struct folded **lines, int *count, int *size,
+		       const char *stack, const char *leaf, u64 ns) {
+	if (ns < 1000)
+		return;
+	if (*count == *size) {
+		*size = *size ? *size * 2 : 64;
+		*lines = realloc(*lines, *size * sizeof(struct folded));
+	}
+	struct folded *line = &(*lines)[(*count)++];
+	if (asprintf(&line->stack, "%s;%s", stack, leaf) == -1)
+		PFATAL("asprintf()");
+	line->us = ns / 1000;
+}
+
+/* Write the folded stacks, identical ones summed up. */
+void profile_write() {
+	if (!profile.path)
+		return;
+
+	struct folded *lines = NULL;
+	int count = 0, size = 0;
+	int b;
+	for (b = 0; b < PROFILE_BUCKETS; b++) {
+		struct hlist_node *pos;
+		hlist_for_each(pos, &profile.hstacks[b]) {
+			struct profile_stack *stack =
+				hlist_entry(pos, struct profile_stack, node);
+			char *buf = NULL;
+			size_t len = 0;
+			FILE *f = open_memstream(&buf, &len);
+			fputs(stack->comm, f);
+			int i;
+			for (i = stack->depth - 1; i >= 0; i--) {
+				struct frame *frame = &stack->frames[i];
+				/* Return addresses point after the call. */
+				unsigned long offset = frame->offset - (i > 0);
+				const char *name = frame->module ?
+					module_symbol(frame->module, offset) : NULL;
+				if (name) {
+					fprintf(f, ";%s", name);
+				} else if (frame->module) {
+					const char *slash =
+						strrchr(frame->module->path, '/');
+					fprintf(f, ";[%s]", slash + 1);
+				} else {
+					fprintf(f, ";[unknown]");
+				}
+			}
+			fclose(f);
+			folded_add(&lines, &count, &size, buf, "[waited]",
+				   stack->waited_ns);
+			folded_add(&lines, &count, &size, buf, "[skipped]",
+				   stack->skipped_ns);
+			free(buf);
+		}
+	}
+
+	FILE *f = fopen(profile.path, "w");
+	if (!f)
+		PFATAL("fopen(%s)", profile.path);
+	qsort(lines, count, sizeof(struct folded), folded_cmp);
+	int i, written = 0;
+	for (i = 0; i < count; i++, written++) {
+		u64 us = lines[i].us;
+		while (i + 1 < count &&
+		       strcmp(lines[i].stack, lines[i + 1].stack) == 0) {
+			free(lines[i].stack);
+			us += lines[++i].us;
+		}
+		fprintf(f, "%s %llu\n", lines[i].stack, (unsigned long long)us);
+		free(lines[i].stack);
+	}
+	fclose(f);
+	free(lines);
+	SHOUT("[.] Wrote %i stacks to %s", written, profile.path);
+}
+
+void profile_free() {
+	if (!profile.path)
+		return;
+	int b;
+	for (b = 0; b < PROFILE_BUCKETS; b++) {
+		struct hlist_node *pos, *tmp;
+		hlist_for_each_safe(pos, tmp, &profile.hstacks[b]) {
+			struct profile_stack *stack =
+				hlist_entry(pos, struct profile_stack, node);
+			free(stack->comm);
+			free(stack);
+		}
+	}
+	struct list_head *pos, *tmp;
+	list_for_each_safe(pos, tmp, &profile.list_of_modules) {
+		struct module *module =
+			list_entry(pos, struct module, in_modules);
+		if (module->map)
+			munmap(module->map, module->map_size);
+		free(module->symbols);
+		free(module->path);
+		free(module);
+	}
+	free(profile.path);
+	profile.path = NULL;
+}
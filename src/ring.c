@@ -0,0 +1,221 @@
+#define _GNU_SOURCE   /* O_CLOEXEC and vasprintf() */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/mman.h>
+
+#include "types.h"
+#include "list.h"
+
+#include "fluxcapacitor.h"
+#include "ring.h"
+
+
+extern struct options options;
+
+
+/* With --ring, SHOUT() and PRINT() don't format anything. They copy
+ * the timestamp, the format pointer and the raw arguments into a
+ * memory mapped file, and fluxcapacitor-decode does the printf()
+ * later. A format gets its event id, and its argument types parsed,
+ * the first time we see it.
+ *
+ * The mapping is shared: what was written survives us crashing. */
+
+#define RING_SLOTS 4096		/* formats we can remember, power of two */
+#define RING_DEFAULT_MB 16
+
+struct format {
+	const char *fmt;
+	u16 event;		/* RING_CONT to format it ourselves */
+	u8 nargs;
+	u8 types[RING_ARGS];
+};
+
+static struct {
+	size_t size;
+	struct ring_header *header;
+	char *table;
+	struct ring_record *records;
+
+	struct format formats[RING_SLOTS];
+} ring;
+
+/* Logged for messages we can't take apart: formatted by us, as an
+ * argument of this. */
+static const char plain_format[] = "%s";
+
+
+static struct format *format_get(const char *fmt) {
+	unsigned slot = ((uintptr_t)fmt >> 3) * 2654435761u;
+	int i;
+	for (i = 0; i < RING_SLOTS; i++) {
+		struct format *format = &ring.formats[(slot + i) & (RING_SLOTS - 1)];
+		if (format->fmt == fmt)
+			return format;
+		if (format->fmt)
+			continue;
+
+		format->fmt = fmt;
+		format->event = RING_CONT;
+		const char *p = fmt;
+		while ((p = strchr(p, '%'))) {
+			int type = ring_conversion(p, &p);
+			if (type == RING_T_NONE)
+				continue;
+			if (type == RING_T_BAD || format->nargs == RING_ARGS)
+				return format;
+			format->types[format->nargs++] = type;
+		}
+		int len = strlen(fmt) + 1;
+		struct ring_header *header = ring.header;
+		if (header->formats == RING_CONT ||
+		    header->table_used + len > RING_TABLE_SIZE)
+			return format;
+		memcpy(ring.table + header->table_used, fmt, len);
+		header->table_used += len;
+		format->event = header->formats++;
+		return format;
+	}
+	return NULL;
+}
+
+static struct ring_record *next_record() {
+	struct ring_header *header = ring.header;
+	return &ring.records[header->head++ % header->records];
+}
+
+/* Log `fmt` and its arguments at verbosity `level`. */
+void ring_log(int level, const char *fmt, ...) {
+	va_list ap;
+	va_start(ap, fmt);
+	if (!ring.header) {
+		/* Not open yet. */
+		vfprintf(options.shoutstream, fmt, ap);
+		va_end(ap);
+		fprintf(options.shoutstream, "\n");
+		return;
+	}
+
+	struct format *format = format_get(fmt);
+	if (!format || format->event == RING_CONT) {
+		char *buf;
+		int r = vasprintf(&buf, fmt, ap);
+		va_end(ap);
+		if (r < 0)
+			return;
+		ring_log(level, plain_format, buf);
+		free(buf);
+		return;
+	}
+
+	struct ring_record *record = next_record();
+	record->ts_ns = monotonic_ns();
+	record->event = format->event;
+	record->level = level;
+	record->nargs = format->nargs;
+
+	const char *strings[RING_ARGS];
+	int i, nstrings = 0;
+	for (i = 0; i < format->nargs; i++) {
+		u64 arg = 0;
+		switch (format->types[i]) {
+		case RING_T_INT:
+			arg = (s64)va_arg(ap, int);
+			break;
+		case RING_T_LONG:
+			arg = (s64)va_arg(ap, long);
+			break;
+		case RING_T_LLONG:
+			arg = va_arg(ap, long long);
+			break;
+		case RING_T_PTR:
+			arg = (uintptr_t)va_arg(ap, void *);
+			break;
+		case RING_T_DOUBLE: {
+			double d = va_arg(ap, double);
+			memcpy(&arg, &d, sizeof(d));
+			break; }
+		case RING_T_STRING: {
+			const char *s = va_arg(ap, const char *);
+			if (!s)
+				s = "(null)";
+			strings[nstrings++] = s;
+			arg = strlen(s);
+			break; }
+		}
+		record->args[i] = arg;
+	}
+	va_end(ap);
+
+	int s;
+	for (s = 0, i = 0; i < format->nargs; i++) {
+		if (format->types[i] != RING_T_STRING)
+			continue;
+		const char *str = strings[s++];
+		u32 off, len = MIN(record->args[i], RING_MAX_STRING);
+		for (off = 0; off < len; off += sizeof(record->args)) {
+			struct ring_record *cont = next_record();
+			cont->event = RING_CONT;
+			cont->len = MIN(len - off, sizeof(cont->args));
+			memcpy(cont->args, str + off, cont->len);
+		}
+	}
+}
+
+/* Map the ring file, `spec` is PATH[:MEGABYTES]. */
+void ring_open(const char *spec) {
+	char *path = strdup(spec);
+	u64 mb = RING_DEFAULT_MB;
+	char *colon = strrchr(path, ':');
+	if (colon) {
+		char *end;
+		*colon = '\0';
+		mb = strtoull(colon + 1, &end, 10);
+		if (*end || mb == 0)
+			FATAL("Bad --ring size: %s", colon + 1);
+	}
+
+	int fd = open(path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (fd == -1)
+		PFATAL("open(%s)", path);
+	u64 records = mb * 1024 * 1024 / sizeof(struct ring_record);
+	ring.size = RING_HEADER_SIZE + RING_TABLE_SIZE +
+		records * sizeof(struct ring_record);
+	if (ftruncate(fd, ring.size))
+		PFATAL("ftruncate(%s)", path);
+	void *map = mmap(NULL, ring.size, PROT_READ | PROT_WRITE, MAP_SHARED,
+			 fd, 0);
+	if (map == MAP_FAILED)
+		PFATAL("mmap(%s)", path);
+	close(fd);
+
+	ring.header = map;
+	ring.table = (char *)map + RING_HEADER_SIZE;
+	ring.records = (void *)(ring.table + RING_TABLE_SIZE);
+
+	struct ring_header *header = ring.header;
+	memcpy(header->magic, RING_MAGIC, sizeof(header->magic));
+	header->record_size = sizeof(struct ring_record);
+	header->records = records;
+	header->start_ns = monotonic_ns();
+	struct timespec ts;
+	clock_gettime(CLOCK_REALTIME, &ts);
+	header->start_realtime_ns = TIMESPEC_NSEC(&ts);
+	/* Event 0. */
+	format_get(plain_format);
+	free(path);
+}
+
+void ring_close() {
+	if (!ring.header)
+		return;
+	munmap(ring.header, ring.size);
+	ring.header = NULL;
+}
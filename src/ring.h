@@ -0,0 +1,102 @@
+#ifndef _HAVE_RING_H
+#define _HAVE_RING_H
+
+#include <string.h>
+
+#include "types.h"
+
+/* Layout of the --ring file, shared with fluxcapacitor-decode.
+ *
+ * A page of header, then the format strings, NUL separated, in the
+ * order of their event ids, then the ring of records. `head` counts
+ * every record ever written, the newest one is at (head - 1) %
+ * records. */
+
+#define RING_MAGIC "FLUXRNG1"
+#define RING_HEADER_SIZE 4096
+#define RING_TABLE_SIZE (64 * 1024)
+
+#define RING_ARGS 6
+#define RING_CONT 0xffff	/* event of a record carrying string data */
+
+struct ring_header {
+	char magic[8];
+	u32 record_size;
+	u32 formats;		/* count of format strings */
+	u64 records;		/* capacity of the ring */
+	u64 head;
+	u64 start_ns;		/* CLOCK_MONOTONIC when opened */
+	u64 start_realtime_ns;
+	u32 table_used;		/* bytes of format strings */
+};
+
+/* Every argument takes a slot in `args`: integers sign extended,
+ * doubles as their bits, strings as their length. The bytes of a
+ * string follow in as many RING_CONT records as needed, in the order
+ * of the arguments, up to RING_MAX_STRING of them. */
+struct ring_record {
+	u64 ts_ns;
+	u16 event;
+	u8 level;		/* 1 for SHOUT, 2 for PRINT */
+	u8 nargs;
+	u32 len;		/* bytes in `args`, RING_CONT only */
+	u64 args[RING_ARGS];
+};
+
+#define RING_MAX_STRING (64 * 1024)
+
+enum ring_types {
+	RING_T_NONE,		/* %% */
+	RING_T_INT,
+	RING_T_LONG,
+	RING_T_LLONG,
+	RING_T_PTR,
+	RING_T_DOUBLE,
+	RING_T_STRING,
+	RING_T_BAD		/* %n, %m, '*' width, long double... */
+};
+
+/* What argument does the conversion starting at the '%' at `p`
+ * take? Sets `*end` past the conversion. */
+static inline int ring_conversion(const char *p, const char **end) {
+	int longs = 0, size_t_like = 0, type = RING_T_BAD;
+	p += 1;
+	p += strspn(p, "-+ #0'");
+	p += strspn(p, "0123456789.");
+	for (;; p++) {
+		if (*p == 'l')
+			longs += 1;
+		else if (*p == 'z' || *p == 't')
+			size_t_like = 1;
+		else if (*p == 'j')
+			longs = 2;
+		else if (*p != 'h')
+			break;
+	}
+	switch (*p) {
+	case 'd': case 'i': case 'u': case 'x': case 'X': case 'o':
+		type = longs > 1 ? RING_T_LLONG :
+			(longs || size_t_like) ? RING_T_LONG : RING_T_INT;
+		break;
+	case 'c':
+		type = RING_T_INT;
+		break;
+	case 'f': case 'F': case 'e': case 'E': case 'g': case 'G':
+	case 'a': case 'A':
+		type = RING_T_DOUBLE;
+		break;
+	case 's':
+		type = RING_T_STRING;
+		break;
+	case 'p':
+		type = RING_T_PTR;
+		break;
+	case '%':
+		type = RING_T_NONE;
+		break;
+	}
+	*end = *p ? p + 1 : p;
+	return type;
+}
+
+#endif /* ^_HAVE_RING_H */
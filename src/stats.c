@@ -0,0 +1,219 @@
+#define _GNU_SOURCE   /* accept4() */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <unistd.h>
+
+#include "types.h"
+#include "list.h"
+
+#include "fluxcapacitor.h"
+#include "uevent.h"
+
+
+extern struct options options;
+
+
+/* Syscalls above that, and stops that aren't syscalls, are counted
+ * in the last slot. */
+#define STATS_SYSCALLS 1024
+/* Power of two buckets, in ns. */
+#define STATS_BUCKETS 64
+
+struct histogram {
+	u64 count;
+	u64 total_ns;
+	u64 buckets[STATS_BUCKETS];
+};
+
+/* Counters kept by the tracer. Only collected after stats_init(), so
+ * that they cost nothing by default. */
+static struct {
+	int enabled;
+	u64 start_ns;
+
+	/* ptrace stops and the time we spent handling them */
+	u64 stops[STATS_SYSCALLS + 1];
+	struct histogram stop;
+
+	/* Time advances, the settle time before each one and the
+	 * virtual time skipped per syscall */
+	struct histogram settle;
+	flux_time skipped[STATS_SYSCALLS + 1];
+	flux_time max_drift;
+
+	/* Where the tracer was before the stop, see counters.c. */
+	int stop_phase;
+
+	int sd;
+} stats = {.sd = -1};
+
+
+static int syscall_slot(int syscall_no) {
+	if (syscall_no < 0 || syscall_no >= STATS_SYSCALLS)
+		return STATS_SYSCALLS;
+	return syscall_no;
+}
+
+static void histogram_add(struct histogram *h, u64 ns) {
+	int bucket = ns ? 64 - __builtin_clzll(ns) : 0;
+	h->buckets[MIN(bucket, STATS_BUCKETS - 1)] += 1;
+	h->count += 1;
+	h->total_ns += ns;
+}
+
+void stats_init() {
+	stats.enabled = 1;
+	stats.start_ns = monotonic_ns();
+	counters_init();
+}
+
+/* A ptrace stop starts. Timestamp for stats_stop(), 0 when
+ * disabled. */
+u64 stats_clock() {
+	if (!stats.enabled)
+		return 0;
+	stats.stop_phase = counters_phase(COUNTERS_STOP);
+	return monotonic_ns();
+}
+
+/* A ptrace stop was handled, starting at `start_ns`. `syscall_no` is
+ * -1 for stops other than syscall entry or exit. */
+void stats_stop(int syscall_no, u64 start_ns) {
+	if (!stats.enabled)
+		return;
+	stats.stops[syscall_slot(syscall_no)] += 1;
+	histogram_add(&stats.stop, monotonic_ns() - start_ns);
+	counters_phase(stats.stop_phase);
+}
+
+/* Time of a domain moved by `speedup` because of `syscall_no`. The
+ * domain became idle at `settle_start_ns`. */
+void stats_advance(int syscall_no, flux_time speedup, u64 settle_start_ns,
+		   flux_time time_drift) {
+	if (!stats.enabled)
+		return;
+	histogram_add(&stats.settle, monotonic_ns() - settle_start_ns);
+	stats.skipped[syscall_slot(syscall_no)] += speedup;
+	stats.max_drift = MAX(stats.max_drift, time_drift);
+}
+
+
+static void histogram_dump(FILE *f, const char *name, struct histogram *h) {
+	fprintf(f, "  \"%s\": {\"count\": %llu, \"total_ns\": %llu, "
+		"\"histogram\": {", name,
+		(unsigned long long)h->count, (unsigned long long)h->total_ns);
+	int i, first = 1;
+	for (i = 0; i < STATS_BUCKETS; i++) {
+		if (!h->buckets[i])
+			continue;
+		/* Keyed by the upper bound of the bucket. */
+		fprintf(f, "%s\"%llu\": %llu", first ? "" : ", ",
+			i < 63 ? 1ULL << i : ~0ULL,
+			(unsigned long long)h->buckets[i]);
+		first = 0;
+	}
+	fprintf(f, "}},\n");
+}
+
+static const char *slot_name(int slot) {
+	return slot == STATS_SYSCALLS ? "other" : syscall_to_str(slot);
+}
+
+void stats_dump(FILE *f) {
+	u64 real_ns = monotonic_ns() - stats.start_ns;
+	u64 virtual_ns = real_ns + stats.max_drift;
+
+	struct rusage ru;
+	getrusage(RUSAGE_SELF, &ru);
+	u64 cpu_ns = TIMEVAL_NSEC(&ru.ru_utime) + TIMEVAL_NSEC(&ru.ru_stime);
+
+	fprintf(f, "{\n");
+	fprintf(f, "  \"real_ns\": %llu,\n", (unsigned long long)real_ns);
+	fprintf(f, "  \"virtual_ns\": %llu,\n", (unsigned long long)virtual_ns);
+	fprintf(f, "  \"compression\": %.3f,\n",
+		real_ns ? (double)virtual_ns / real_ns : 1.0);
+	fprintf(f, "  \"tracer_cpu_ns\": %llu,\n", (unsigned long long)cpu_ns);
+	counters_dump(f, real_ns, stats.stop.count);
+
+	int i, first = 1;
+	fprintf(f, "  \"stops\": {");
+	for (i = 0; i <= STATS_SYSCALLS; i++) {
+		if (!stats.stops[i])
+			continue;
+		fprintf(f, "%s\"%s\": %llu", first ? "" : ", ", slot_name(i),
+			(unsigned long long)stats.stops[i]);
+		first = 0;
+	}
+	fprintf(f, "},\n");
+	histogram_dump(f, "stop_ns", &stats.stop);
+
+	fprintf(f, "  \"advances\": %llu,\n",
+		(unsigned long long)stats.settle.count);
+	histogram_dump(f, "settle_ns", &stats.settle);
+
+	first = 1;
+	fprintf(f, "  \"skipped_ns\": {");
+	for (i = 0; i <= STATS_SYSCALLS; i++) {
+		if (!stats.skipped[i])
+			continue;
+		fprintf(f, "%s\"%s\": %lli", first ? "" : ", ", slot_name(i),
+			(long long)stats.skipped[i]);
+		first = 0;
+	}
+	fprintf(f, "}\n");
+	fprintf(f, "}\n");
+}
+
+void stats_write(const char *path) {
+	FILE *f = fopen(path, "w");
+	if (!f)
+		PFATAL("fopen(%s)", path);
+	stats_dump(f);
+	fclose(f);
+}
+
+
+/* Every connection gets a snapshot and is closed. */
+static int on_stats_accept(struct uevent *uevent, int sd, int mask,
+			   void *userdata) {
+	int cd = accept4(sd, NULL, NULL, SOCK_CLOEXEC);
+	if (cd < 0) {
+		SHOUT("[ ] accept(): %s", strerror(errno));
+		return 0;
+	}
+
+	char *buf = NULL;
+	size_t len = 0;
+	FILE *f = open_memstream(&buf, &len);
+	stats_dump(f);
+	fclose(f);
+
+	/* Small enough to fit in the socket buffer. */
+	if (send(cd, buf, len, MSG_DONTWAIT | MSG_NOSIGNAL) != (ssize_t)len)
+		SHOUT("[ ] Can't send stats: %s", strerror(errno));
+	free(buf);
+	close(cd);
+	return 0;
+}
+
+/* Serve live stats on a unix socket at `path`. */
+void stats_listen(const char *path, struct uevent *uevent) {
+	stats.sd = unix_listen(path, SOCK_STREAM);
+	uevent_yield(uevent, stats.sd, UEVENT_READ, on_stats_accept, NULL);
+	SHOUT("[.] Stats on %s", path);
+}
+
+void stats_free(const char *path, struct uevent *uevent) {
+	if (stats.sd == -1)
+		return;
+	uevent_clear(uevent, stats.sd);
+	close(stats.sd);
+	stats.sd = -1;
+	unlink(path);
+}
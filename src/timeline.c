@@ -0,0 +1,112 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "types.h"
+#include "list.h"
+
+#include "fluxcapacitor.h"
+
+
+extern struct options options;
+
+
+/* Chrome trace event JSON, as loaded by Perfetto or chrome://tracing.
+ * Every time domain is a process. Its tracees are threads, with a
+ * span for every syscall blocked on a timeout. Thread 0 is the
+ * tracer: settle phases, time jumps and the drift counter.
+ *
+ * Timestamps are real time since start, in microseconds. We use the
+ * array format, which is still readable if we die before closing
+ * it. */
+static struct {
+	FILE *f;
+	u64 start_ns;
+	int events;
+} timeline;
+
+
+static void event_begin(const char *ph, int domain, int tid, u64 ts_ns) {
+	fprintf(timeline.f, "%s{\"ph\":\"%s\",\"pid\":%i,\"tid\":%i,"
+		"\"ts\":%.3f", timeline.events ? ",\n" : "", ph, domain, tid,
+		(ts_ns - timeline.start_ns) / 1000.);
+	timeline.events += 1;
+}
+
+void timeline_open(const char *path) {
+	timeline.f = fopen(path, "w");
+	if (!timeline.f)
+		PFATAL("fopen(%s)", path);
+	timeline.start_ns = monotonic_ns();
+	fprintf(timeline.f, "[\n");
+}
+
+void timeline_close() {
+	if (!timeline.f)
+		return;
+	fprintf(timeline.f, "\n]\n");
+	fclose(timeline.f);
+	timeline.f = NULL;
+}
+
+/* Timestamp for the spans below, 0 when disabled. */
+u64 timeline_clock() {
+	if (!timeline.f)
+		return 0;
+	return monotonic_ns();
+}
+
+/* Name the tracks of a new domain. */
+void timeline_domain(int domain) {
+	if (!timeline.f)
+		return;
+	u64 now = monotonic_ns();
+	event_begin("M", domain, 0, now);
+	fprintf(timeline.f, ",\"name\":\"process_name\","
+		"\"args\":{\"name\":\"domain %i\"}}", domain);
+	event_begin("M", domain, 0, now);
+	fprintf(timeline.f, ",\"name\":\"thread_name\","
+		"\"args\":{\"name\":\"fluxcapacitor\"}}");
+}
+
+/* `pid` was blocked on `syscall_no` since `start_ns`. */
+void timeline_blocked(int domain, int pid, int syscall_no, u64 start_ns) {
+	if (!timeline.f || !start_ns)
+		return;
+	event_begin("X", domain, pid, start_ns);
+	fprintf(timeline.f, ",\"dur\":%.3f,\"name\":\"%s\",\"cat\":\"blocked\"}",
+		(monotonic_ns() - start_ns) / 1000., syscall_to_str(syscall_no));
+}
+
+/* Everyone in the domain was idle since `start_ns`, and we made
+ * sure of it. */
+void timeline_settle(int domain, u64 start_ns) {
+	if (!timeline.f || !start_ns)
+		return;
+	event_begin("X", domain, 0, start_ns);
+	fprintf(timeline.f, ",\"dur\":%.3f,\"name\":\"settle\","
+		"\"cat\":\"tracer\"}", (monotonic_ns() - start_ns) / 1000.);
+}
+
+/* Time jumped forward by `speedup`, possibly 0, to wake `pid` from
+ * `syscall_no`. */
+void timeline_jump(int domain, int pid, int syscall_no, flux_time speedup,
+		   flux_time time_drift) {
+	if (!timeline.f)
+		return;
+	u64 now = monotonic_ns();
+	char name[64];
+	if (speedup > 0)
+		snprintf(name, sizeof(name), "jump %.3fs",
+			 speedup / 1000000000.);
+	else
+		snprintf(name, sizeof(name), "wake expired");
+	event_begin("i", domain, 0, now);
+	fprintf(timeline.f, ",\"s\":\"p\",\"name\":\"%s\","
+		"\"cat\":\"tracer\",\"args\":{\"speedup_ns\":%lli,"
+		"\"pid\":%i,\"syscall\":\"%s\"}}", name,
+		(long long)speedup, pid, syscall_to_str(syscall_no));
+	event_begin("C", domain, 0, now);
+	fprintf(timeline.f, ",\"name\":\"drift\","
+		"\"args\":{\"drift_ms\":%.3f}}", time_drift / 1000000.);
+}
@@ -7,8 +7,8 @@
   http://www.linuxjournal.com/article/6210?page=0,1
 */
 
-/* required for pread() */
-#define _XOPEN_SOURCE 500
+/* required for pread(), openat() and syscall() */
+#define _GNU_SOURCE
 /* required for long offsets for pread */
 #define _FILE_OFFSET_BITS 64
 
@@ -18,6 +18,7 @@
 #include <unistd.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <dirent.h>
 
 #include <sys/types.h>
 #include <sys/ptrace.h>
@@ -26,6 +27,7 @@
 #include <sys/signalfd.h>
 #include <sys/user.h>
 #include <sys/stat.h>
+#include <sys/syscall.h>
 
 #include "list.h"
 #include "trace.h"
@@ -38,6 +40,10 @@ extern struct options options;
 
 #define HPIDS_SIZE 51
 
+#ifndef __NR_pidfd_open
+# define __NR_pidfd_open 434
+#endif
+
 
 #if defined(__x86_64__)
 
@@ -55,6 +61,10 @@ extern struct options options;
 # define ARG5 (regs.r8)
 # define ARG6 (regs.r9)
 # define RET (regs.rax)
+# define IP (regs.rip)
+# define SP (regs.rsp)
+# define FP (regs.rbp)
+# define SYSCALL_INSN_LEN 2
 
 #elif defined(__i386__)
 
@@ -68,6 +78,10 @@ extern struct options options;
 # define ARG5 (regs.edi)
 # define ARG6 (regs.ebp)
 # define RET (regs.eax)
+# define IP (regs.eip)
+# define SP (regs.esp)
+# define FP (regs.ebp)
+# define SYSCALL_INSN_LEN 2
 
 #elif defined(__arm__)
 
@@ -91,6 +105,8 @@ extern struct options options;
 # define ARG5 (regs.ARM_r4)
 # define ARG6 (regs.ARM_r5)
 # define RET (regs.ARM_r0)
+# define IP (regs.ARM_pc)
+# define SYSCALL_INSN_LEN 4
 
 #else
 
@@ -103,11 +119,44 @@ struct trace {
 	int sfd;
 	int process_count;
 	struct hlist_head hpids[HPIDS_SIZE];
+	struct hlist_head hgroups[HPIDS_SIZE];
 
 	trace_callback callback;
 	void *userdata;
 
+	trace_preexec_callback preexec;
+
 	struct list_head list_of_waitpid_reports;
+
+	/* In trace_detach(), waiting for everyone to stop. */
+	int detaching;
+};
+
+/* What the threads of a process share: the address space and its
+ * descriptors. A process with thousands of threads still uses a
+ * handful of fds. */
+struct trace_group {
+	struct hlist_node node;
+
+	pid_t tgid;
+	int refs;
+	int mem_fd;
+	int task_fd;		/* /proc/<tgid>/task, opened on demand */
+	int pidfd;		/* opened on demand */
+	int execs;
+
+	/* Executable mappings, for trace_process_stack(). Loaded on
+	 * demand, dropped on exec. */
+	struct text_range *text;
+	int text_count;
+
+	/* See trace_process_slot(), dropped on exec. */
+	void *slot;
+};
+
+struct text_range {
+	unsigned long start;
+	unsigned long end;
 };
 
 struct trace_process {
@@ -116,10 +165,21 @@ struct trace_process {
 
 	pid_t pid;
 	int initialized;
+	/* From trace_attach(), or forked by one that is. */
+	int seized;
+	/* In a stop nobody is going to resume, see trace_attach()
+	 * and trace_detach(). */
+	int stopped;
+	/* Stopped on a syscall entry by trace_detach(). */
+	int detach_entry;
 	int within_syscall;
-	int mem_fd;
+	struct trace_group *group;
 	REGS_STRUCT regs;
 
+	/* Stopped, waiting for trace_release() */
+	int held;
+	int held_signal;
+
 	trace_callback callback;
 	void *userdata;
 };
@@ -147,8 +207,10 @@ struct trace *trace_new(trace_callback callback, void *userdata) {
 	if (trace->sfd == -1)
 		PFATAL("signalfd()");
 	int i;
-	for (i=0; i < HPIDS_SIZE; i++)
+	for (i=0; i < HPIDS_SIZE; i++) {
 		INIT_HLIST_HEAD(&trace->hpids[i]);
+		INIT_HLIST_HEAD(&trace->hgroups[i]);
+	}
 
 	trace->callback = callback;
 	trace->userdata = userdata;
@@ -163,8 +225,8 @@ void trace_free(struct trace *trace) {
 
 	int i;
 	for (i=0; i < HPIDS_SIZE; i++) {
-		struct hlist_node *pos;
-		hlist_for_each(pos, &trace->hpids[i]) {
+		struct hlist_node *pos, *n;
+		hlist_for_each_safe(pos, n, &trace->hpids[i]) {
 			struct trace_process *process =
 				hlist_entry(pos, struct trace_process, node);
 			ptrace(PTRACE_DETACH, process->pid, NULL, NULL);
@@ -181,6 +243,10 @@ int trace_continue(struct trace_process *process,
 	return 0;
 }
 
+void trace_preexec(struct trace *trace, trace_preexec_callback preexec) {
+	trace->preexec = preexec;
+}
+
 int trace_sfd(struct trace *trace) {
 	return trace->sfd;
 }
@@ -205,10 +271,68 @@ static int mem_fd_open(int pid) {
 	return fd;
 }
 
-static struct trace_process *trace_process_new(struct trace *trace, int pid) {
+/* Thread group id of a freshly cloned `pid`. */
+static int pid_tgid(int pid) {
+	char path[64], buf[512];
+	snprintf(path, sizeof(path), "/proc/%i/status", pid);
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd == -1)
+		PFATAL("open(%s, O_RDONLY)", path);
+	int r = read(fd, buf, sizeof(buf) - 1);
+	if (r < 0)
+		PFATAL("read(%s)", path);
+	close(fd);
+	buf[r] = '\0';
+
+	char *p = strstr(buf, "\nTgid:");
+	if (!p)
+		FATAL("No Tgid in %s", path);
+	return atoi(p + 6);
+}
+
+static struct trace_group *group_get(struct trace *trace, int tgid) {
+	struct hlist_node *pos;
+	hlist_for_each(pos, &trace->hgroups[tgid % HPIDS_SIZE]) {
+		struct trace_group *group =
+			hlist_entry(pos, struct trace_group, node);
+		if (group->tgid == tgid) {
+			group->refs += 1;
+			return group;
+		}
+	}
+
+	struct trace_group *group = calloc(1, sizeof(struct trace_group));
+	group->tgid = tgid;
+	group->refs = 1;
+	group->mem_fd = mem_fd_open(tgid);
+	group->task_fd = -1;
+	group->pidfd = -1;
+	hlist_add_head(&group->node, &trace->hgroups[tgid % HPIDS_SIZE]);
+	return group;
+}
+
+static void group_put(struct trace_group *group) {
+	group->refs -= 1;
+	if (group->refs)
+		return;
+	hlist_del(&group->node);
+	if (group->mem_fd != -1)
+		close(group->mem_fd);
+	if (group->task_fd != -1)
+		close(group->task_fd);
+	if (group->pidfd != -1)
+		close(group->pidfd);
+	free(group->text);
+	free(group->slot);
+	free(group);
+}
+
+static struct trace_process *trace_process_new(struct trace *trace, int pid,
+					       int tgid) {
 	struct trace_process *process = calloc(1, sizeof(struct trace_process));
+	process->trace = trace;
 	process->pid = pid;
-	process->mem_fd = mem_fd_open(pid);
+	process->group = group_get(trace, tgid);
 	trace->process_count += 1;
 	hlist_add_head(&process->node, &trace->hpids[pid % HPIDS_SIZE]);
 	return process;
@@ -217,12 +341,45 @@ static struct trace_process *trace_process_new(struct trace *trace, int pid) {
 static void trace_process_del(struct trace *trace, struct trace_process *process) {
 	hlist_del(&process->node);
 	trace->process_count -= 1;
-	if (process->mem_fd != -1)
-		close(process->mem_fd);
+	group_put(process->group);
 	free(process);
 }
 
-int trace_execvp(struct trace *trace, char **argv) {
+int trace_process_open(struct trace_process *process, const char *name) {
+	struct trace_group *group = process->group;
+	if (group->task_fd == -1) {
+		char path[64];
+		snprintf(path, sizeof(path), "/proc/%i/task", group->tgid);
+		group->task_fd = open(path, O_RDONLY | O_DIRECTORY |
+				      O_CLOEXEC);
+		if (group->task_fd == -1)
+			return -1;
+	}
+	char path[64];
+	snprintf(path, sizeof(path), "%i/%s", process->pid, name);
+	return openat(group->task_fd, path, O_RDONLY | O_CLOEXEC);
+}
+
+int trace_process_pidfd(struct trace_process *process) {
+	struct trace_group *group = process->group;
+	if (group->pidfd == -1)
+		group->pidfd = syscall(__NR_pidfd_open, group->tgid, 0);
+	return group->pidfd;
+}
+
+int trace_process_execs(struct trace_process *process) {
+	return process->group->execs;
+}
+
+int trace_process_tgid(struct trace_process *process) {
+	return process->group->tgid;
+}
+
+void **trace_process_slot(struct trace_process *process) {
+	return &process->group->slot;
+}
+
+int trace_execvp(struct trace *trace, char **argv, void *userdata) {
 	int pid = fork();
 	if (pid == -1)
 		PFATAL("fork()");
@@ -238,6 +395,9 @@ int trace_execvp(struct trace *trace, char **argv) {
 		int r = ptrace(PTRACE_TRACEME, 0, NULL, NULL);
 		if (r < 0)
 			PFATAL("ptrace(PTRACE_TRACEME)");
+		if (trace->preexec)
+			trace->preexec(userdata);
+
 		// Wait for the parent to catch up.
 		raise(SIGSTOP);
 
@@ -247,9 +407,10 @@ int trace_execvp(struct trace *trace, char **argv) {
 		PFATAL("execvp(\"%s\")", flat_argv);
 	}
 
-	struct trace_process *process = trace_process_new(trace, pid);
+	struct trace_process *process = trace_process_new(trace, pid, pid);
 	/* On new process call trace->callback, not process->callback. */
-	trace->callback(process, TRACE_ENTER, (void*)(long)pid, trace->userdata);
+	struct trace_enterarg enterarg = {pid, NULL};
+	trace->callback(process, TRACE_ENTER, &enterarg, userdata);
 	return pid;
 }
 
@@ -264,24 +425,30 @@ static struct trace_process *process_by_pid(struct trace *trace, int pid) {
 	return NULL;
 }
 
+#define PTRACE_OPTIONS (PTRACE_O_TRACESYSGOOD |	\
+			PTRACE_O_TRACEFORK |	\
+			PTRACE_O_TRACEVFORK |	\
+			PTRACE_O_TRACECLONE |	\
+			PTRACE_O_TRACEEXEC |	\
+			PTRACE_O_TRACEEXIT)
+
 static void ptrace_prepare(int pid) {
-	int r = ptrace(PTRACE_SETOPTIONS, pid, 0,
-		       PTRACE_O_TRACESYSGOOD |
-		       PTRACE_O_TRACEFORK |
-		       PTRACE_O_TRACEVFORK |
-		       PTRACE_O_TRACECLONE |
-		       PTRACE_O_TRACEEXEC |
-		       PTRACE_O_TRACEEXIT);
+	int r = ptrace(PTRACE_SETOPTIONS, pid, 0, PTRACE_OPTIONS);
 	if (r != 0)
 		PFATAL("ptrace(PTRACE_SETOPTIONS)");
 }
 
 static int process_stopped(struct trace *trace, struct trace_process *process,
-			   int signal) {
+			   int signal, int *syscall_no) {
 
 	int pid = process->pid;
 	int inject_signal = 0;
 
+	/* PTRACE_INTERRUPT, or a group-stop, of a seized process.
+	 * Nothing to deliver. */
+	if ((signal >> 8) == PTRACE_EVENT_STOP)
+		return 0;
+
 	switch (signal) {
 
 	case SIGTRAP | 0x80: { // assuming PTRACE_O_SYSGOOD
@@ -289,11 +456,22 @@ static int process_stopped(struct trace *trace, struct trace_process *process,
 		if (ptrace(PTRACE_GETREGS, pid, 0, &regs) < 0)
 			PFATAL("ptrace(PTRACE_GETREGS)");
 		int syscall_entry = SYSCALL_ENTRY;
+		/* A syscall skipped on entry by setting its number to
+		 * -1 exits with -ENOSYS, looking like an entry. */
+		if ((long)SYSCALL == -1 && process->within_syscall)
+			syscall_entry = 0;
 		struct trace_sysarg sysarg = {SYSCALL, ARG1, ARG2,
 					      ARG3, ARG4, ARG5, ARG6, RET};
 		process->regs = regs;
+		*syscall_no = sysarg.number;
 		if (syscall_entry != !process->within_syscall)
 			FATAL("syscall entry - exit desynchronizaion");
+		/* Detaching, a syscall that's just starting is left
+		 * to TRACE_DETACH. */
+		if (trace->detaching && syscall_entry) {
+			process->detach_entry = 1;
+			break;
+		}
 
 		int type = syscall_entry ? TRACE_SYSCALL_ENTER
 			: TRACE_SYSCALL_EXIT;
@@ -308,17 +486,34 @@ static int process_stopped(struct trace *trace, struct trace_process *process,
 		unsigned long child_pid;
 		if (ptrace(PTRACE_GETEVENTMSG, pid, NULL, &child_pid) < 0)
 			PFATAL("ptrace(PTRACE_GETEVENTMSG)");
+		/* Only a clone can start a thread. */
+		int tgid = child_pid;
+		if (signal == (SIGTRAP | (PTRACE_EVENT_CLONE << 8)))
+			tgid = pid_tgid(child_pid);
 		struct trace_process *child_process =
-			trace_process_new(trace, child_pid);
+			trace_process_new(trace, child_pid, tgid);
+		/* Stops with PTRACE_EVENT_STOP, not SIGSTOP. */
+		child_process->seized = process->seized;
+		struct trace_enterarg enterarg = {child_pid, process->userdata};
 		trace->callback(child_process, TRACE_ENTER,
-					 (void*)child_pid, trace->userdata);
+				&enterarg, trace->userdata);
 		break; }
 
 	case SIGTRAP | PTRACE_EVENT_EXEC << 8: {
 		// /proc/<pid>/mem  must be re-opened after exec.
-		if (process->mem_fd != -1)
-			close(process->mem_fd);
-		process->mem_fd = mem_fd_open(pid);
+		struct trace_group *group = process->group;
+		if (group->mem_fd != -1)
+			close(group->mem_fd);
+		group->mem_fd = mem_fd_open(pid);
+		if (group->task_fd != -1)
+			close(group->task_fd);
+		group->task_fd = -1;
+		group->execs += 1;
+		free(group->text);
+		group->text = NULL;
+		group->text_count = 0;
+		free(group->slot);
+		group->slot = NULL;
 		break; }
 
 	case SIGTRAP | PTRACE_EVENT_EXIT << 8:
@@ -340,12 +535,38 @@ static int process_stopped(struct trace *trace, struct trace_process *process,
 	return inject_signal;
 }
 
+/* A thread other than the leader called execve(). All the other
+ * threads are gone and it takes over the pid of the leader, which
+ * never reports its death. */
+static struct trace_process *exec_takeover(struct trace *trace,
+					   struct trace_process *leader) {
+	unsigned long former_pid;
+	if (ptrace(PTRACE_GETEVENTMSG, leader->pid, NULL, &former_pid) < 0)
+		PFATAL("ptrace(PTRACE_GETEVENTMSG)");
+	struct trace_process *process = process_by_pid(trace, former_pid);
+	if ((int)former_pid == leader->pid || !process)
+		return leader;
+
+	int pid = leader->pid;
+	struct trace_exitarg exitarg = {TRACE_EXIT_NORMAL, 0};
+	leader->callback(leader, TRACE_EXIT, &exitarg, leader->userdata);
+	trace_process_del(trace, leader);
+
+	hlist_del(&process->node);
+	process->pid = pid;
+	hlist_add_head(&process->node, &trace->hpids[pid % HPIDS_SIZE]);
+	process->callback(process, TRACE_PID_CHANGE, &pid, process->userdata);
+	return process;
+}
+
 static void process_evaluate(struct trace *trace,
 			     struct trace_process *process, int status) {
 
 	int inject_signal = 0;
+	int syscall_no = -1;
+	u64 start_ns = stats_clock();
 
-	if (!process->initialized) {
+	if (!process->initialized && !process->seized) {
 		/* First child SIGSTOPs itself after calling TRACEME,
 		   descendants are STOPPED due to TRACEFORK. */
 		if (!WIFSTOPPED(status) || WSTOPSIG(status) != SIGSTOP) {
@@ -355,10 +576,16 @@ static void process_evaluate(struct trace *trace,
 		ptrace_prepare(process->pid);
 		process->initialized = 1;
 	} else {
+		/* PTRACE_SEIZE already set the options, the first stop
+		 * is like any other. */
+		process->initialized = 1;
 		if (WIFSTOPPED(status)) {
 			/* We can't use WSTOPSIG(status) - it cuts high bits. */
 			int signal = (status >> 8) & 0xffff;
-			inject_signal = process_stopped(trace, process, signal);
+			if (signal == (SIGTRAP | PTRACE_EVENT_EXEC << 8))
+				process = exec_takeover(trace, process);
+			inject_signal = process_stopped(trace, process, signal,
+							&syscall_no);
 		} else
 		if (WIFSIGNALED(status) || WIFEXITED(status)) {
 			struct trace_exitarg exitarg;
@@ -372,15 +599,24 @@ static void process_evaluate(struct trace *trace,
 			process->callback(process, TRACE_EXIT, &exitarg,
 					  process->userdata);
 			trace_process_del(trace, process);
+			stats_stop(syscall_no, start_ns);
 			return;
 		} else {
 			SHOUT("%i status 0x%x not understood!", process->pid, status);
 		}
 	}
 
+	if (process->held || trace->detaching) {
+		process->held_signal = inject_signal;
+		process->stopped = 1;
+		stats_stop(syscall_no, start_ns);
+		return;
+	}
+
 	int r = ptrace(PTRACE_SYSCALL, process->pid, 0, inject_signal);
 	if (r < 0)
 		PFATAL("ptrace(PTRACE_SYSCALL)");
+	stats_stop(syscall_no, start_ns);
 }
 
 
@@ -466,6 +702,205 @@ int trace_read(struct trace *trace) {
 	return counter;
 }
 
+/* Seize the threads of `tgid` we don't have yet, up to `max` of
+ * them, and wait for each to stop. Returns how many, -1 if the first
+ * one can't be traced. */
+static int attach_threads(struct trace *trace, int tgid, void *userdata,
+			  struct trace_process **seized, int max) {
+	char path[64];
+	snprintf(path, sizeof(path), "/proc/%i/task", tgid);
+	DIR *dir = opendir(path);
+	if (!dir)
+		return -1;
+
+	int count = 0;
+	struct dirent *de;
+	while (count < max && (de = readdir(dir))) {
+		int tid = atoi(de->d_name);
+		if (tid <= 0 || process_by_pid(trace, tid))
+			continue;
+		if (ptrace(PTRACE_SEIZE, tid, 0, PTRACE_OPTIONS)) {
+			/* Gone, or cloned by a thread we already have:
+			 * it's ours, we'll hear about it. */
+			if (errno == ESRCH ||
+			    (errno == EPERM && process_by_pid(trace, tgid)))
+				continue;
+			closedir(dir);
+			return count ? count : -1;
+		}
+		if (ptrace(PTRACE_INTERRUPT, tid, 0, 0))
+			PFATAL("ptrace(PTRACE_INTERRUPT)");
+
+		struct trace_process *process =
+			trace_process_new(trace, tid, tgid);
+		process->seized = 1;
+		int status;
+		while (waitpid(tid, &status, __WALL) == -1) {
+			if (errno != EINTR)
+				PFATAL("waitpid()");
+		}
+		if (WIFSTOPPED(status) && status >> 16 == PTRACE_EVENT_STOP) {
+			process->initialized = 1;
+			process->stopped = 1;
+		} else {
+			/* A signal, an event or its death got there
+			 * first. Look at it later, in order. */
+			struct waitpid_report *sr =
+				calloc(1, sizeof(struct waitpid_report));
+			sr->pid = tid;
+			sr->status = status;
+			list_add_tail(&sr->in_list,
+				      &trace->list_of_waitpid_reports);
+		}
+		struct trace_enterarg enterarg = {tid, NULL};
+		trace->callback(process, TRACE_ENTER, &enterarg, userdata);
+		seized[count++] = process;
+	}
+	closedir(dir);
+	return count;
+}
+
+int trace_attach(struct trace *trace, int pid, void *userdata) {
+	int tgid = pid;
+	int size = 16, count = 0;
+	struct trace_process **seized =
+		malloc(size * sizeof(struct trace_process *));
+
+	/* Threads may come and go while we look, until we've got
+	 * them all stopped. */
+	while (1) {
+		int r = attach_threads(trace, tgid, userdata, &seized[count],
+				       size - count);
+		if (r < 0 && !count) {
+			free(seized);
+			return -1;
+		}
+		if (r <= 0)
+			break;
+		count += r;
+		if (count == size) {
+			size *= 2;
+			seized = realloc(seized,
+					 size * sizeof(struct trace_process *));
+		}
+	}
+
+	struct trace_process *leader = process_by_pid(trace, pid);
+	if (leader)
+		leader->callback(leader, TRACE_ATTACHED, NULL,
+				 leader->userdata);
+
+	int i;
+	for (i = 0; i < count; i++) {
+		struct trace_process *process = seized[i];
+		if (!process->stopped)
+			continue;
+		process->stopped = 0;
+		if (process->held)
+			continue;
+		if (ptrace(PTRACE_SYSCALL, process->pid, 0, 0))
+			PFATAL("ptrace(PTRACE_SYSCALL)");
+	}
+	free(seized);
+	return 0;
+}
+
+/* Evaluate the waitpid reports put aside, of processes we know by
+ * now. */
+static void reports_evaluate(struct trace *trace) {
+	struct list_head *pos, *tmp;
+	list_for_each_safe(pos, tmp, &trace->list_of_waitpid_reports) {
+		struct waitpid_report *sr =
+			hlist_entry(pos, struct waitpid_report, in_list);
+		struct trace_process *process = process_by_pid(trace, sr->pid);
+		if (!process)
+			continue;
+		list_del(&sr->in_list);
+		process_evaluate(trace, process, sr->status);
+		free(sr);
+	}
+}
+
+/* Not stopped, or not for long. */
+static int process_running(struct trace_process *process) {
+	return !process->stopped &&
+		!(process->held && process->initialized);
+}
+
+void trace_detach(struct trace *trace) {
+	struct hlist_node *pos, *n;
+	int i;
+
+	trace->detaching = 1;
+	for (i = 0; i < HPIDS_SIZE; i++) {
+		hlist_for_each(pos, &trace->hpids[i]) {
+			struct trace_process *process =
+				hlist_entry(pos, struct trace_process, node);
+			if (process_running(process) && process->initialized)
+				ptrace(PTRACE_INTERRUPT, process->pid, 0, 0);
+		}
+	}
+
+	/* Everyone to a stop. Syscall exits and signals on the way
+	 * are handled as usual, new children wait for us too. */
+	while (1) {
+		reports_evaluate(trace);
+		int running = 0;
+		for (i = 0; i < HPIDS_SIZE && !running; i++) {
+			hlist_for_each(pos, &trace->hpids[i]) {
+				if (process_running(hlist_entry(
+					    pos, struct trace_process, node)))
+					running = 1;
+			}
+		}
+		if (!running)
+			break;
+
+		int status;
+		int pid = waitpid(-1, &status, __WALL);
+		if (pid == -1) {
+			if (errno == EINTR)
+				continue;
+			if (errno != ECHILD)
+				PFATAL("waitpid()");
+			break;
+		}
+		struct waitpid_report *sr =
+			calloc(1, sizeof(struct waitpid_report));
+		sr->pid = pid;
+		sr->status = status;
+		list_add_tail(&sr->in_list, &trace->list_of_waitpid_reports);
+	}
+
+	for (i = 0; i < HPIDS_SIZE; i++) {
+		hlist_for_each_safe(pos, n, &trace->hpids[i]) {
+			struct trace_process *process =
+				hlist_entry(pos, struct trace_process, node);
+			REGS_STRUCT regs = process->regs;
+			struct trace_sysarg sysarg = {SYSCALL, ARG1, ARG2,
+						      ARG3, ARG4, ARG5, ARG6,
+						      RET};
+			if (process->callback)
+				process->callback(process, TRACE_DETACH,
+						  process->detach_entry ?
+						  &sysarg : NULL,
+						  process->userdata);
+			ptrace(PTRACE_DETACH, process->pid, 0,
+			       process->held_signal);
+			trace_process_del(trace, process);
+		}
+	}
+
+	struct list_head *lpos, *ltmp;
+	list_for_each_safe(lpos, ltmp, &trace->list_of_waitpid_reports) {
+		struct waitpid_report *sr =
+			hlist_entry(lpos, struct waitpid_report, in_list);
+		list_del(&sr->in_list);
+		free(sr);
+	}
+	trace->detaching = 0;
+}
+
 void trace_setregs(struct trace_process *process, struct trace_sysarg *sysarg) {
 	REGS_STRUCT regs = process->regs;
 	SYSCALL = sysarg->number;
@@ -480,6 +915,148 @@ void trace_setregs(struct trace_process *process, struct trace_sysarg *sysarg) {
 		PFATAL("ptrace(PTRACE_SETREGS)");
 }
 
+void trace_hold(struct trace_process *process) {
+	process->held = 1;
+}
+
+void trace_release(struct trace_process *process) {
+	if (!process->held)
+		FATAL("");
+	process->held = 0;
+	/* Not stopped yet, it goes on from its first stop. */
+	if (!process->initialized)
+		return;
+	int r = ptrace(PTRACE_SYSCALL, process->pid, 0, process->held_signal);
+	/* Killed while held, we'll see it exit. */
+	if (r < 0 && errno != ESRCH)
+		PFATAL("ptrace(PTRACE_SYSCALL)");
+}
+
+void trace_restart_syscall(struct trace_process *process) {
+	if (!process->held)
+		FATAL("");
+	/* Do what the kernel does for -ERESTARTNOINTR: rewind the
+	 * instruction pointer to the syscall instruction and put the
+	 * clobbered register back. */
+	REGS_STRUCT regs = process->regs;
+#if defined(__arm__)
+	RET = ARG1;
+#else
+	RET = SYSCALL;
+#endif
+	IP -= SYSCALL_INSN_LEN;
+	if (ptrace(PTRACE_SETREGS, process->pid, 0, &regs) < 0)
+		PFATAL("ptrace(PTRACE_SETREGS)");
+	process->regs = regs;
+}
+
+#if defined(SP)
+int trace_getpc(struct trace_process *process, unsigned long *ip,
+		unsigned long *sp) {
+	REGS_STRUCT regs;
+	if (ptrace(PTRACE_GETREGS, process->pid, 0, &regs) < 0)
+		return -1;
+	*ip = IP;
+	*sp = SP;
+	return 0;
+}
+
+void trace_setpc(struct trace_process *process, unsigned long ip,
+		 unsigned long sp) {
+	REGS_STRUCT regs;
+	if (ptrace(PTRACE_GETREGS, process->pid, 0, &regs) < 0)
+		PFATAL("ptrace(PTRACE_GETREGS)");
+	IP = ip;
+	SP = sp;
+	if (ptrace(PTRACE_SETREGS, process->pid, 0, &regs) < 0)
+		PFATAL("ptrace(PTRACE_SETREGS)");
+	process->regs = regs;
+}
+
+static int in_ranges(unsigned long ip, const unsigned long *ranges,
+		     int count) {
+	int i;
+	for (i = 0; i < count; i++) {
+		if (ip >= ranges[2 * i] && ip < ranges[2 * i + 1])
+			return 1;
+	}
+	return 0;
+}
+
+/* A thread doesn't stay long in the few instructions we care about. */
+#define STEP_MAX 64
+
+int trace_step_out(struct trace_process *process,
+		   const unsigned long *ranges, int count) {
+	struct trace *trace = process->trace;
+	struct hlist_node *pos;
+	int i;
+	for (i = 0; i < HPIDS_SIZE; i++) {
+		hlist_for_each(pos, &trace->hpids[i]) {
+			struct trace_process *thread =
+				hlist_entry(pos, struct trace_process, node);
+			if (thread->group != process->group)
+				continue;
+			int steps = 0;
+			while (1) {
+				unsigned long ip, sp;
+				if (trace_getpc(thread, &ip, &sp))
+					return -1;
+				if (!in_ranges(ip, ranges, count))
+					break;
+				/* Its stop is still to be looked at. */
+				if (!thread->stopped || steps++ == STEP_MAX)
+					return -1;
+				if (ptrace(PTRACE_SINGLESTEP, thread->pid, 0, 0))
+					PFATAL("ptrace(PTRACE_SINGLESTEP)");
+				int status;
+				while (waitpid(thread->pid, &status, __WALL) == -1) {
+					if (errno != EINTR)
+						PFATAL("waitpid()");
+				}
+				if (WIFSTOPPED(status) && status >> 8 == SIGTRAP)
+					continue;
+				/* A signal or its death, leave it to
+				 * the main loop. */
+				struct waitpid_report *sr =
+					calloc(1, sizeof(struct waitpid_report));
+				sr->pid = thread->pid;
+				sr->status = status;
+				list_add_tail(&sr->in_list,
+					      &trace->list_of_waitpid_reports);
+				thread->stopped = 0;
+				return -1;
+			}
+		}
+	}
+	return 0;
+}
+#else
+int trace_getpc(struct trace_process *process, unsigned long *ip,
+		unsigned long *sp) {
+	return -1;
+}
+
+void trace_setpc(struct trace_process *process, unsigned long ip,
+		 unsigned long sp) {
+	FATAL("");
+}
+
+int trace_step_out(struct trace_process *process,
+		   const unsigned long *ranges, int count) {
+	return -1;
+}
+#endif
+
+int trace_signal_pending(struct trace_process *process) {
+	struct __ptrace_peeksiginfo_args args = {0, 0, 1};
+	siginfo_t si;
+	if (ptrace(PTRACE_PEEKSIGINFO, process->pid, &args, &si) > 0)
+		return 1;
+	args.flags = PTRACE_PEEKSIGINFO_SHARED;
+	return ptrace(PTRACE_PEEKSIGINFO, process->pid, &args, &si) > 0;
+}
+
 static int copy_from_user_ptrace(struct trace_process *process, void *dst,
 				 unsigned long src, size_t len) {
 	size_t words = len / sizeof(long);
@@ -524,7 +1101,7 @@ static int copy_to_user_ptrace(struct trace_process *process, unsigned long dst,
 
 static int copy_from_user_fd(struct trace_process *process, void *dst,
 			     unsigned long src, unsigned len) {
-	int r = pread(process->mem_fd, dst, len, src);
+	int r = pread(process->group->mem_fd, dst, len, src);
 	if (r < 0)
 		PFATAL("pread(\"/proc/%i/mem\", offset=0x%lx, len=%u) = %i",
 		       process->pid, src, len, r);
@@ -536,7 +1113,7 @@ int copy_from_user(struct trace_process *process, void *dst,
 	if (src % sizeof(long) || len % sizeof(long))
 		PFATAL("unaligned");
 
-	if (process->mem_fd != -1)
+	if (process->group->mem_fd != -1)
 		return copy_from_user_fd(process, dst, src, len);
 	return copy_from_user_ptrace(process, dst, src, len);
 }
@@ -548,3 +1125,158 @@ int copy_to_user(struct trace_process *process, unsigned long dst,
 
 	return copy_to_user_ptrace(process, dst, src, len);
 }
+
+#if defined(FP)
+/* Read up to `len` bytes, stopping at the first fault. Returns how
+ * many were read. */
+static size_t peek_user(struct trace_process *process, unsigned long *dst,
+			unsigned long src, size_t len) {
+	if (process->group->mem_fd != -1) {
+		ssize_t r = pread(process->group->mem_fd, dst, len, src);
+		return r < 0 ? 0 : r;
+	}
+	size_t done;
+	for (done = 0; done < len; done += sizeof(long)) {
+		if (copy_from_user_ptrace(process, &dst[done / sizeof(long)],
+					  src + done, sizeof(long)))
+			break;
+	}
+	return done;
+}
+
+static void text_load(struct trace_process *process) {
+	struct trace_group *group = process->group;
+	free(group->text);
+	group->text = NULL;
+	group->text_count = 0;
+
+	int fd = trace_process_open(process, "maps");
+	if (fd == -1)
+		return;
+	FILE *f = fdopen(fd, "r");
+	int size = 0;
+	char *line = NULL;
+	size_t line_size = 0;
+	while (getline(&line, &line_size, f) != -1) {
+		unsigned long start, end;
+		char perms[8];
+		if (sscanf(line, "%lx-%lx %7s", &start, &end, perms) != 3 ||
+		    perms[2] != 'x')
+			continue;
+		if (group->text_count == size) {
+			size = size ? size * 2 : 32;
+			group->text = realloc(group->text,
+					      size * sizeof(struct text_range));
+		}
+		group->text[group->text_count++] =
+			(struct text_range){start, end};
+	}
+	free(line);
+	fclose(f);
+}
+
+/* The executable mapping `addr` is in, NULL if none. */
+static struct text_range *text_find(struct trace_process *process,
+				    unsigned long addr) {
+	struct trace_group *group = process->group;
+	int i;
+	for (i = 0; i < group->text_count; i++) {
+		if (addr >= group->text[i].start && addr < group->text[i].end)
+			return &group->text[i];
+	}
+	return NULL;
+}
+#endif
+
+/* How far above the stack pointer we look for the first frame. */
+#define STACK_SCAN 512
+#define STACK_SIZE (8 * 1024 * 1024)
+
+/* Walk the frame pointers: each frame starts with the caller's frame
+ * pointer and the return address. A bad pointer is no error here,
+ * it's just where the stack ends.
+ *
+ * We stop in the C library, usually built without frame pointers, so
+ * its callers need some guessing. If the frame pointer register
+ * doesn't point into the stack, the first frame is the first word on
+ * the stack that does, followed by an address in an executable
+ * mapping. And the function that called the library has no frame in
+ * the chain: its return address is taken to be the first word above
+ * the stack pointer that's executable, outside of the library. */
+int trace_process_stack(struct trace_process *process, unsigned long *pcs,
+			int max) {
+	REGS_STRUCT regs = process->regs;
+	int depth = 0;
+	if (max < 1)
+		return 0;
+	pcs[depth++] = IP;
+#if defined(FP)
+	struct text_range *leaf = text_find(process, IP);
+	if (!leaf) {
+		/* Never seen, dlopen()? */
+		text_load(process);
+		leaf = text_find(process, IP);
+	}
+
+	unsigned long sp = SP, fp = FP;
+	unsigned long stack[STACK_SCAN];
+	int words = peek_user(process, stack, sp, sizeof(stack)) /
+		sizeof(long);
+	int i;
+#define IN_STACK(addr, from) ((addr) > (from) &&			\
+			      (addr) < (from) + STACK_SIZE &&		\
+			      (addr) % sizeof(long) == 0)
+	unsigned long frame[2];
+	if (!IN_STACK(fp, sp) ||
+	    peek_user(process, frame, fp, sizeof(frame)) != sizeof(frame) ||
+	    !text_find(process, frame[1])) {
+		fp = 0;
+		for (i = 0; i < words; i++) {
+			unsigned long at = sp + i * sizeof(long);
+			if (IN_STACK(stack[i], at) &&
+			    peek_user(process, frame, stack[i],
+				      sizeof(frame)) == sizeof(frame) &&
+			    text_find(process, frame[1])) {
+				fp = stack[i];
+				break;
+			}
+		}
+	}
+	if (!fp)
+		return depth;
+
+	for (i = 0; i < words && sp + i * sizeof(long) < fp; i++) {
+		struct text_range *text = text_find(process, stack[i]);
+		if (text && text != leaf) {
+			pcs[depth++] = stack[i];
+			break;
+		}
+	}
+
+	while (depth < max) {
+		pcs[depth++] = frame[1];
+		/* The stack grows down, callers are above. */
+		if (!IN_STACK(frame[0], fp))
+			break;
+		fp = frame[0];
+		if (peek_user(process, frame, fp, sizeof(frame)) !=
+		    sizeof(frame) || !text_find(process, frame[1]))
+			break;
+	}
+#undef IN_STACK
+#endif
+	return depth;
+}
+
+/* Like `copy_from_user`, for any address and length. */
+int copy_from_user_unaligned(struct trace_process *process, void *dst,
+			     unsigned long src, size_t len) {
+	unsigned long start = src & ~(sizeof(long) - 1);
+	unsigned long end = (src + len + sizeof(long) - 1) &
+		~(sizeof(long) - 1);
+	char *buf = malloc(end - start);
+	int faults = copy_from_user(process, buf, start, end - start);
+	memcpy(dst, buf + (src - start), len);
+	free(buf);
+	return faults;
+}
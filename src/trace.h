@@ -1,9 +1,17 @@
 enum trace_types {
-	TRACE_ENTER,		/* arg = (void*)pid */
+	TRACE_ENTER,		/* arg = ptr to trace_enterarg */
 	TRACE_EXIT,		/* arg = ptr to trace_exitarg */
 	TRACE_SYSCALL_ENTER,	/* arg = ptr to trace_sysarg */
 	TRACE_SYSCALL_EXIT,	/* arg = ptr to trace_sysarg */
-	TRACE_SIGNAL		/* arg = ptr to signal number */
+	TRACE_SIGNAL,		/* arg = ptr to signal number */
+	TRACE_PID_CHANGE,	/* arg = ptr to the new pid, after a thread
+				   other than the leader did exec */
+	TRACE_ATTACHED,		/* arg = NULL, every thread of a process
+				   given to `trace_attach` is stopped */
+	TRACE_DETACH		/* arg = ptr to trace_sysarg if stopped on
+				   a syscall entry, NULL otherwise. From
+				   `trace_detach`, every traced process is
+				   stopped */
 };
 
 enum {
@@ -11,6 +19,13 @@ enum {
 	TRACE_EXIT_SIGNAL
 };
 
+struct trace_enterarg {
+	int pid;
+	/* Userdata of the process that forked this one, NULL if
+	 * started with `trace_execvp`. */
+	void *parent_userdata;
+};
+
 struct trace_exitarg {
 	int type;		/* normal exit or signal */
 	int value;		/* signal no or exit status */
@@ -33,15 +48,32 @@ struct trace_process;
 typedef int (*trace_callback)(struct trace_process *process,
 			      int type, void *arg, void *userdata);
 
-/* Allocate and initialize `struct trace`. `callback` with `tracedata`
- * will be called on the arrival of a new process. */
+/* Allocate and initialize `struct trace`. `callback` will be called
+ * on the arrival of a new process, with `userdata` for forked
+ * processes. */
 struct trace *trace_new(trace_callback callback, void *userdata);
 
 /* Release `struct trace`, stop tracing processes (PTRACE_DETACH). */
 void trace_free(struct trace *trace);
 
-/* Run a traced process. */
-int trace_execvp(struct trace *trace, char **argv);
+/* Set a function to run in the forked child just before exec, with
+ * the userdata given to `trace_execvp`. */
+typedef void (*trace_preexec_callback)(void *userdata);
+void trace_preexec(struct trace *trace, trace_preexec_callback preexec);
+
+/* Run a traced process. `userdata` is given to the callback. */
+int trace_execvp(struct trace *trace, char **argv, void *userdata);
+
+/* Trace the running process `pid` with all its threads, with
+ * PTRACE_SEIZE. The callback gets TRACE_ENTER for each thread, with
+ * `userdata`, then the thread `pid` gets TRACE_ATTACHED while they're
+ * all stopped. Returns -1 and sets errno if `pid` can't be traced. */
+int trace_attach(struct trace *trace, int pid, void *userdata);
+
+/* Stop tracing everyone and let them run on. Each process gets
+ * TRACE_DETACH once they're all stopped. Only for processes from
+ * `trace_attach`, and their children. */
+void trace_detach(struct trace *trace);
 
 /* Get a signal file descriptor. If readable call `trace_read`. */
 int trace_sfd(struct trace *trace);
@@ -60,9 +92,63 @@ int trace_continue(struct trace_process *process,
  * TRACE_SYSCALL_* callback. */
 void trace_setregs(struct trace_process *process, struct trace_sysarg *sysarg);
 
+/* Don't resume the process when the current callback returns. It
+ * stays stopped until `trace_release`. */
+void trace_hold(struct trace_process *process);
+void trace_release(struct trace_process *process);
+
+/* Make a held process, stopped on a syscall exit, run the syscall
+ * again once released. */
+void trace_restart_syscall(struct trace_process *process);
+
+/* Instruction and stack pointers of a stopped thread, read afresh:
+ * outside of syscall stops the registers we keep are stale. Returns
+ * -1 if they can't be read. */
+int trace_getpc(struct trace_process *process, unsigned long *ip,
+		unsigned long *sp);
+void trace_setpc(struct trace_process *process, unsigned long ip,
+		 unsigned long sp);
+
+/* During TRACE_ATTACHED, single-step the threads of the process
+ * until none is in one of `count` address ranges, `ranges` holding
+ * the start and end of each. Returns -1 if a thread can't be moved
+ * out. */
+int trace_step_out(struct trace_process *process,
+		   const unsigned long *ranges, int count);
+
+/* Has the stopped thread, or its process, a signal queued? */
+int trace_signal_pending(struct trace_process *process);
+
+/* Open a file in /proc/<pid>/task/<tid>/, read-only. The threads of
+ * a process share a single descriptor for the directory. */
+int trace_process_open(struct trace_process *process, const char *name);
+
+/* A pidfd for the process the thread belongs to, -1 if the kernel
+ * doesn't have pidfd_open(). Don't close it. */
+int trace_process_pidfd(struct trace_process *process);
+
+/* How many times the process called exec, to tell its address spaces
+ * apart. */
+int trace_process_execs(struct trace_process *process);
+
+/* The thread group id, the pid of the process. */
+int trace_process_tgid(struct trace_process *process);
+
+/* A pointer for the caller, shared by the threads of a process. What
+ * it points to is free()d on exec and when the process is gone. */
+void **trace_process_slot(struct trace_process *process);
+
+/* Return addresses on the stack of a process stopped in a
+ * TRACE_SYSCALL_* callback, innermost first, starting with the
+ * instruction pointer. Returns how many were stored in `pcs`. */
+int trace_process_stack(struct trace_process *process, unsigned long *pcs,
+			int max);
+
 /* Copy data to and from a process. Data length and address must be
    word-aligned. */
 int copy_from_user(struct trace_process *process, void *dst,
 		   unsigned long src, size_t len);
 int copy_to_user(struct trace_process *process, unsigned long dst,
 		 void *src, size_t len);
+int copy_from_user_unaligned(struct trace_process *process, void *dst,
+			     unsigned long src, size_t len);
@@ -1,57 +1,205 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <time.h>
-#include <sys/select.h>
 #include <string.h>
+#include <unistd.h>
 #include <sys/types.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
 #include <errno.h>
 
 #include "uevent.h"
 
 struct timespec uevent_now;
 
+#define MAX_EVENTS 64
+
+/* Timers registered with `uevent_timer()` */
+struct uevent_timer {
+	uevent_callback_t callback;
+	void *userdata;
+};
+
+static void timerfd_arm(int tfd, unsigned long long timeout_ns) {
+	struct itimerspec its;
+	memset(&its, 0, sizeof(its));
+	its.it_value.tv_sec = timeout_ns / 1000000000ULL;
+	its.it_value.tv_nsec = timeout_ns % 1000000000ULL;
+	/* Zero would disarm the timer. */
+	if (timeout_ns == 0)
+		its.it_value.tv_nsec = 1;
+	if (timerfd_settime(tfd, 0, &its, NULL) == -1) {
+		perror("timerfd_settime()");
+		abort();
+	}
+}
+
+static void timerfd_disarm(int tfd) {
+	struct itimerspec its;
+	memset(&its, 0, sizeof(its));
+	if (timerfd_settime(tfd, 0, &its, NULL) == -1) {
+		perror("timerfd_settime()");
+		abort();
+	}
+}
+
+static int timerfd_new() {
+	int tfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	if (tfd == -1) {
+		perror("timerfd_create()");
+		abort();
+	}
+	return tfd;
+}
+
+static void epoll_update(struct uevent *uevent, int op, int fd, int mask) {
+	struct epoll_event ev;
+	memset(&ev, 0, sizeof(ev));
+	if (mask & UEVENT_READ)
+		ev.events |= EPOLLIN;
+	if (mask & UEVENT_WRITE)
+		ev.events |= EPOLLOUT;
+	ev.data.fd = fd;
+	if (epoll_ctl(uevent->epfd, op, fd, &ev) == -1) {
+		perror("epoll_ctl()");
+		abort();
+	}
+}
 
 struct uevent *uevent_new(struct uevent *uevent) {
-	if (!uevent)
+	int allocated = 0;
+	if (!uevent) {
 		uevent = malloc(sizeof(struct uevent));
+		allocated = 1;
+	}
 	memset(uevent, 0, sizeof(struct uevent));
+	uevent->allocated = allocated;
 	uevent->used_slots = 0;
-	uevent->max_fd = 0;
-	FD_ZERO(&uevent->readfds);
-	FD_ZERO(&uevent->writefds);
+
+	uevent->epfd = epoll_create1(EPOLL_CLOEXEC);
+	if (uevent->epfd == -1) {
+		perror("epoll_create1()");
+		abort();
+	}
+
+	uevent->tfd = timerfd_new();
+	epoll_update(uevent, EPOLL_CTL_ADD, uevent->tfd, UEVENT_READ);
 	return uevent;
 }
 
+void uevent_free(struct uevent *uevent) {
+	int fd;
+	for (fd = 0; fd < uevent->fdmap_sz; fd++) {
+		if (uevent->fdmap[fd].callback && !uevent->fdmap[fd].mask) {
+			/* Timers are owned by us. */
+			free(uevent->fdmap[fd].userdata);
+			close(fd);
+		}
+	}
+	close(uevent->tfd);
+	close(uevent->epfd);
+	free(uevent->fdmap);
+	if (uevent->allocated)
+		free(uevent);
+}
+
+static struct uevent_slot *slot_get(struct uevent *uevent, int fd) {
+	if (fd >= uevent->fdmap_sz) {
+		int sz = uevent->fdmap_sz ? uevent->fdmap_sz : 64;
+		while (sz <= fd)
+			sz *= 2;
+		uevent->fdmap = realloc(uevent->fdmap,
+					sz * sizeof(struct uevent_slot));
+		memset(&uevent->fdmap[uevent->fdmap_sz], 0,
+		       (sz - uevent->fdmap_sz) * sizeof(struct uevent_slot));
+		uevent->fdmap_sz = sz;
+	}
+	return &uevent->fdmap[fd];
+}
+
+static void timer_dispatch(struct uevent *uevent, int tfd) {
+	struct uevent_timer *timer = uevent->fdmap[tfd].userdata;
+	struct uevent_timer t = *timer;
+	/* Release the slot first, the callback may want to register
+	 * a new timer. The descriptor stays open until it returns, so
+	 * that number isn't reused under it. */
+	free(timer);
+	uevent_clear(uevent, tfd);
+	t.callback(uevent, tfd, UEVENT_READ, t.userdata);
+	close(tfd);
+}
+
 int uevent_select(struct uevent *uevent, struct timeval *timeout) {
-	fd_set rfds;
-	fd_set wfds;
-	memcpy(&rfds, &uevent->readfds, sizeof(fd_set));
-	memcpy(&wfds, &uevent->writefds, sizeof(fd_set));
-	int r = select(uevent->max_fd + 1, &rfds, &wfds, NULL, timeout);
+	struct epoll_event events[MAX_EVENTS];
+
+	int wait_ms = -1;
+	if (timeout) {
+		unsigned long long timeout_ns =
+			timeout->tv_sec * 1000000000ULL +
+			timeout->tv_usec * 1000ULL;
+		if (timeout_ns == 0) {
+			wait_ms = 0;
+		} else {
+			/* epoll_wait() has only millisecond
+			 * granularity. */
+			timerfd_arm(uevent->tfd, timeout_ns);
+		}
+	}
+
+	int r = epoll_wait(uevent->epfd, events, MAX_EVENTS, wait_ms);
 	if (-1 == r) {
 		if (EINTR != errno) {
-			perror("select()");
+			perror("epoll_wait()");
 			abort();
 		}
 	}
 
 	clock_gettime(CLOCK_REALTIME, &uevent_now);
 
-	int i;
-	for (i=0; i < uevent->max_fd+1; i++) {
+	int i, ready = 0, timer_fired = 0;
+	for (i = 0; i < r; i++) {
+		int fd = events[i].data.fd;
+		if (fd == uevent->tfd) {
+			unsigned long long ticks;
+			if (read(fd, &ticks, sizeof(ticks)) < 0 &&
+			    errno != EAGAIN) {
+				perror("read(timerfd)");
+				abort();
+			}
+			timer_fired = 1;
+			continue;
+		}
+		/* Callback may have been cleared by an earlier
+		 * callback in this batch. */
+		if (fd >= uevent->fdmap_sz || !uevent->fdmap[fd].callback)
+			continue;
+
+		if (!uevent->fdmap[fd].mask) {
+			timer_dispatch(uevent, fd);
+			ready++;
+			continue;
+		}
+
 		int mask = 0;
-		if (FD_ISSET(i, &rfds)) {
+		if (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) {
 			mask |= UEVENT_READ;
 		}
-		if (FD_ISSET(i, &wfds)) {
+		if (events[i].events & (EPOLLOUT | EPOLLERR)) {
 			mask |= UEVENT_WRITE;
 		}
+		mask &= uevent->fdmap[fd].mask;
 		if (mask) {
-			uevent->fdmap[i].callback(uevent, i, mask,
-						  uevent->fdmap[i].userdata);
+			uevent->fdmap[fd].callback(uevent, fd, mask,
+						   uevent->fdmap[fd].userdata);
+			ready++;
 		}
 	}
-	return r;
+
+	/* Don't let a stale timeout wake up the next call. */
+	if (timeout && wait_ms && !timer_fired)
+		timerfd_disarm(uevent->tfd);
+
+	return r == -1 ? -1 : ready;
 }
 
 int uevent_loop(struct uevent *uevent) {
@@ -66,37 +214,68 @@ int uevent_loop(struct uevent *uevent) {
 
 int uevent_yield(struct uevent *uevent, int fd, int mask,
 		 uevent_callback_t callback, void *userdata) {
-	if (fd >= __FD_SETSIZE) {
-		fprintf(stderr, "Can't handle more than %i descriptors.",
-			__FD_SETSIZE);
+	if (fd < 0 || !mask) {
 		abort();
 	}
 	if (!callback) {
 		abort();
 	}
 
-	if (mask & UEVENT_READ) {
-	 	FD_SET(fd, &uevent->readfds);
-	}
-	if (mask & UEVENT_WRITE) {
-		FD_SET(fd, &uevent->writefds);
-	}
-	if (!uevent->fdmap[fd].callback) {
+	struct uevent_slot *slot = slot_get(uevent, fd);
+	if (!slot->callback) {
 		uevent->used_slots++;
-		if (uevent->max_fd < fd) {
-			uevent->max_fd = fd;
-		}
+		epoll_update(uevent, EPOLL_CTL_ADD, fd, mask);
+	} else if ((slot->mask | mask) != slot->mask) {
+		epoll_update(uevent, EPOLL_CTL_MOD, fd, slot->mask | mask);
 	}
-	uevent->fdmap[fd].callback = callback;
-	uevent->fdmap[fd].userdata = userdata;
+	slot->mask |= mask;
+	slot->callback = callback;
+	slot->userdata = userdata;
 	return 1;
 }
 
 void uevent_clear(struct uevent *uevent, int fd) {
-	FD_CLR(fd, &uevent->readfds);
-	FD_CLR(fd, &uevent->writefds);
+	if (fd >= uevent->fdmap_sz || !uevent->fdmap[fd].callback)
+		return;
+	/* The descriptor may already be closed, in which case the
+	 * kernel has dropped it from the epoll set already. */
+	epoll_ctl(uevent->epfd, EPOLL_CTL_DEL, fd, NULL);
 	uevent->fdmap[fd].callback = NULL;
 	uevent->fdmap[fd].userdata = NULL;
+	uevent->fdmap[fd].mask = 0;
 	uevent->used_slots--;
 }
 
+
+int uevent_timer(struct uevent *uevent, unsigned long long timeout_ns,
+		 uevent_callback_t callback, void *userdata) {
+	if (!callback) {
+		abort();
+	}
+	int tfd = timerfd_new();
+
+	struct uevent_timer *timer = malloc(sizeof(struct uevent_timer));
+	timer->callback = callback;
+	timer->userdata = userdata;
+
+	/* Timers are marked by an empty mask in the slot. */
+	struct uevent_slot *slot = slot_get(uevent, tfd);
+	slot->callback = callback;
+	slot->userdata = timer;
+	slot->mask = 0;
+	uevent->used_slots++;
+	epoll_update(uevent, EPOLL_CTL_ADD, tfd, UEVENT_READ);
+
+	timerfd_arm(tfd, timeout_ns);
+	return tfd;
+}
+
+void uevent_timer_cancel(struct uevent *uevent, int tfd) {
+	/* Fired already, or not a timer. */
+	if (tfd < 0 || tfd >= uevent->fdmap_sz ||
+	    !uevent->fdmap[tfd].callback || uevent->fdmap[tfd].mask)
+		return;
+	free(uevent->fdmap[tfd].userdata);
+	uevent_clear(uevent, tfd);
+	close(tfd);
+}
@@ -5,20 +5,24 @@ struct uevent;
 
 typedef int (*uevent_callback_t)(struct uevent *uevent, int sd, int mask, void *userdata);
 
+struct uevent_slot {
+	uevent_callback_t callback;
+	void *userdata;
+	int mask;
+};
+
 struct uevent {
-	int max_slots;
-	int curr_slot;
+	int allocated;
 	int used_slots;
-	
-	struct {
-		uevent_callback_t callback;
-		void *userdata;
-	} fdmap[__FD_SETSIZE];
-	
-	fd_set readfds;
-	fd_set writefds;
-	int max_fd;
-	
+
+	int epfd;
+
+	/* Timerfd used to implement `uevent_select()` timeouts. */
+	int tfd;
+
+	/* Indexed by file descriptor, grows on demand. */
+	struct uevent_slot *fdmap;
+	int fdmap_sz;
 };
 
 enum {
@@ -28,11 +32,20 @@ enum {
 
 
 struct uevent *uevent_new(struct uevent *uevent);
+void uevent_free(struct uevent *uevent);
 int uevent_loop(struct uevent *uevent);
 int uevent_select(struct uevent *uevent, struct timeval *timeout);
 
 int uevent_yield(struct uevent *uevent, int fd, int mask, uevent_callback_t callback, void *userdata);
 void uevent_clear(struct uevent *uevent, int fd);
 
+/* One-shot timers. `callback` is run from `uevent_select()` with the
+ * timer descriptor as `sd`, after `timeout_ns` nanoseconds. The timer
+ * is gone by then: cancelling it does nothing. Returns the timer
+ * descriptor. */
+int uevent_timer(struct uevent *uevent, unsigned long long timeout_ns,
+		 uevent_callback_t callback, void *userdata);
+void uevent_timer_cancel(struct uevent *uevent, int tfd);
+
 
 #endif // _UEVENT_H
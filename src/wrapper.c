@@ -1,8 +1,10 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <errno.h>
+#include <limits.h>
 #include <time.h>
 #include <sys/prctl.h>
+#include <sys/socket.h>
 
 #include "list.h"
 #include "types.h"
@@ -17,9 +19,87 @@ enum {
 	TYPE_MSEC = 1,
 	TYPE_TIMEVAL,
 	TYPE_TIMESPEC,
+	TYPE_NSEC,
 	TYPE_FOREVER
 };
 
+/* Is the syscall waiting for time alone, with no descriptors? */
+static int syscall_fd_free(struct trace_sysarg *sysarg) {
+	switch (sysarg->number) {
+	case __NR_nanosleep:
+	case __NR_clock_nanosleep:
+		return 1;
+	case __NR_poll:
+	case __NR_ppoll:
+		return sysarg->arg2 == 0;
+#ifdef __NR_select
+	case __NR_select:
+#endif
+#ifdef __NR__newselect
+	case __NR__newselect:
+#endif
+	case __NR_pselect6:
+		return sysarg->arg1 == 0;
+	}
+	return 0;
+}
+
+/* SO_RCVTIMEO or SO_SNDTIMEO, with a 32 or 64 bit time_t. */
+static int sockopt_timeout(long optname) {
+#ifdef SO_RCVTIMEO_NEW
+	if (optname == SO_RCVTIMEO_NEW || optname == SO_SNDTIMEO_NEW)
+		return 1;
+#endif
+#ifdef SO_RCVTIMEO_OLD
+	if (optname == SO_RCVTIMEO_OLD || optname == SO_SNDTIMEO_OLD)
+		return 1;
+#endif
+	return optname == SO_RCVTIMEO || optname == SO_SNDTIMEO;
+}
+
+/* Is `clock` one we move? Not the cpu time clocks. */
+static int clock_virtual(long clock) {
+	switch (clock) {
+	case CLOCK_REALTIME:
+	case CLOCK_REALTIME_COARSE:
+	case CLOCK_TAI:
+	case CLOCK_MONOTONIC:
+	case CLOCK_MONOTONIC_COARSE:
+	case CLOCK_MONOTONIC_RAW:
+	case CLOCK_BOOTTIME:
+		return 1;
+	}
+	return 0;
+}
+
+/* The child is about to sleep and nobody else in the domain can
+ * wake up before it does. Don't bother going through the kernel and
+ * the settle phase in main_loop(): skip the syscall, move the clock
+ * right away and make the syscall time out on exit.
+ *
+ * Skipping a syscall by changing its number needs orig_eax/orig_rax,
+ * so this is x86 only. */
+static void fast_forward(struct child *child, struct trace_sysarg *sysarg,
+			 flux_time timeout) {
+#if defined(__x86_64__) || defined(__i386__)
+	if (!syscall_fd_free(sysarg) ||
+	    !parent_fast_forward_ok(child->parent, child))
+		return;
+
+	PRINT(" ~  %i fast forward %s() by %.3f sec",
+	      child->pid, syscall_to_str(sysarg->number),
+	      timeout / 1000000000.);
+	child->parent->time_drift += timeout;
+	parent_note_advance(child->parent, child->pid, sysarg->number,
+			    timeout, monotonic_ns());
+
+	sysarg->number = -1;
+	trace_setregs(child->process, sysarg);
+	child->skipped = 1;
+	child->skipped_ret = 0;
+#endif
+}
+
 /* Responsibilities:
  *  - save child->blocked_time if syscall is recognized
  *  - work together with preload.c to simplify syscall parameters
@@ -27,7 +107,25 @@ enum {
 void wrapper_syscall_enter(struct child *child, struct trace_sysarg *sysarg) {
 
 	int type = 0;
-	long value = 0;
+	s64 value = 0;
+
+	critpath_syscall_enter(child, sysarg);
+
+	if (child->restarting) {
+		child->restarting = 0;
+		/* Restarted after the freezer interrupted it, the
+		 * deadline stays the same. */
+		if (child->timed &&
+		    (sysarg->number == child->syscall_no ||
+		     sysarg->number == __NR_restart_syscall)) {
+			profile_blocked(child);
+			return;
+		}
+		/* Something else, the wait is over. */
+		profile_unblocked(child);
+		child->blocked_until = TIMEOUT_UNKNOWN;
+	}
+	child->fd_free = syscall_fd_free(sysarg);
 
 	switch ((unsigned short)sysarg->number) {
 	case __NR_epoll_wait:
@@ -49,8 +147,25 @@ void wrapper_syscall_enter(struct child *child, struct trace_sysarg *sysarg) {
 	case __NR_ppoll:
 		type = TYPE_TIMESPEC; value = sysarg->arg3; break;
 
+	/* Not from the preload library, which turns it into
+	 * nanosleep(). From a process we attached to, see attach.c. */
 	case __NR_clock_nanosleep:
-		FATAL("clock_nanosleep() unsupported");
+		if (!clock_virtual(sysarg->arg1))
+			break;
+		if (sysarg->arg2 & TIMER_ABSTIME) {
+			/* A deadline on the virtual clock. */
+			struct timespec ts, now;
+			copy_from_user(child->process, &ts, sysarg->arg3,
+				       sizeof(struct timespec));
+			clock_gettime(sysarg->arg1, &now);
+			type = TYPE_NSEC;
+			value = MAX((flux_time)TIMESPEC_NSEC(&ts) -
+				    (flux_time)TIMESPEC_NSEC(&now) -
+				    child->parent->time_drift, 0);
+		} else {
+			type = TYPE_TIMESPEC; value = sysarg->arg3;
+		}
+		break;
 
 	case __NR_nanosleep:
 		/* Second argument to nanosleep() can be ignored, it's
@@ -58,6 +173,77 @@ void wrapper_syscall_enter(struct child *child, struct trace_sysarg *sysarg) {
 		type = TYPE_TIMESPEC; value = sysarg->arg1;
 		break;
 
+	/* Data to a --latency port, see latency.c. Otherwise, like
+	 * the reads below. */
+	case __NR_write:
+	case __NR_writev:
+#ifdef __NR_sendto
+	case __NR_sendto:
+#endif
+#ifdef __NR_sendmsg
+	case __NR_sendmsg:
+#endif
+#ifdef __NR_sendmmsg
+	case __NR_sendmmsg:
+#endif
+		if (latency_syscall_enter(child, sysarg))
+			return;
+#ifdef __NR_connect
+		/* fall through */
+	case __NR_connect:
+#endif
+		if (child->parent->sock_timeouts) {
+			value = fdprobe_sock_timeout(child, sysarg->arg1,
+						     SO_SNDTIMEO);
+			type = value ? TYPE_NSEC : 0;
+		}
+		break;
+
+#ifdef __NR_shutdown
+	/* Waits behind the delayed data, see latency.c. */
+	case __NR_shutdown:
+#endif
+	/* Data to a --latency port, read from elsewhere. */
+	case __NR_sendfile:
+	case __NR_splice:
+		latency_syscall_enter(child, sysarg);
+		break;
+
+	/* A socket with SO_RCVTIMEO. Once someone in the domain set
+	 * the option, we ask the kernel, once per descriptor, see
+	 * fdprobe_sock_timeout(). */
+	case __NR_read:
+	case __NR_readv:
+#ifdef __NR_recvfrom
+	case __NR_recvfrom:
+#endif
+#ifdef __NR_recvmsg
+	case __NR_recvmsg:
+#endif
+#ifdef __NR_accept
+	case __NR_accept:
+#endif
+#ifdef __NR_accept4
+	case __NR_accept4:
+#endif
+		if (child->parent->sock_timeouts) {
+			value = fdprobe_sock_timeout(child, sysarg->arg1,
+						     SO_RCVTIMEO);
+			type = value ? TYPE_NSEC : 0;
+		}
+		break;
+
+#ifdef __NR_setsockopt
+	case __NR_setsockopt:
+		if (sysarg->arg2 == SOL_SOCKET &&
+		    sockopt_timeout(sysarg->arg3) &&
+		    !child->parent->sock_timeouts) {
+			PRINT(" ~  %i sets a socket timeout", child->pid);
+			child->parent->sock_timeouts = 1;
+		}
+		return;
+#endif
+
 	/* Anti-debugging machinery. Prevent processes from disabling ptrace. */
 	case __NR_prctl:
 		if (sysarg->arg1 == PR_SET_DUMPABLE && sysarg->arg2 == 0) {
@@ -102,6 +288,10 @@ void wrapper_syscall_enter(struct child *child, struct trace_sysarg *sysarg) {
 		}
 		break;
 
+	case TYPE_NSEC:
+		timeout = value;
+		break;
+
 	case TYPE_FOREVER:
 		timeout = TIMEOUT_FOREVER;
 		break;
@@ -118,28 +308,55 @@ void wrapper_syscall_enter(struct child *child, struct trace_sysarg *sysarg) {
 		      timeout == TIMEOUT_FOREVER ? "forever" : "unknown timeout");
 		child->blocked_until = timeout;
 		break;
-	default:
+	default: {
 		PRINT(" ~  %i blocking on %s() for %.3f sec",
 		      child->pid, syscall_to_str(sysarg->number),
 		      timeout / 1000000000.);
-		child->blocked_until = (flux_time)TIMESPEC_NSEC(&uevent_now) +
+		/* Not uevent_now, the child started counting after our
+		 * last clock reading. */
+		struct timespec ts;
+		clock_gettime(CLOCK_REALTIME, &ts);
+		child->blocked_until = (flux_time)TIMESPEC_NSEC(&ts) +
 			child->parent->time_drift + (flux_time)timeout;
+		break; }
 	}
+	child->timed = 1;
 	child->syscall_no = sysarg->number;
+	profile_blocked(child);
+
+	if (timeout > 0)
+		fast_forward(child, sysarg, timeout);
 }
 
 int wrapper_syscall_exit(struct child *child, struct trace_sysarg *sysarg) {
 
+	critpath_syscall_exit(child, sysarg);
+	child->timed = 0;
 	child->syscall_no = 0;
 
+	if (child->skipped) {
+		child->skipped = 0;
+		/* Kernel said -ENOSYS, we say "timeout" or "sent". */
+		sysarg->ret = child->skipped_ret;
+		trace_setregs(child->process, sysarg);
+		return 0;
+	}
+
 	switch (sysarg->number) {
 
 	case __NR_clock_gettime: {
 		if (sysarg->ret == 0) {
-			if (sysarg->arg1 != CLOCK_REALTIME && sysarg->arg1 != CLOCK_MONOTONIC)
-				FATAL("%li ", sysarg->arg1);
 			struct timespec ts;
-			clock_gettime(CLOCK_REALTIME, &ts);
+			/* The preload library only asks for this one,
+			 * the vDSO of an attached process any. */
+			if (sysarg->arg1 == CLOCK_REALTIME) {
+				clock_gettime(CLOCK_REALTIME, &ts);
+			} else if (clock_virtual(sysarg->arg1)) {
+				copy_from_user(child->process, &ts, sysarg->arg2,
+					       sizeof(struct timespec));
+			} else {
+				break;
+			}
 			flux_time newtime = TIMESPEC_NSEC(&ts) + child->parent->time_drift;
 			ts = NSEC_TIMESPEC(newtime);
 			copy_to_user(child->process, sysarg->arg2, &ts,
@@ -147,12 +364,103 @@ int wrapper_syscall_exit(struct child *child, struct trace_sysarg *sysarg) {
 		}
 		break;}
 
+#ifdef __NR_gettimeofday
+	case __NR_gettimeofday: {
+		if (sysarg->ret == 0 && sysarg->arg1) {
+			struct timespec ts;
+			clock_gettime(CLOCK_REALTIME, &ts);
+			flux_time newtime = TIMESPEC_NSEC(&ts) + child->parent->time_drift;
+			struct timeval tv = {newtime / 1000000000ULL,
+					     (newtime % 1000000000ULL) / 1000ULL};
+			copy_to_user(child->process, sysarg->arg1, &tv,
+				     sizeof(struct timeval));
+		}
+		break;}
+#endif
+
+#ifdef __NR_time
+	case __NR_time: {
+		struct timespec ts;
+		clock_gettime(CLOCK_REALTIME, &ts);
+		time_t t = (TIMESPEC_NSEC(&ts) + child->parent->time_drift) /
+			1000000000ULL;
+		if (sysarg->arg1 && sysarg->arg1 % sizeof(long) == 0)
+			copy_to_user(child->process, sysarg->arg1, &t,
+				     sizeof(time_t));
+		sysarg->ret = t;
+		trace_setregs(child->process, sysarg);
+		break;}
+#endif
+
+	/* What fdprobe.c knows about the descriptor is stale. */
+	case __NR_close:
+		fdprobe_forget(child, sysarg->arg1, sysarg->arg1);
+		break;
+#ifdef __NR_dup2
+	case __NR_dup2:
+#endif
+	case __NR_dup3:
+		if (sysarg->ret >= 0)
+			fdprobe_forget(child, sysarg->arg2, sysarg->arg2);
+		break;
+#ifdef __NR_connect
+	case __NR_connect:
+#endif
+#ifdef __NR_bind
+	case __NR_bind:
+#endif
+		fdprobe_forget(child, sysarg->arg1, sysarg->arg1);
+		break;
+#ifdef __NR_close_range
+	case __NR_close_range:
+		if (sysarg->ret == 0)
+			fdprobe_forget(child, sysarg->arg1,
+				       MIN((unsigned long)sysarg->arg2, INT_MAX));
+		break;
+#endif
+#ifdef __NR_setsockopt
+	case __NR_setsockopt:
+		if (sysarg->ret == 0 && sysarg->arg2 == SOL_SOCKET &&
+		    sockopt_timeout(sysarg->arg3))
+			fdprobe_timeouts_changed();
+		break;
+#endif
 	}
 	return 0;
 
 }
 
 
+/* `child` is entering a syscall and we're letting it go. A deadline
+ * on the virtual clock is far ahead on the real one: skip the
+ * syscall, as if the deadline passed. x86 only like fast_forward(). */
+void wrapper_detach_enter(struct child *child, struct trace_sysarg *sysarg) {
+#if defined(__x86_64__) || defined(__i386__)
+	if (sysarg->number != __NR_clock_nanosleep ||
+	    !clock_virtual(sysarg->arg1) || !(sysarg->arg2 & TIMER_ABSTIME))
+		return;
+	sysarg->number = -1;
+	sysarg->ret = 0;
+	trace_setregs(child->process, sysarg);
+#endif
+}
+
+/* Was the syscall broken by a signal (or by the freezer)? */
+int wrapper_interrupted(struct trace_sysarg *sysarg) {
+	return sysarg->ret == -EINTR ||
+		(-512 >= sysarg->ret && sysarg->ret >= -517);
+}
+
+/* Was the syscall broken by the freezer, not by a signal? The freezer
+ * queues no signal. Syscalls it breaks return -ERESTART*, which the
+ * kernel restarts, or -EINTR, which we rewind by hand. An -EINTR with
+ * a signal queued belongs to the program. */
+int wrapper_frozen(struct child *child, struct trace_sysarg *sysarg) {
+	if (sysarg->ret == -EINTR)
+		return !trace_signal_pending(child->process);
+	return -512 >= sysarg->ret && sysarg->ret >= -517;
+}
+
 /* When we break a syscall by sending a signal, kernel returns
  * ERESTART_RESTARTBLOCK or similar error. Here we rewrite this value
  * to a result that will read: "timeout". */
@@ -170,6 +478,7 @@ void wrapper_pacify_signal(struct child *child, struct trace_sysarg *sysarg) {
 	case __NR_select:
 #endif
 	case __NR_nanosleep:
+	case __NR_clock_nanosleep:
 	case __NR_pselect6:
 	case __NR_poll:
 	case __NR_ppoll:
@@ -180,6 +489,43 @@ void wrapper_pacify_signal(struct child *child, struct trace_sysarg *sysarg) {
 			sysarg->ret = 0;
 		}
 		break;
+
+	/* Socket timeouts, as if SO_RCVTIMEO or SO_SNDTIMEO
+	 * expired. */
+	case __NR_read:
+	case __NR_readv:
+	case __NR_write:
+	case __NR_writev:
+#ifdef __NR_recvfrom
+	case __NR_recvfrom:
+#endif
+#ifdef __NR_recvmsg
+	case __NR_recvmsg:
+#endif
+#ifdef __NR_accept
+	case __NR_accept:
+#endif
+#ifdef __NR_accept4
+	case __NR_accept4:
+#endif
+#ifdef __NR_sendto
+	case __NR_sendto:
+#endif
+#ifdef __NR_sendmsg
+	case __NR_sendmsg:
+#endif
+#ifdef __NR_connect
+	case __NR_connect:
+#endif
+		if (!wrapper_interrupted(sysarg))
+			break;
+		sysarg->ret = -EAGAIN;
+#ifdef __NR_connect
+		/* Still connecting in the background. */
+		if (sysarg->number == __NR_connect)
+			sysarg->ret = -EINPROGRESS;
+#endif
+		break;
 	default:
 		return;
 	}
@@ -60,7 +60,7 @@ def at_most(seconds=None):
     return decorator
 
 
-def compile(code=None):
+def compile(code=None, flags=''):
     def decorator(fn):
         @functools.wraps(fn)
         def wrapper(self, *args, **kwargs):
@@ -70,9 +70,9 @@ def compile(code=None):
             os.write(fd, code + '\n')
             os.close(fd)
             try:
-                cc_cmd = "%s %s -Os -Wall %s -o %s" \
+                cc_cmd = "%s %s -Os -Wall %s -o %s %s" \
                     % (os.getenv('CC', 'cc'), os.getenv('CFLAGS', ''),
-                       source, compiled)
+                       source, compiled, flags)
                 rc = subprocess.call(cc_cmd, shell=True)
                 self.assertEqual(rc, 0)
 
@@ -1,7 +1,12 @@
 import os
+import json
 import tests
 from tests import at_most, compile, savefile
+import shutil
+import socket
 import subprocess
+import tempfile
+import time
 
 
 node_present = True
@@ -17,6 +22,25 @@ if (os.system("erl -version >/dev/null 2>/dev/null") != 0 or
     erlang_present = False
 
 
+def cgroup2_dir():
+    # Our own cgroup v2 directory, if we may create cgroups in it.
+    mnt = None
+    for line in open('/proc/self/mountinfo'):
+        if ' - cgroup2 ' in line:
+            mnt = line.split()[4]
+            break
+    for line in open('/proc/self/cgroup'):
+        if mnt and line.startswith('0::'):
+            path = mnt + line[3:].strip().rstrip('/')
+            if os.access(path, os.W_OK):
+                return path
+    return None
+
+cgroup_dir = cgroup2_dir()
+if not cgroup_dir:
+    print " [!] ignoring cgroup tests"
+
+
 sleep_sort_script='''\
 #!/bin/bash
 echo "Unsorted: $*"
@@ -32,6 +56,195 @@ wait
 echo
 '''
 
+# Prints the average round trip time over loopback, in ms.
+ping_pong_script='''\
+import os, socket, sys, time
+s = socket.socket()
+s.setsockopt(socket.SOL_SOCKET, socket.SO_REUSEADDR, 1)
+s.bind(('127.0.0.1', int(sys.argv[1])))
+s.listen(1)
+if os.fork() == 0:
+    c, _ = s.accept()
+    while True:
+        d = c.recv(100)
+        if not d:
+            break
+        c.sendall(d)
+    os._exit(0)
+c = socket.create_connection(s.getsockname())
+t0 = time.time()
+for i in range(10):
+    c.sendall('x')
+    c.recv(100)
+print int((time.time() - t0) * 100)
+c.close()
+os.wait()
+'''
+
+# Data with and without flags, then a shutdown(), all delivered in
+# order after 50ms. Prints what arrived and the time it took.
+latency_order_script='''\
+import ctypes, os, socket, sys, tempfile, time
+libc = ctypes.CDLL(None, use_errno=True)
+class iovec(ctypes.Structure):
+    _fields_ = [('base', ctypes.c_char_p), ('len', ctypes.c_size_t)]
+class msghdr(ctypes.Structure):
+    _fields_ = [('name', ctypes.c_void_p), ('namelen', ctypes.c_uint),
+                ('iov', ctypes.POINTER(iovec)), ('iovlen', ctypes.c_size_t),
+                ('control', ctypes.c_void_p), ('controllen', ctypes.c_size_t),
+                ('flags', ctypes.c_int)]
+class mmsghdr(ctypes.Structure):
+    _fields_ = [('hdr', msghdr), ('len', ctypes.c_uint)]
+s = socket.socket()
+s.setsockopt(socket.SOL_SOCKET, socket.SO_REUSEADDR, 1)
+s.bind(('127.0.0.1', int(sys.argv[1])))
+s.listen(1)
+if os.fork() == 0:
+    c = socket.create_connection(s.getsockname())
+    c.sendall('a')
+    c.send('b', 0x8000) # MSG_MORE
+    os.write(c.fileno(), 'c')
+    f = tempfile.TemporaryFile()
+    f.write('d')
+    f.flush()
+    off = ctypes.c_long(0)
+    assert libc.sendfile(c.fileno(), f.fileno(), ctypes.byref(off), 1) == 1
+    assert off.value == 1
+    r, w = os.pipe()
+    os.write(w, 'e')
+    assert libc.splice(r, None, c.fileno(), None, 1, 0) == 1
+    iovs = [iovec(x, 1) for x in 'fg']
+    msgs = (mmsghdr * 2)(*[mmsghdr(msghdr(None, 0, ctypes.pointer(v), 1,
+                                          None, 0, 0), 0) for v in iovs])
+    assert libc.sendmmsg(c.fileno(), msgs, 2, 0) == 2
+    assert [m.len for m in msgs] == [1, 1]
+    c.shutdown(socket.SHUT_WR)
+    c.recv(1)
+    os._exit(0)
+c, _ = s.accept()
+t0 = time.time()
+d = ''
+while True:
+    r = c.recv(100)
+    if not r:
+        break
+    d += r
+print d, int((time.time() - t0) * 100)
+c.close()
+os.wait()
+'''
+
+# The parent waits on a pipe for the first child (2s), then sleeps
+# 3s. The second child (1s) is never waited for.
+critical_path_script='''\
+import os, select
+r, w = os.pipe()
+a = os.fork()
+if a == 0:
+    select.select([], [], [], 2)
+    os.write(w, 'x')
+    os._exit(0)
+b = os.fork()
+if b == 0:
+    select.select([], [], [], 1)
+    os._exit(0)
+os.read(r, 1)
+select.select([], [], [], 3)
+os.waitpid(a, 0)
+os.waitpid(b, 0)
+'''
+
+# A forked child receives on a copy of a socket with a 30s
+# SO_RCVTIMEO, prints how long it waited.
+socket_timeout_script='''\
+import errno, os, socket, struct, time
+a, b = socket.socketpair()
+a.setsockopt(socket.SOL_SOCKET, socket.SO_RCVTIMEO, struct.pack('ll', 30, 0))
+t0 = time.time()
+if os.fork() == 0:
+    c = socket.fromfd(a.fileno(), socket.AF_UNIX, socket.SOCK_STREAM)
+    try:
+        c.recv(1)
+    except socket.error as e:
+        assert e.errno == errno.EAGAIN, e
+    print int(time.time() - t0)
+    os._exit(0)
+os.wait()
+'''
+
+# Two processes take turns on a socket pair, sleeping 0.5s and 0.2s
+# before each message. Prints the total.
+lockstep_script='''\
+import os, select, socket, time
+a, b = socket.socketpair()
+t0 = time.time()
+if os.fork() == 0:
+    for i in range(200):
+        select.select([], [], [], 0.5)
+        b.send('x')
+        b.recv(1)
+    os._exit(0)
+b.close()
+while a.recv(1):
+    select.select([], [], [], 0.2)
+    a.send('y')
+os.wait()
+print int(round(time.time() - t0))
+'''
+
+# The parent waits in epoll for 60s, a child exits after 5s. The
+# SIGCHLD handler doesn't restart syscalls, the wait fails with EINTR.
+signal_script='''\
+import errno, os, select, signal, time
+signal.signal(signal.SIGCHLD, lambda *a: None)
+t0 = time.time()
+if os.fork() == 0:
+    select.select([], [], [], 5)
+    os._exit(0)
+try:
+    select.epoll().poll(60)
+except IOError as e:
+    print errno.errorcode[e.errno], int(round(time.time() - t0))
+'''
+
+# A slow start, then a copy per job: sleeps for the job's argument and
+# prints it, and $JOB of the job.
+fork_server_script='''\
+import ctypes, select
+select.select([], [], [], 60)
+fork_point = ctypes.CDLL(None).fluxcapacitor_fork_point
+fork_point.restype = ctypes.POINTER(ctypes.c_char_p)
+argv = fork_point()
+getenv = ctypes.CDLL(None).getenv
+getenv.restype = ctypes.c_char_p
+select.select([], [], [], int(argv[0]))
+print argv[0], getenv('JOB')
+'''
+
+# Held on a fifo until the test opens it, then a copy per job: sleeps
+# for the job's argument, prints it and the pid of the template.
+fork_queue_script='''\
+import ctypes, os, select, sys
+open(sys.argv[1]).read()
+fork_point = ctypes.CDLL(None).fluxcapacitor_fork_point
+fork_point.restype = ctypes.POINTER(ctypes.c_char_p)
+argv = fork_point()
+select.select([], [], [], int(argv[0]))
+print argv[0], os.getppid()
+'''
+
+def zombies(ppid):
+    found = []
+    for pid in os.listdir('/proc'):
+        try:
+            stat = open('/proc/%s/stat' % pid).read()
+        except IOError:
+            continue
+        fields = stat.rsplit(')', 1)[-1].split()
+        if fields[0] == 'Z' and int(fields[1]) == ppid:
+            found.append(pid)
+    return found
+
 class SingleProcess(tests.TestCase):
     @at_most(seconds=2)
     def test_bash_sleep(self):
@@ -65,6 +278,13 @@ class SingleProcess(tests.TestCase):
             self.system('node -e "setTimeout(function(){},10000);"')
 
 
+    @at_most(seconds=2)
+    def test_python2_ticker(self):
+        # 5ms ticks are too short to speed up in the main loop, they
+        # must be skipped on syscall entry.
+        self.system('python2 -c "import select\n'
+                    'for i in range(1000): select.select([],[],[], 0.005)"')
+
     def test_bad_command(self):
         self.system('command_that_doesnt exist',
                     returncode=127, ignore_stderr=True)
@@ -72,6 +292,7 @@ class SingleProcess(tests.TestCase):
     def test_return_status(self):
         self.system('python2 -c "import sys; sys.exit(188)"', returncode=188)
         self.system('python2 -c "import sys; sys.exit(-1)"', returncode=255)
+        self.system("bash -c 'kill -TERM $$'", returncode=128 + 15)
 
 
     @at_most(seconds=2)
@@ -96,6 +317,26 @@ class SingleProcess(tests.TestCase):
     def test_c_nanosleep(self, compiled=None):
         self.system(compiled)
 
+    @at_most(seconds=2)
+    @compile(code='''
+    #include <pthread.h>
+    #include <poll.h>
+    #include <unistd.h>
+    static void *run(void *arg) {
+        poll(NULL, 0, 1000);
+        execl("/bin/sh", "sh", "-c", "exit 7", NULL);
+        return NULL;
+    }
+    int main() {
+        pthread_t t;
+        pthread_create(&t, NULL, run, NULL);
+        poll(NULL, 0, 10000);
+        return(0);
+    }''', flags='-pthread')
+    def test_c_thread_exec(self, compiled=None):
+        # The thread takes over the pid of the main one.
+        self.system(compiled, returncode=7)
+
 
 
     @at_most(seconds=5)
@@ -193,6 +434,448 @@ class SingleProcess(tests.TestCase):
             assert 55 < (c - b) < 65, str(c-b)
             assert 110 < (c - a) < 130, str(c-a)
 
+    @at_most(seconds=1)
+    def test_short_sleeps(self):
+        # Two processes sleeping 5ms at a time, each wakes up before
+        # the other: sleeps only, no need to settle.
+        self.system("python2 -c 'import os, time\n"
+                    "os.fork()\n"
+                    "for i in range(300): time.sleep(0.005)'")
+
+    @at_most(seconds=5)
+    def test_cgroup(self):
+        if not cgroup_dir:
+            return
+        self.do_system("%s --cgroup=%s -- bash -c "
+                       "'sleep 60 & sleep 120; wait'" %
+                       (self.fcpath, cgroup_dir))
+        assert not [d for d in os.listdir(cgroup_dir)
+                    if d.startswith('fluxcapacitor.')]
+
+    @at_most(seconds=5)
+    @savefile(suffix="py", text=signal_script)
+    def test_freeze(self, filename=None):
+        if not cgroup_dir:
+            return
+        out = subprocess.check_output("%s --freeze -- python2 %s" %
+                                      (self.fcpath, filename), shell=True)
+        self.assertEqual(out.strip(), 'EINTR 5')
+
+    @at_most(seconds=2)
+    def test_embedded(self):
+        # Moved away from the .so files, without --libpath. Not for
+        # make EMBED=0, which needs them.
+        fcdir = os.path.dirname(self.fcpath.split()[0])
+        if os.path.exists(os.path.join(fcdir, 'fluxcapacitor_test.so')):
+            return
+        tmp = tempfile.mkdtemp()
+        try:
+            shutil.copy(self.fcpath.split()[0], tmp)
+            self.do_system("%s/fluxcapacitor -- python2 -c "
+                           "'import time; time.sleep(60)'" % (tmp,))
+        finally:
+            shutil.rmtree(tmp)
+
+    @at_most(seconds=5)
+    def test_domains(self):
+        # A busy domain must not keep the other one from advancing.
+        self.system(' '.join(['sleep 120',
+                              '--domain --',
+                              "bash -c 'i=0; while [ $i -lt 100000 ]; "
+                              "do i=$((i+1)); done'"]))
+
+    @at_most(seconds=5)
+    def test_daemon(self):
+        sock = tempfile.mktemp(suffix=".sock")
+        daemon = subprocess.Popen("exec %s --daemon=%s" %
+                                  (self.fcpath, sock), shell=True)
+        try:
+            while not os.path.exists(sock):
+                time.sleep(0.01)
+            for i in range(3):
+                self.do_system("%s --submit=%s -- sleep 60" %
+                               (self.fcpath, sock))
+            self.do_system("%s --submit=%s -- bash -c 'exit 3'" %
+                           (self.fcpath, sock), returncode=3)
+            self.do_system("%s --submit=%s -- bash -c 'kill -TERM $$'" %
+                           (self.fcpath, sock), returncode=128 + 15)
+        finally:
+            daemon.terminate()
+            daemon.wait()
+
+    @at_most(seconds=5)
+    @savefile(suffix="py", text=fork_server_script)
+    def test_fork_server(self, filename=None):
+        sock = tempfile.mktemp(suffix=".sock")
+        daemon = subprocess.Popen("exec %s --daemon=%s --fork-server -- "
+                                  "python2 %s" % (self.fcpath, sock, filename),
+                                  shell=True)
+        try:
+            while not os.path.exists(sock):
+                time.sleep(0.01)
+            for i in range(3):
+                out = subprocess.check_output(
+                    "JOB=%i %s --submit=%s -- %i" %
+                    (i, self.fcpath, sock, 60 + i), shell=True)
+                self.assertEqual(out.split(), [str(60 + i), str(i)])
+        finally:
+            daemon.terminate()
+            daemon.wait()
+
+    @at_most(seconds=5)
+    @savefile(suffix="py", text=fork_queue_script)
+    def test_fork_server_queue(self, filename=None):
+        # More jobs than the socket to the template holds, before the
+        # template gets to the fork point. The environment goes with
+        # each job.
+        sock = tempfile.mktemp(suffix=".sock")
+        fifo = tempfile.mktemp()
+        os.mkfifo(fifo)
+        daemon = subprocess.Popen("exec %s --daemon=%s --fork-server -- "
+                                  "python2 %s %s" %
+                                  (self.fcpath, sock, filename, fifo),
+                                  shell=True)
+        try:
+            while not os.path.exists(sock):
+                time.sleep(0.01)
+            env = dict(os.environ, PADDING='x' * 64 * 1024)
+            jobs = [subprocess.Popen("%s --submit=%s -- %i" %
+                                     (self.fcpath, sock, 60 + i),
+                                     stdout=subprocess.PIPE, shell=True,
+                                     env=env)
+                    for i in range(16)]
+            time.sleep(0.5)
+            open(fifo, 'w').close()
+            outs = [job.communicate()[0].split() for job in jobs]
+            self.assertEqual([job.returncode for job in jobs], [0] * 16)
+            self.assertEqual([int(out[0]) for out in outs],
+                             range(60, 76))
+            # The copies that are done don't stay zombies.
+            template = int(outs[0][1])
+            for i in range(100):
+                if not zombies(template):
+                    break
+                time.sleep(0.01)
+            self.assertEqual(zombies(template), [])
+        finally:
+            daemon.terminate()
+            daemon.wait()
+            os.unlink(fifo)
+
+    @at_most(seconds=2)
+    def test_stats(self):
+        (fd, filename) = tempfile.mkstemp(suffix=".json")
+        os.close(fd)
+        try:
+            self.do_system("%s --stats=%s -- sleep 60" %
+                           (self.fcpath, filename))
+            stats = json.load(open(filename))
+            self.assertEqual(stats['advances'], 1)
+            assert stats['virtual_ns'] - stats['real_ns'] > 59 * 10**9
+            # Newer libcs sleep with clock_nanosleep(), skipped on
+            # entry: its exit is counted as 'other'.
+            stops = stats['stops']
+            assert (stops.get('nanosleep', 0) >= 2 or
+                    stops.get('clock_nanosleep', 0) >= 1)
+            # null without perf_event_open().
+            counters = stats['counters']
+            if counters is not None:
+                assert counters['stop_overhead_ns'] > 0
+                assert counters['tracees']['task_clock_ns'] > 0
+        finally:
+            os.unlink(filename)
+
+    @at_most(seconds=2)
+    def test_trace_out(self):
+        (fd, filename) = tempfile.mkstemp(suffix=".json")
+        os.close(fd)
+        # read() is syscall 0 on x86_64, its span must show too.
+        script = ("import os, select, socket, struct; "
+                  "a, b = socket.socketpair(); "
+                  "a.setsockopt(socket.SOL_SOCKET, socket.SO_RCVTIMEO, "
+                  "struct.pack('ll', 30, 0)); "
+                  "select.select([], [], [], 60)\n"
+                  "try: os.read(a.fileno(), 1)\n"
+                  "except OSError: pass")
+        try:
+            self.do_system("%s --trace-out=%s -- python2 -c \"%s\"" %
+                           (self.fcpath, filename, script))
+            events = json.load(open(filename))
+            spans = [e for e in events
+                     if e['ph'] == 'X' and e['cat'] == 'blocked']
+            names = [e['name'] for e in spans]
+            assert 'select' in names or 'pselect6' in names, names
+            assert 'read' in names, names
+            jumps = [e for e in events
+                     if e['ph'] == 'i' and e['name'].startswith('jump')]
+            self.assertEqual(len(jumps), 2)
+            assert sum(j['args']['speedup_ns'] for j in jumps) > 89 * 10**9
+        finally:
+            os.unlink(filename)
+
+    @at_most(seconds=3)
+    def test_until(self):
+        # A server blocked forever is stopped after two virtual
+        # weeks, with a checkpoint every day.
+        stdout = subprocess.check_output(
+            "%s --until=14d --checkpoint=1d:'echo day' -- python2 -c "
+            "'import select; select.select([],[],[])'" % (self.fcpath,),
+            shell=True)
+        self.assertEqual(stdout.split(), ['day'] * 13)
+
+    @at_most(seconds=3)
+    @savefile(suffix="py", text=ping_pong_script)
+    def test_latency(self, filename=None):
+        # 50ms each way.
+        out = subprocess.check_output(
+            "%s --latency=17541:50ms -- python2 %s 17541" %
+            (self.fcpath, filename), shell=True)
+        self.assertEqual(int(out), 100)
+
+    @at_most(seconds=2)
+    @savefile(suffix="py", text=latency_order_script)
+    def test_latency_order(self, filename=None):
+        out = subprocess.check_output(
+            "%s --latency=17544:50ms -- python2 %s 17544" %
+            (self.fcpath, filename), shell=True)
+        self.assertEqual(out.split(), ['abcdefg', '5'])
+
+    @at_most(seconds=2)
+    @savefile(suffix="py", text=socket_timeout_script)
+    def test_socket_timeout(self, filename=None):
+        out = subprocess.check_output("%s -- python2 %s" %
+                                      (self.fcpath, filename), shell=True)
+        self.assertEqual(int(out), 30)
+
+    @at_most(seconds=2)
+    def test_unshare(self):
+        # The port is ours outside, and free inside.
+        s = socket.socket()
+        s.bind(('127.0.0.1', 17543))
+        s.listen(1)
+        try:
+            out = subprocess.check_output(
+                "%s --unshare -- python2 -c 'import os, select, socket\n"
+                "socket.socket().bind((\"127.0.0.1\", 17543))\n"
+                "select.select([], [], [], 60)\n"
+                "print os.getpid()'" % (self.fcpath,), shell=True)
+            self.assertEqual(int(out), 2)
+        finally:
+            s.close()
+
+    @at_most(seconds=5)
+    def test_attach(self):
+        # Started without us, sped up for ten virtual minutes. Then
+        # detaching would put its clocks ten minutes back: we stay
+        # until it exits.
+        p = subprocess.Popen(
+            ["python2", "-u", "-c", "import select, sys, time\n"
+             "t0 = time.time()\n"
+             "while True:\n"
+             "    select.select([], [], [], 60)\n"
+             "    print int(time.time() - t0)"], stdout=subprocess.PIPE)
+        fc = None
+        try:
+            time.sleep(0.5)
+            fc = subprocess.Popen([self.fcpath, "-v", "--attach=%i" % p.pid,
+                                   "--until=10m"], stderr=subprocess.PIPE)
+            out = []
+            while not out or out[-1] < 540:
+                out.append(int(p.stdout.readline()))
+            time.sleep(0.5)
+            self.assertEqual(fc.poll(), None)
+        finally:
+            p.kill()
+            if fc:
+                err = fc.communicate()[1]
+        assert 'Not detaching' in err, err
+        self.assertEqual(fc.returncode, 0)
+
+    @at_most(seconds=10)
+    @compile(code='''
+    #include <pthread.h>
+    #include <time.h>
+    #include <unistd.h>
+    static void *run(void *arg) {
+        struct timespec ts;
+        while (1) {
+            clock_gettime(CLOCK_MONOTONIC, &ts);
+            time(NULL);
+        }
+        return NULL;
+    }
+    int main() {
+        pthread_t t;
+        int i;
+        for (i = 0; i < 4; i++)
+            pthread_create(&t, NULL, run, NULL);
+        pause();
+        return(0);
+    }''', flags='-pthread')
+    def test_attach_detach_busy(self, compiled=None):
+        # Threads in and out of the patched vDSO all along, detaching
+        # must not leave them in the middle of its code.
+        p = subprocess.Popen([compiled])
+        try:
+            time.sleep(0.2)
+            for i in range(5):
+                fc = subprocess.Popen([self.fcpath, "--attach=%i" % p.pid],
+                                      stderr=open(os.devnull, "w"))
+                time.sleep(0.3)
+                fc.terminate()
+                fc.wait()
+                time.sleep(0.2)
+                self.assertEqual(p.poll(), None)
+        finally:
+            if p.poll() is None:
+                p.kill()
+            p.wait()
+
+    @at_most(seconds=2)
+    @savefile(suffix="py", text=lockstep_script)
+    def test_lockstep(self, filename=None):
+        out = subprocess.check_output("%s --lockstep -- python2 %s" %
+                                      (self.fcpath, filename), shell=True)
+        self.assertEqual(int(out), 140)
+
+    @at_most(seconds=3)
+    def test_control(self):
+        sock = os.path.join(tempfile.mkdtemp(), 'control.sock')
+        p = subprocess.Popen(
+            "%s --until=1d --control=%s -- python2 -c "
+            "'import select\nwhile True: select.select([],[],[],60)'" %
+            (self.fcpath, sock), shell=True)
+        try:
+            while not os.path.exists(sock):
+                time.sleep(0.01)
+            s = socket.socket(socket.AF_UNIX)
+            s.connect(sock)
+            f = s.makefile('r+')
+            def command(line):
+                f.write(line + '\n')
+                f.flush()
+                return json.loads(f.readline())
+
+            self.assertEqual(command('pause'), {'ok': True})
+            t0 = command('status')['domains'][0]['virtual_ns']
+            # Crosses a deadline on the way.
+            self.assertEqual(command('advance 90s'), {'ok': True})
+            status = command('status')
+            assert status['paused']
+            t1 = status['domains'][0]['virtual_ns']
+            assert 90 * 10**9 <= t1 - t0 < 91 * 10**9
+            self.assertEqual(command('resume'), {'ok': True})
+            s.close()
+        finally:
+            self.assertEqual(p.wait(), 0)
+
+    @at_most(seconds=2)
+    def test_control_step_nowhere(self):
+        # Blocked on stdin, there's no deadline to step to.
+        sock = os.path.join(tempfile.mkdtemp(), 'control.sock')
+        p = subprocess.Popen(
+            "%s --control=%s -- python2 -c 'import sys; sys.stdin.read()'" %
+            (self.fcpath, sock), shell=True, stdin=subprocess.PIPE)
+        try:
+            while not os.path.exists(sock):
+                time.sleep(0.01)
+            s = socket.socket(socket.AF_UNIX)
+            s.connect(sock)
+            f = s.makefile('r+')
+            f.write('step\n')
+            f.flush()
+            self.assertEqual(json.loads(f.readline()),
+                             {'error': 'nothing to step to'})
+            s.close()
+        finally:
+            p.stdin.close()
+            self.assertEqual(p.wait(), 0)
+
+    @at_most(seconds=2)
+    def test_ring(self):
+        (fd, filename) = tempfile.mkstemp(suffix=".ring")
+        os.close(fd)
+        decode = os.path.join(os.path.dirname(self.fcpath.split()[0]),
+                              'fluxcapacitor-decode')
+        try:
+            # Arguments longer than a few records are logged whole.
+            long_arg = 'x' * 1000
+            self.do_system("%s -vv --ring=%s:1 -- python2 -c "
+                           "'import select; select.select([],[],[],60)' %s" %
+                           (self.fcpath, filename, long_arg))
+            out = subprocess.check_output([decode, filename])
+            assert 'by 60.000 sec' in out, out
+            assert 'Exiting with code 0. Speedup ' in out, out
+            assert long_arg + '\n' in out, out
+        finally:
+            os.unlink(filename)
+
+    @at_most(seconds=2)
+    @compile(code='''
+#include <stddef.h>
+#include <sys/select.h>
+static void wait_ms(int ms) {
+    struct timeval tv = {ms / 1000, (ms % 1000) * 1000};
+    select(0, NULL, NULL, NULL, &tv);
+}
+__attribute__((noinline)) static void backoff(void) {
+    int i;
+    for (i = 0; i < 8; i++)
+        wait_ms(100 << i);
+}
+__attribute__((noinline)) static void heartbeat(void) {
+    int i;
+    for (i = 0; i < 5; i++)
+        wait_ms(1000);
+}
+int main(void) {
+    backoff();
+    heartbeat();
+    return 0;
+}
+''', flags='-fno-omit-frame-pointer -fno-optimize-sibling-calls')
+    def test_profile(self, compiled=None):
+        if os.uname()[4] != "x86_64":
+            return
+        (fd, filename) = tempfile.mkstemp(suffix=".folded")
+        os.close(fd)
+        try:
+            self.do_system("%s --profile=%s -- %s" %
+                           (self.fcpath, filename, compiled))
+            skipped = {}
+            for line in open(filename):
+                (stack, us) = line.rsplit(' ', 1)
+                frames = stack.split(';')
+                if frames[-1] == '[skipped]':
+                    for f in ('backoff', 'heartbeat'):
+                        if f in frames:
+                            skipped[f] = skipped.get(f, 0) + int(us)
+            self.assertEqual(skipped, {'backoff': 25500000,
+                                       'heartbeat': 5000000})
+        finally:
+            os.unlink(filename)
+
+    @at_most(seconds=2)
+    @savefile(suffix="py", text=critical_path_script)
+    def test_critical_path(self, filename=None):
+        (fd, report) = tempfile.mkstemp(suffix=".txt")
+        os.close(fd)
+        try:
+            self.do_system("%s --critical-path=%s -- python2 %s" %
+                           (self.fcpath, report, filename))
+            out = open(report).read()
+            total = float(out.split()[2])
+            assert abs(total - 5.0) < 0.1, out
+            assert ' woken by ' in out, out
+            slack = out[out.index('Slack:'):].splitlines()[2:]
+            slacks = sorted(float(l.split()[-1]) for l in slack
+                            if 'python' in l)
+            self.assertEqual(len(slacks), 3)
+            assert slacks[:2] == [0.0, 0.0], out
+            assert abs(slacks[2] - 4.0) < 0.1, out
+        finally:
+            os.unlink(report)
+
     @at_most(seconds=3)
     def test_file_descriptor_leak(self):
         out = subprocess.check_output("ls /proc/self/fd", shell=True)